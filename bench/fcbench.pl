@@ -0,0 +1,162 @@
+#
+# This program runs FoodCalc on a set of standard scenarios and reports the lines read
+# per second and the peak memory for each step, so the speed of two versions of FoodCalc
+# or of two computers can be compared.
+#
+# This is a Perl program and requires that you have installed Perl at you computer.
+# Execute the program with:
+#    perl fcbench.pl [options]
+# The options are (with the default in parentheses):
+#    -x program   the FoodCalc program to run (foodcalc)
+#    -d dir       the directory with the data made by fcgen.pl (data)
+#    -g options   options for fcgen.pl, if it has to make the data ("")
+#    -n runs      no of times to run each scenario; the fastest run is reported (3)
+#    -s list      comma separated list of scenarios to run (all)
+#    -k depths    comma separated list of prefetch: depths for the prefetch scenario
+#                 (0,4,8,16)
+#
+# If the directory has no bench.fc file, fcgen.pl is run first to make the data, e.g.
+#    perl fcbench.pl -x ../src/foodcalc -g "-p 5000 -l 300"
+# The scenarios are:
+#    plain        calculation of each input line
+#    groupinput   group by: on input fields (person and day)
+#    groupfood    group by: on a food table field (person and food group)
+#    recipes      expanded recipes (ingredients: keep)
+#    cook         cook: and reduce field: on the nutrients
+#    where        where: with a simple test and a test on a calculated field
+#    binnative    bin-native input and output files
+#    prefetch     plain with prefetch:, run once for each depth given with -k and
+#                 reported as prefetch0, prefetch4, ...
+#    pipeline     plain with pipeline: 1024, reading, calculating and writing in
+#                 three threads
+# The food cache is not used, so every run also reads the foods, groups and recipes
+# files. For each scenario the commands file, the log and the timing file written with
+# the -t option of FoodCalc are left in the directory as <scenario>.fc, .log and .json.
+#
+
+use Getopt::Std;
+use Cwd;
+
+getopts('x:d:g:n:s:k:') || die "Unknown option\n";
+$foodcalc = defined($opt_x) ? $opt_x : "foodcalc";
+$dir = defined($opt_d) ? $opt_d : "data";
+$genOptions = defined($opt_g) ? $opt_g : "";
+$runs = defined($opt_n) ? $opt_n : 3;
+@depths = split(/,/,defined($opt_k) ? $opt_k : "0,4,8,16");
+@scenarios = ("plain","groupinput","groupfood","recipes","cook","where","binnative",
+	"prefetch","pipeline");
+@scenarios = split(/,/,$opt_s) if defined($opt_s);
+# the prefetch scenario is a scenario for each depth
+@scenarios = map {$_ eq "prefetch" ? (map {"prefetch$_"} @depths) : $_} @scenarios;
+
+# a program name with a directory is relative to where we are now, not to $dir
+$foodcalc = Cwd::abs_path($foodcalc) if $foodcalc =~ m{[/\\]};
+($genProgram = $0) =~ s/fcbench\.pl$/fcgen.pl/i;
+
+unless (-f "$dir/bench.fc") {
+	system("perl $genProgram -d $dir $genOptions") == 0 || die "Could not run $genProgram\n";
+}
+chdir($dir) || die "Could not change to $dir - $!";
+
+# find the no of nutrient and cook fields in the foods file
+open(FO,"<foods.txt") || die "Could not open foods.txt - $!";
+$header = <FO>;
+close(FO);
+$width = () = $header =~ /\bn\d+\b/g;
+$noCooks = () = $header =~ /\bcook\d+\b/g;
+open(IN,"<input.txt") || die "Could not open input.txt - $!";
+$header = <IN>;
+close(IN);
+$noText = () = $header =~ /\btext\d+\b/g;
+$text = $noText ? "text fields: " . join(", ",map {"text$_"} 1..$noText) . "\n" : "";
+$nutri = "n1--n" . ($width < 20 ? $width : 20);
+
+%commands = (
+	"plain" =>
+		"input: input.txt food gram\n" . $text .
+		"output fields: person, day, food, energy, n1, n2, n3\n",
+	"groupinput" =>
+		"input: input.txt food gram\n" . $text .
+		"group by: person, day\n" .
+		"output fields: person, day, energy, $nutri\n",
+	"groupfood" =>
+		"input: input.txt food gram\n" . $text .
+		"group by: person, grp\n" .
+		"output fields: person, grp, energy, gfat, $nutri\n",
+	"recipes" =>
+		"input: input.txt food gram\n" . $text .
+		"ingredients: keep\n" .
+		"output fields: person, day, food, energy, n1, n2, n3\n",
+	"cook" =>
+		"input: input.txt food gram\n" . $text .
+		join("",map {"cook: c$_ cook$_ $nutri\n"} 1..$noCooks) .
+		($noCooks ? "cook field: cook " . join(",",map {"c$_"} 1..$noCooks) . "\n" : "") .
+		"reduce field: red $nutri\n" .
+		"output fields: person, day, food, energy, $nutri\n",
+	"where" =>
+		"input: input.txt food gram\n" . $text .
+		"where: grp <= 25 and energy > 500\n" .
+		"output fields: person, day, food, energy, n1, n2, n3\n",
+	"binnative" =>
+		"input: input.bin food gram\n" .
+		"input format: bin-native\n" .
+		"input fields: person, day, food, gram, cook, red\n" .
+		"output format: bin-native\n" .
+		"output fields: person, day, food, energy, n1, n2, n3\n",
+	"pipeline" =>
+		"input: input.txt food gram\n" . $text .
+		"pipeline: 1024\n" .
+		"output fields: person, day, food, energy, n1, n2, n3\n",
+);
+for $depth (@depths) {
+	$commands{"prefetch$depth"} =
+		"input: input.txt food gram\n" . $text .
+		"prefetch: $depth\n" .
+		"output fields: person, day, food, energy, n1, n2, n3\n";
+}
+
+printf "%-12s %-20s %9s %9s %10s %10s %8s\n",
+	"scenario","step/file","wall s","cpu s","lines","lines/s","peak MB";
+for $scenario (@scenarios) {
+	die "Unknown scenario $scenario\n" unless defined($commands{$scenario});
+	open(FC,">$scenario.fc") || die "Could not open $scenario.fc - $!";
+	print FC "commands: bench.fc\n", "food cache: none\n", $commands{$scenario},
+		"output: $scenario.out\n";
+	close(FC);
+
+	# run it $runs times and keep the timings of the fastest run
+	$best = undef;
+	for (1..$runs) {
+		if (system("$foodcalc -v 25 -l $scenario.log -t $scenario.tmp $scenario.fc") != 0) {
+			print "$scenario: FoodCalc failed, see $dir/$scenario.log\n";
+			last;
+		}
+		open(JS,"<$scenario.tmp") || die "Could not open $scenario.tmp - $!";
+		@json = <JS>;
+		close(JS);
+		($wall) = join("",@json) =~ /"wall": ([\d.]+),/;
+		if (!defined($best) || $wall < $best) {
+			$best = $wall;
+			rename("$scenario.tmp","$scenario.json");
+		}
+	}
+	unlink("$scenario.tmp");
+	next unless defined($best);
+
+	# report the steps and files that read lines, and the total
+	open(JS,"<$scenario.json") || die "Could not open $scenario.json - $!";
+	$name = $scenario;
+	while (<JS>) {
+		if (/"step": "([^"]*)"(?:, "file": "([^"]*)")?, "wall": ([\d.]+), "cpu": ([\d.]+), "bytes": \d+, "lines": (\d+), "linesPerSec": (\d+), "peakRssKb": (\d+)/) {
+			next unless $5;
+			printf "%-12s %-20s %9.3f %9.3f %10d %10d %8.1f\n",
+				$name, defined($2) ? "  $2" : $1, $3, $4, $5, $6, $7/1024;
+			$name = "";
+		} elsif (/"wall": ([\d.]+), "cpu": ([\d.]+), "peakRssKb": (\d+)/) {
+			($totWall,$totCpu,$totRss) = ($1,$2,$3);
+		}
+	}
+	close(JS);
+	printf "%-12s %-20s %9.3f %9.3f %10s %10s %8.1f\n",
+		$name, "total", $totWall, $totCpu, "", "", $totRss/1024;
+}
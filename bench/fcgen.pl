@@ -0,0 +1,157 @@
+#
+# This program writes a synthetic food table and intake data for benchmarking FoodCalc.
+# The files are made from a fixed random number generator, so the same options always
+# give exactly the same files, on any computer.
+#
+# This is a Perl program and requires that you have installed Perl at you computer.
+# Execute the program with:
+#    perl fcgen.pl [options]
+# The options are (with the default in parentheses):
+#    -d dir       the directory to write the files in (data)
+#    -f foods     no of foods in the foods file (2000)
+#    -w width     no of nutrient fields in the foods file, n1, n2, ... (100)
+#    -z zeros     fraction of the nutrient fields n2, n3, ... which are zero (0.4)
+#    -g groups    no of groups in the groups file (50)
+#    -r recipes   no of recipes in the recipes file (500)
+#    -n nesting   no of levels of recipes used as ingredients in other recipes (2)
+#    -p persons   no of persons in the input file (2000)
+#    -l lines     no of lines per person in the input file (200)
+#    -c cooks     no of cook types, and reduce fields in the foods file (3)
+#    -t text      no of text fields in the foods and input files (2)
+#    -s seed      the seed of the random number generator (1)
+#
+# It will write the following files in the directory:
+#    foods.txt    the foods file with the fields foodid, grp, name1.., cook1.., n1..
+#    groups.txt   the groups file with the fields grp, gname, gfat, gfib
+#    recipes.txt  the recipes file with the fields rid, fid, gram, rname. Recipes of
+#                 level 2 and up also have recipes of lower levels as ingredients
+#    input.txt    the input file with the fields person, day, food, gram, cook, red,
+#                 text1.. sorted on person and day. Some of the foods are recipes
+#    input.bin    the same input without the text fields as a bin-native file
+#    bench.fc     a commands file with the foods, groups and recipes files
+#
+# fcbench.pl runs this program to make its data, and then runs FoodCalc on it.
+#
+
+use Getopt::Std;
+
+getopts('d:f:w:z:g:r:n:p:l:c:t:s:') || die "Unknown option\n";
+$dir = defined($opt_d) ? $opt_d : "data";
+$noFoods = defined($opt_f) ? $opt_f : 2000;
+$width = defined($opt_w) ? $opt_w : 100;
+$zeros = defined($opt_z) ? $opt_z : 0.4;
+$noGroups = defined($opt_g) ? $opt_g : 50;
+$noRecipes = defined($opt_r) ? $opt_r : 500;
+$nesting = defined($opt_n) ? $opt_n : 2;
+$noPersons = defined($opt_p) ? $opt_p : 2000;
+$noLines = defined($opt_l) ? $opt_l : 200;
+$noCooks = defined($opt_c) ? $opt_c : 3;
+$noText = defined($opt_t) ? $opt_t : 2;
+$seed = defined($opt_s) ? $opt_s : 1;
+
+die "There must be at least 3 nutrient fields\n" if $width < 3;
+die "There must be at least one food and one group\n" if $noFoods < 1 || $noGroups < 1;
+$seed = $seed % 2147483647;
+$seed = 1 if $seed <= 0;
+$recipeBase = 100000; # recipe ids are $recipeBase+1, $recipeBase+2, ...
+
+mkdir($dir,0777) unless -d $dir;
+
+# the minimal standard random number generator (Park and Miller). all products are
+# less than 2**53, so it gives the same numbers with any Perl
+sub rnd {
+	$seed = ($seed * 16807) % 2147483647;
+	return $seed / 2147483647;
+}
+sub rndInt { # an integer from $_[0] to $_[1]
+	return $_[0] + int(rnd() * ($_[1] - $_[0] + 1));
+}
+sub rndText { # a text value with a blank and maybe a comma in it
+	return '"' . ("abc","def,gh","ijk lmn","op")[rndInt(0,3)] . " " . rndInt(1,999) . '"';
+}
+
+# the foods file
+open(FO,">$dir/foods.txt") || die "Could not open $dir/foods.txt - $!";
+print FO join(",","foodid","grp",(map {"name$_"} 1..$noText),(map {"cook$_"} 1..$noCooks),
+	(map {"n$_"} 1..$width)), "\n";
+for $food (1..$noFoods) {
+	@line = ($food,rndInt(1,$noGroups));
+	push(@line,rndText()) for 1..$noText;
+	push(@line,rnd() < 0.3 ? 0 : sprintf("%.2f",rnd()*0.4)) for 1..$noCooks;
+	# n1 is never zero, so no recipe has a weight of zero
+	push(@line,sprintf("%.3f",0.001+rnd()*50));
+	push(@line,rnd() < $zeros ? 0 : sprintf("%.3f",rnd()*50)) for 2..$width;
+	print FO join(",",@line), "\n";
+}
+close(FO);
+
+# the groups file
+open(GR,">$dir/groups.txt") || die "Could not open $dir/groups.txt - $!";
+print GR "grp,gname,gfat,gfib\n";
+for $group (1..$noGroups) {
+	printf GR "%d,\"group %d\",%.3f,%.3f\n", $group, $group, rnd(), rnd();
+}
+close(GR);
+
+# the recipes file. the recipes are split in $nesting levels; a recipe of level 1 has
+# only foods as ingredients, a recipe of a higher level also has recipes of the levels
+# before it. a recipe is always written after its ingredients
+open(RE,">$dir/recipes.txt") || die "Could not open $dir/recipes.txt - $!";
+print RE "rid,fid,gram,rname\n";
+$nesting = 1 if $nesting < 1;
+$perLevel = int(($noRecipes + $nesting - 1) / $nesting);
+for $recipe (1..$noRecipes) {
+	$level = int(($recipe - 1) / $perLevel) + 1;
+	for (1..rndInt(2,6)) {
+		if ($level > 1 && rnd() < 0.3) {
+			$fid = $recipeBase + rndInt(1,($level - 1) * $perLevel);
+		} else {
+			$fid = rndInt(1,$noFoods);
+		}
+		printf RE "%d,%d,%d,\"recipe %d\"\n", $recipeBase + $recipe, $fid, rndInt(5,250), $recipe;
+	}
+}
+close(RE);
+
+# the input files
+open(IN,">$dir/input.txt") || die "Could not open $dir/input.txt - $!";
+open(BIN,">$dir/input.bin") || die "Could not open $dir/input.bin - $!";
+binmode(BIN);
+print IN join(",","person","day","food","gram","cook","red",(map {"text$_"} 1..$noText)), "\n";
+for $person (1..$noPersons) {
+	$day = 1;
+	for $line (1..$noLines) {
+		$day++ if rnd() < 0.1;
+		if ($noRecipes && rnd() < 0.15) {
+			$food = $recipeBase + rndInt(1,$noRecipes);
+			$cook = 0; # recipes can not be cooked
+		} else {
+			$food = rndInt(1,$noFoods);
+			$cook = rnd() < 0.5 ? 0 : rndInt(1,$noCooks);
+		}
+		@line = ($person,$day,$food,rndInt(1,400),$cook,rnd() < 0.8 ? 0 : 0.1);
+		print BIN pack("d*",@line);
+		push(@line,rndText()) for 1..$noText;
+		print IN join(",",@line), "\n";
+	}
+}
+close(IN);
+close(BIN);
+
+# the commands file
+open(FC,">$dir/bench.fc") || die "Could not open $dir/bench.fc - $!";
+print FC "; made by fcgen.pl\n";
+print FC "foods: foods.txt foodid\n";
+print FC "groups: groups.txt grp\n";
+print FC "recipes: recipes.txt rid fid gram\n" if $noRecipes;
+@text = ((map {"name$_"} 1..$noText),"gname");
+push(@text,"rname") if $noRecipes;
+print FC "text fields: ", join(", ",@text), "\n";
+print FC "set: energy = 17*n1 + 37*n2 + 17*n3\n";
+print FC "set: weight = n1 + n2 + n3\n";
+print FC "food weight: 100 weight\n";
+close(FC);
+
+print "Wrote foods, groups, recipes and input files to $dir: ",
+	"$noFoods foods, $noGroups groups, $noRecipes recipes, ",
+	$noPersons*$noLines, " input lines.\n";
@@ -87,6 +87,66 @@
 					Allow more than one id field in groups files.
 					Allow grouping on any number of input and food table fields.
 					New keepx argument to ingredients: command.
+  v. 1.4  (not yet released)
+					Where: tests on calculated fields only calculate the fields
+					needed by the tests before testing; the rest is calculated only
+					for used lines.
+					Fix bug: numbers in where: tests on calculated fields were never
+					set.
+					New input where: command to select lines in the input file.
+					Fields in data files that are not used are skipped without being
+					converted to numbers.
+					Fix bug: a bad character after a number in a data file was taken
+					as a separator.
+					New prefetch: command to read ahead in the input file and prefetch
+					the food table rows.
+					New food profile: command to place the most used foods together
+					in memory.
+					Fix memory overruns in where: parsing and in recipes files with
+					ingredients: keep.
+					New save file format that is mapped into memory by -s, with the
+					food table in one block and a checksum. Save files from earlier
+					versions can not be read.
+					Fix bugs in reading save files with where: tests or weight reduce
+					fields.
+					The food table is cached in a file and read from it when the foods,
+					groups and recipes files and the commands are unchanged. New food
+					cache: command.
+					New -d and -j options to serve jobs on a unix socket.
+					The compiled calculations are split in a plan, which is not
+					changed by a run, and a context for each run, so more runs can
+					use the same plan and food table at the same time.
+					FoodCalc can be compiled as a library (see FoodCalc.h), where
+					a program pushes input lines and gets the output lines back.
+					New output block: command to compute more outputs, each with
+					its own output fields, group by and where, in one run.
+					New rollup: command to write coarser groups of the group by:
+					groups to more output files. The last group is now also
+					output when only one input line was calculated.
+					New summary output: command to write the mean, standard
+					deviation and percentiles of the output fields instead of the
+					output lines.
+					New pipeline: command to read, calculate and write in three
+					threads.
+					More foods and groups files are read at the same time.
+					The time of each step is logged, and new -t option to write
+					it to a JSON file.
+					Counters of lookups, tests, cooking, reductions and groups
+					are logged.
+					Hashes mix the bits of the keys and grow with the no of
+					entries. Their chains are logged with verbosity 70.
+					New progress: command to write the progress of the run as JSON
+					lines to a file or file descriptor.
+					The commands and syntax trees, and the food table, are allocated
+					from arenas of big blocks.
+					Food rows with at most half of the nutrient fields non-zero are
+					calculated and grouped from their non-zero fields only.
+					New usda foods: command to read the files of the USDA Nutrient
+					Database directly.
+					New long foods: command to read foods files with a line for
+					each value of a food.
+					New code fields: command for id and group fields with values
+					that are not numbers.
 
 */
 
@@ -98,13 +158,86 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
+#include <math.h>
+#include <setjmp.h>
+#include "FoodCalc.h"
+
+
+/* prefetch(p) hints the CPU to load the memory at p into the cache. it does nothing
+   if the compiler has no way to say this */
+#if defined(__GNUC__)
+#define prefetch(p) __builtin_prefetch(p)
+#else
+#define prefetch(p)
+#endif
+
+/* threadLocal makes a global variable have one copy per thread. it is used for the
+   state of the current file, so runs of foodCalc() in different threads can each
+   read their own input file */
+#if defined(__GNUC__)
+#define threadLocal __thread
+#elif defined(_MSC_VER)
+#define threadLocal __declspec(thread)
+#else
+#define threadLocal
+#endif
+
+/* on unix the save file is mapped into memory with mmap(), and the -d option is
+   available */
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+/* with gcc on unix the pipeline: command runs foodCalc() in three threads, and more
+   groups and foods files are read at the same time */
+#if defined(HAVE_POSIX) && defined(__GNUC__)
+#define HAVE_PIPELINE
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* once a thread has been started, getc() and putc() lock the file in every call. a
+   file is only read or written by one thread at a time, so on unix the files are read
+   and written with the versions that do not lock */
+#if defined(HAVE_POSIX)
+#define fileGetc(f) getc_unlocked(f)
+#define filePutc(c,f) putc_unlocked((c),(f))
+#else
+#define fileGetc(f) getc(f)
+#define filePutc(c,f) putc((c),(f))
+#endif
+
+/* counters of a run that the progress: thread reads while the run counts. the
+   relaxed atomics tell the compiler (and the thread sanitizer) that another thread
+   reads them. each counter has only one thread that counts it, so countInc() is a
+   load and a store, not a locked add */
+#if defined(HAVE_PIPELINE)
+#define countInc(x) __atomic_store_n(&(x),__atomic_load_n(&(x),__ATOMIC_RELAXED)+1,__ATOMIC_RELAXED)
+#define countSet(x,v) __atomic_store_n(&(x),(v),__ATOMIC_RELAXED)
+#define countGet(x) __atomic_load_n(&(x),__ATOMIC_RELAXED)
+#else
+#define countInc(x) (++(x))
+#define countSet(x,v) ((x) = (v))
+#define countGet(x) (x)
+#endif
 
 
 /* the name and current version of the program. You should increase programMinor
    or programMajor with any new release of the program. */
 char* program = "FoodCalc";
 int programMajor = 1;
-int programMinor = 3;
+int programMinor = 4;
 
 
 
@@ -152,7 +285,16 @@ CmdDef decimalPointDef = {"decimal point",optional,single,1,1,&decimalPointCmd,d
 
 Cmd* foodsCmd = NULL;
 ArgType foodsArgs[] = {strArg/*filename*/,strArg/*id field*/,chArg/*sep char*/,chArg/*decPoint char*/};
-CmdDef foodsDef = {"foods",required,multiple,4,1,&foodsCmd,foodsArgs};
+CmdDef foodsDef = {"foods",optional,multiple,4,1,&foodsCmd,foodsArgs};
+
+Cmd* usdaFoodsCmd = NULL;
+ArgType usdaFoodsArgs[] = {strArg/*directory*/};
+CmdDef usdaFoodsDef = {"usda foods",optional,multiple,1,1,&usdaFoodsCmd,usdaFoodsArgs};
+
+Cmd* longFoodsCmd = NULL;
+ArgType longFoodsArgs[] = {strArg/*filename*/,strArg/*food id field*/,strArg/*nutrient id field*/,
+						   strArg/*value field*/,chArg/*sep char*/,chArg/*decPoint char*/};
+CmdDef longFoodsDef = {"long foods",optional,multiple,6,4,&longFoodsCmd,longFoodsArgs};
 
 Cmd* commandsCmd = NULL;
 ArgType commandsArgs[] = {strArg/*filename*/};
@@ -290,10 +432,18 @@ Cmd* whereCmd = NULL;
 ArgType whereArgs[] = {whereArg/*bool exp*/};
 CmdDef whereDef = {"where",optional,single,1,1,&whereCmd,whereArgs};
 
+Cmd* inputWhereCmd = NULL;
+ArgType inputWhereArgs[] = {whereArg/*bool exp*/};
+CmdDef inputWhereDef = {"input where",optional,single,1,1,&inputWhereCmd,inputWhereArgs};
+
 Cmd* inputStarFieldsCmd = NULL;
 ArgType inputStarFieldsArgs[] = {listArg/*field list*/};
 CmdDef inputStarFieldsDef = {"input *fields",optional,single,1,1,&inputStarFieldsCmd,inputStarFieldsArgs};
 
+Cmd* codeFieldsCmd = NULL;
+ArgType codeFieldsArgs[] = {listArg/*field list*/};
+CmdDef codeFieldsDef = {"code fields",optional,multiple,1,1,&codeFieldsCmd,codeFieldsArgs};
+
 Cmd* textFieldsCmd = NULL;
 ArgType textFieldsArgs[] = {listArg/*field list*/};
 CmdDef textFieldsDef = {"text fields",optional,multiple,1,1,&textFieldsCmd,textFieldsArgs};
@@ -306,21 +456,57 @@ Cmd* verbosityCmd = NULL;
 ArgType verbosityArgs[] = {numArg/*level*/};
 CmdDef verbosityDef = {"verbosity",optional,single,1,1,&verbosityCmd,verbosityArgs};
 
+Cmd* foodProfileCmd = NULL;
+ArgType foodProfileArgs[] = {strArg/*file name*/};
+CmdDef foodProfileDef = {"food profile",optional,single,1,1,&foodProfileCmd,foodProfileArgs};
+
+Cmd* foodCacheCmd = NULL;
+ArgType foodCacheArgs[] = {strArg/*file name|none*/};
+CmdDef foodCacheDef = {"food cache",optional,single,1,1,&foodCacheCmd,foodCacheArgs};
+
+Cmd* prefetchCmd = NULL;
+ArgType prefetchArgs[] = {numArg/*no lines*/};
+CmdDef prefetchDef = {"prefetch",optional,single,1,1,&prefetchCmd,prefetchArgs};
+
+Cmd* pipelineCmd = NULL;
+ArgType pipelineArgs[] = {numArg/*no lines*/};
+CmdDef pipelineDef = {"pipeline",optional,single,1,1,&pipelineCmd,pipelineArgs};
+
 Cmd* transposeCmd = NULL;
 ArgType transposeArgs[] = {strArg/*field name*/,numArg/*no*/,listArg/*field list*/};
 CmdDef transposeDef = {"transpose",optional,multiple,3,3,&transposeCmd,transposeArgs};
 
+/* the output:, output format:, output fields:, group by: and where: commands after
+   an output block: command are read into the block, see beginOutputBlock() */
+Cmd* outputBlockCmd = NULL;
+ArgType outputBlockArgs[] = {strArg/*block name*/};
+CmdDef outputBlockDef = {"output block",optional,multiple,1,1,&outputBlockCmd,outputBlockArgs};
+
+Cmd* rollupCmd = NULL;
+ArgType rollupArgs[] = {strArg/*file name*/,listArg/*field list*/};
+CmdDef rollupDef = {"rollup",optional,multiple,2,1,&rollupCmd,rollupArgs};
+
+Cmd* summaryOutputCmd = NULL;
+ArgType summaryOutputArgs[] = {strArg/*stratify field*/};
+CmdDef summaryOutputDef = {"summary output",optional,single,1,0,&summaryOutputCmd,summaryOutputArgs};
+
+Cmd* progressCmd = NULL;
+ArgType progressArgs[] = {strArg/*file name|descriptor*/,numArg/*seconds*/};
+CmdDef progressDef = {"progress",optional,single,2,1,&progressCmd,progressArgs};
+
 
 /* a list of all command definitions: */
-CmdDef* cmdDefs[] = {&logDef,&decimalPointDef,&foodsDef,&commandsDef,&separatorDef,
+CmdDef* cmdDefs[] = {&logDef,&decimalPointDef,&foodsDef,&usdaFoodsDef,&longFoodsDef,&commandsDef,&separatorDef,
 	&groupsDef,&cookDef,&inputDef,&inputFieldsDef,&inputScaleDef,
 	&cookFieldDef,&reducFieldDef,&outputDef,&outputFieldsDef,&groupByDef,
 	&noCalcFieldsDef,&calculateDef,&recipesDef,&recipeSumDef,&ingredientsDef,
 	&inputFormatDef,&outputFormatDef,&saveDef,&blipDef,&idDef,&ifNotDef,
-	&inputStarFieldsDef,&textFieldsDef,&commentDef,&recipeWeightReducFieldDef,
+	&inputStarFieldsDef,&textFieldsDef,&codeFieldsDef,&commentDef,&recipeWeightReducFieldDef,
 	&foodWeightDef,&recipeReducFieldDef,&weightReducFieldDef,&weightCookDef,
 	&nonEdibleFieldDef,&verbosityDef,&transposeDef,&setDef,&recipeSetDef,&whereDef,
-	&groupSetDef,NULL};
+	&groupSetDef,&inputWhereDef,&prefetchDef,
+	&foodProfileDef,&foodCacheDef,&outputBlockDef,&rollupDef,
+	&summaryOutputDef,&pipelineDef,&progressDef,NULL};
 
 
 
@@ -332,7 +518,9 @@ char* mainCommandsName;		/* name of the main commands file - set by main() */
 char* logFileName = NULL;	/* name of the log file - set by openLog() or get() */
 char logName[300];			
 FILE* logFile = NULL;		/* the log file */
-int errors = 0;				/* number of errors so far - incrementet by error() */
+threadLocal int errors = 0;	/* number of errors so far - incrementet by error() */
+threadLocal jmp_buf* abortJump = NULL; /* if set, abortAndExit() jumps here (library) */
+char abortMessage[200];		/* the message of the last abortAndExit() (for -d) */
 int verbosity = 0;			/* current verbosity level */
 
 
@@ -412,6 +600,12 @@ void abortAndExit(char* str, ...) {
 		vfprintf(logFile,str,va);
 		fprintf(logFile,"ABORTED!\n");
 	}
+#if defined(HAVE_POSIX)
+	va_start(va,str);
+	vsnprintf(abortMessage,sizeof(abortMessage),str,va);
+	va_end(va);
+#endif
+	if (abortJump) longjmp(*abortJump,1);
 	exit(1);
 }
 
@@ -489,60 +683,226 @@ void* allocStr(char* str, int len) {
 }
 
 
+/* an arena hands out memory from big blocks, for the many small structures which are
+   never freed one by one. there is an arena for the commands and the syntax and
+   semantic trees made from them, one for the food table (entries, rows and hash
+   entries), and a scratch arena for the buffers of a step, which is reset when the
+   step is done. an arena must only be used by one thread at a time */
+typedef union {double d; long l; void* p;} ArenaAlign;
+typedef struct ArenaBlock_ {
+	struct ArenaBlock_* next;
+	ArenaAlign data[1];		/* the memory of the block */
+} ArenaBlock;
+typedef struct {
+	char* name;				/* what the arena is for (in the log) */
+	ArenaBlock* blocks;		/* the blocks, the current first */
+	char* p;				/* the free memory in the current block */
+	char* end;				/* the end of the current block, or NULL if none */
+	long noBlocks;			/* no of blocks allocated */
+	size_t bytes;			/* no of bytes handed out */
+} Arena;
+
+Arena treeArena = {"commands",NULL,NULL,NULL,0,0};
+Arena foodArena = {"food table",NULL,NULL,NULL,0,0};
+Arena scratchArena = {"scratch",NULL,NULL,NULL,0,0};
+
+#define arenaBlockSize 65536	/* bytes in a block, bigger allocations get their own */
+
+/* alloc a number of bytes in the arena (with no initialization) */
+void* arenaAlloc(Arena* arena, size_t size) {
+	void* p;
+	size = (size + sizeof(ArenaAlign) - 1) / sizeof(ArenaAlign) * sizeof(ArenaAlign);
+	arena->bytes += size;
+	if ((size_t)(arena->end - arena->p) < size) {
+		ArenaBlock* block;
+		arena->noBlocks++;
+		if (size > arenaBlockSize/4) {
+			/* a big one gets a block of its own after the current block, so the
+			   rest of the current block is still used */
+			block = alloc(sizeof(ArenaBlock)+size);
+			if (arena->blocks) {
+				block->next = arena->blocks->next;
+				arena->blocks->next = block;
+			} else {
+				block->next = NULL;
+				arena->blocks = block;
+			}
+			return(block->data);
+		}
+		block = alloc(sizeof(ArenaBlock)+arenaBlockSize);
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->p = (char*)block->data;
+		arena->end = arena->p + arenaBlockSize;
+	}
+	p = arena->p;
+	arena->p += size;
+	return(p);
+}
+
+/* allocate memory for a structure in the arena (with no initialization) */
+#define arenaStruct(arena,Type) arenaAlloc(arena,sizeof(Type))
+
+/* allocate an array of elements in the arena (initialized with zeros) */
+void* arenaArray(Arena* arena, size_t num, size_t size) {
+	void* p = arenaAlloc(arena,num*size);
+	memset(p,0,num*size);
+	return(p);
+}
+
+/* copy a string to the arena */
+char* arenaStr(Arena* arena, char* str, int len) {
+	char* p = arenaAlloc(arena,len+1);
+	memcpy(p,str,len+1);
+	return(p);
+}
+
+/* free all the memory of the arena but the current block, which is used again */
+void resetArena(Arena* arena) {
+	ArenaBlock* block = arena->blocks;
+	if (arena->end) block = block->next; /* the first block is the current */
+	while (block) {
+		ArenaBlock* next = block->next;
+		free(block);
+		arena->noBlocks--;
+		block = next;
+	}
+	if (arena->end) {
+		arena->blocks->next = NULL;
+		arena->p = (char*)arena->blocks->data;
+	} else {
+		arena->blocks = NULL;
+	}
+	arena->bytes = 0;
+}
+
+
 
 /****************************************************************************/
 /*** Utility types and functions to handle integer based hashes */
 
 
+/* the tables of the hashes have a power of 2 chains, and the keys are mixed so all
+   bits of a key are used to pick the chain. when a hash gets more entries than chains
+   the table is doubled, so the size of the table follows the no of entries */
+
 typedef struct _HashIntEntry {
 	void* value; 
 	struct _HashIntEntry* next;
 	int key[1]; 
 } HashIntEntry;
 
-typedef struct {
-	int size;				/* no entries in the table */
+typedef struct _HashInt {
+	int size;				/* no chains in the table (a power of 2) */
 	int noKeys;				/* no keys */
 	int entrySize;			/* size of HashIntEntry with noKeys keys */
+	int noEntries;			/* no entries in the hash */
 	HashIntEntry** table;	/* the table proper */
+	char* name;				/* what the hash is used for (in the hash statistics) */
+	Arena* arena;			/* the arena of the entries */
+	struct _HashInt* next;	/* next in the list of all int hashes */
 } HashInt;
 
+HashInt* hashInts = NULL;	/* all int hashes, for the hash statistics */
 
-/* allocate and initialize a new hash */
-HashInt* newHashInt(int size/* should be prime!*/) {
-	HashInt* hash = allocStruct(HashInt);
-	hash->size = size;
-	hash->noKeys = 1;
-	hash->entrySize = sizeof(HashIntEntry);
-	hash->table = allocarray(size,sizeof(HashIntEntry*));
-	return(hash);
+
+/* mix the bits of a key (the finalizer of MurmurHash3) */
+unsigned int hashMix(unsigned int h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return(h);
+}
+
+/* the smallest power of 2 which is at least size (and at least 8) */
+int hashSize(int size) {
+	int n = 8;
+	while (n < size && n < 0x40000000) n <<= 1;
+	return(n);
 }
-HashInt* newHashIntN(int size/* should be prime!*/, int noKeys) {
+
+
+/* allocate and initialize a new hash. size is the no of entries expected */
+HashInt* newHashIntN(int size, int noKeys, char* name) {
 	HashInt* hash = allocStruct(HashInt);
-	hash->size = size;
+	hash->size = hashSize(size);
 	hash->noKeys = noKeys;
 	hash->entrySize = sizeof(HashIntEntry)+(noKeys-1)*sizeof(int);
-	hash->table = allocarray(size,sizeof(HashIntEntry*));
+	hash->noEntries = 0;
+	hash->table = allocarray(hash->size,sizeof(HashIntEntry*));
+	hash->name = name;
+	hash->arena = &treeArena;
+	hash->next = hashInts;
+	hashInts = hash;
 	return(hash);
 }
+#define newHashInt(size,name) newHashIntN(size,1,name)
 
 
+/* calculate hash index from key (one or more int's) */
+#define hashIntIndex(hash,key) (hashMix((unsigned int)(key)) & ((hash)->size-1))
 #define hashIntKey(hkey,key) { \
 	int i = 0; \
-	hkey = 0; \
-	while (i < hash->noKeys) hkey = (hkey << 10) + key[i++]; \
-	hkey %= hash->size; \
-}
+	unsigned int h = 0; \
+	while (i < hash->noKeys) h = hashMix(h + (unsigned int)key[i++]); \
+	hkey = h & (hash->size-1); \
+}
+
+
+/* double the table of the hash. the entries are kept in the same order in the
+   chains, so entries with the same key are found in the same order as before */
+void growHashInt(HashInt* hash) {
+	int oldSize = hash->size;
+	HashIntEntry** oldTable = hash->table;
+	HashIntEntry** tails;
+	int n;
+	hash->size *= 2;
+	hash->table = allocarray(hash->size,sizeof(HashIntEntry*));
+	tails = alloc(hash->size*sizeof(HashIntEntry*));
+	for (n = 0; n < hash->size; n++) tails[n] = NULL;
+	for (n = 0; n < oldSize; n++) {
+		HashIntEntry* entry = oldTable[n];
+		while (entry) {
+			HashIntEntry* next = entry->next;
+			int hkey;
+			int* key = entry->key;
+			hashIntKey(hkey,key);
+			entry->next = NULL;
+			if (tails[hkey]) tails[hkey]->next = entry;
+			else hash->table[hkey] = entry;
+			tails[hkey] = entry;
+			entry = next;
+		}
+	}
+	free(tails);
+	free(oldTable);
+}
+#define countHashInt(hash) {if (++hash->noEntries > hash->size) growHashInt(hash);}
+
 
 /* look up an entry by key and return a pointer to the value or NULL if not found */
 void* lookInt(HashInt* hash, int key) {
-	HashIntEntry* entry = hash->table[key % hash->size];
+	HashIntEntry* entry = hash->table[hashIntIndex(hash,key)];
 	while (entry) {
 		if (key == entry->key[0]) return(entry->value);
 		entry = entry->next;
 	}
 	return(NULL);
 }
+/* like lookInt(), but adds the no of entries looked at to *steps */
+void* lookIntCount(HashInt* hash, int key, long* steps) {
+	HashIntEntry* entry = hash->table[hashIntIndex(hash,key)];
+	long n = 0;
+	while (entry) {
+		n++;
+		if (key == entry->key[0]) {*steps += n; return(entry->value);}
+		entry = entry->next;
+	}
+	*steps += n;
+	return(NULL);
+}
 void* lookIntN(HashInt* hash, int* key) {
 	int hkey;
 	HashIntEntry* entry;
@@ -560,50 +920,54 @@ void* lookIntN(HashInt* hash, int* key) {
 
 /* insert an entry (key and value) into the hash */
 void insertInt(HashInt* hash, int key, void* value) {
-	int hkey = key % hash->size;
-	HashIntEntry* entry = allocStruct(HashIntEntry);
+	int hkey = hashIntIndex(hash,key);
+	HashIntEntry* entry = arenaStruct(hash->arena,HashIntEntry);
 	entry->key[0] = key;
 	entry->value = value;
 	entry->next = hash->table[hkey];
 	hash->table[hkey] = entry;
+	countHashInt(hash);
 }
 void insertIntN(HashInt* hash, int* key, void* value) {
 	int hkey;
 	int i;
 	HashIntEntry* entry;
 	hashIntKey(hkey,key);
-	entry = alloc(hash->entrySize);
+	entry = arenaAlloc(hash->arena,hash->entrySize);
 	for (i = 0; i < hash->noKeys; i++) entry->key[i] = key[i];
 	entry->value = value;
 	entry->next = hash->table[hkey];
 	hash->table[hkey] = entry;
+	countHashInt(hash);
 }
 
 
 /* first look up an entry by key. If found the value of the entry is return, otherwise
    a new entry (key and value) is inseted into the hash */
 void* lookInsertInt(HashInt* hash, int key, void* value) {
-	int hkey = key % hash->size;
+	int hkey = hashIntIndex(hash,key);
 	HashIntEntry* entry;
 	if (entry = hash->table[hkey]) {
 		while(1) {
 			if (entry->key[0] == key) return(entry->value);
 			if (!entry->next) {
-				HashIntEntry* entry2 = allocStruct(HashIntEntry);
+				HashIntEntry* entry2 = arenaStruct(hash->arena,HashIntEntry);
 				entry2->key[0] = key;
 				entry2->value = value;
 				entry2->next = NULL;
 				entry->next = entry2;
+				countHashInt(hash);
 				return(NULL);
 			}
 			entry = entry->next;
 		};
 	} else {
-		entry = allocStruct(HashIntEntry);
+		entry = arenaStruct(hash->arena,HashIntEntry);
 		entry->key[0] = key;
 		entry->value = value;
 		entry->next = NULL;
 		hash->table[hkey] = entry;
+		countHashInt(hash);
 		return(NULL);
 	}
 }
@@ -625,30 +989,66 @@ typedef struct _HashStrEntry {
 	struct _HashStrEntry* next;
 } HashStrEntry;
 
-typedef struct {int size; HashStrEntry** table;} HashStr;
+typedef struct _HashStr {
+	int size;				/* no chains in the table (a power of 2) */
+	int noEntries;			/* no entries in the hash */
+	HashStrEntry** table;	/* the table proper */
+	char* name;				/* what the hash is used for (in the hash statistics) */
+	Arena* arena;			/* the arena of the entries */
+	struct _HashStr* next;	/* next in the list of all string hashes */
+} HashStr;
+
+HashStr* hashStrs = NULL;	/* all string hashes, for the hash statistics */
 
 
-/* allocate and initialize a new hash */
-HashStr* newHashStr(int size/* should be prime!*/) {
+/* allocate and initialize a new hash. size is the no of entries expected */
+HashStr* newHashStr(int size, char* name) {
 	HashStr* hash = allocStruct(HashStr);
-	hash->size = size;
-	hash->table = allocarray(size,sizeof(HashStrEntry*));
+	hash->size = hashSize(size);
+	hash->noEntries = 0;
+	hash->table = allocarray(hash->size,sizeof(HashStrEntry*));
+	hash->name = name;
+	hash->arena = &treeArena;
+	hash->next = hashStrs;
+	hashStrs = hash;
 	return(hash);
 }
 
 
-/* calculate hash index from key (a string) */
-/* this is not a good algorithm. should be changed! */
+/* calculate hash index from key (a string) with FNV-1a, and mix the bits */
 #define hashStrKey(hkey,key) { \
-	char* k = key; \
-	int i = 0; \
-	hkey = 0; \
-	while (*k) { \
-		hkey += *k++ << (i++ << 3); \
-		if (i >= sizeof(int)) i = 0; \
-	} \
-	hkey = abs(hkey); \
-	hkey %= hash->size; \
+	unsigned char* k = (unsigned char*)(key); \
+	unsigned int h = 2166136261U; \
+	while (*k) h = (h ^ *k++) * 16777619U; \
+	hkey = hashMix(h) & (hash->size-1); \
+}
+
+
+/* double the table of the hash, keeping the order of the entries in the chains */
+void growHashStr(HashStr* hash) {
+	int oldSize = hash->size;
+	HashStrEntry** oldTable = hash->table;
+	HashStrEntry** tails;
+	int n;
+	hash->size *= 2;
+	hash->table = allocarray(hash->size,sizeof(HashStrEntry*));
+	tails = alloc(hash->size*sizeof(HashStrEntry*));
+	for (n = 0; n < hash->size; n++) tails[n] = NULL;
+	for (n = 0; n < oldSize; n++) {
+		HashStrEntry* entry = oldTable[n];
+		while (entry) {
+			HashStrEntry* next = entry->next;
+			int hkey;
+			hashStrKey(hkey,entry->key);
+			entry->next = NULL;
+			if (tails[hkey]) tails[hkey]->next = entry;
+			else hash->table[hkey] = entry;
+			tails[hkey] = entry;
+			entry = next;
+		}
+	}
+	free(tails);
+	free(oldTable);
 }
 
 
@@ -669,7 +1069,7 @@ void* lookStr(HashStr* hash, char* key) {
 /* insert an entry (key and value) into the hash */
 void insertStr(HashStr* hash, char* key, void* value) {
 	int hkey;
-	HashStrEntry* entry = allocStruct(HashStrEntry);
+	HashStrEntry* entry = arenaStruct(hash->arena,HashStrEntry);
 	entry->key = key;
 	entry->value = value;
 	entry->next = NULL;
@@ -680,10 +1080,187 @@ void insertStr(HashStr* hash, char* key, void* value) {
 		while (e->next) e = e->next;
 		e->next = entry;
 	}
+	if (++hash->noEntries > hash->size) growHashStr(hash);
+}
+
+
+
+/****************************************************************************/
+/*** Codes. The values of a code field are strings, like alphanumeric food codes.
+     Each different string read in any code field gets a dense no 1, 2, 3, ... the
+     first time it is read, and this no is the value of the field. So the food table,
+     the groups and the recipes work with codes just as with numbers. An empty string
+     is 0. The names are kept in blocks which are never moved, so codeName() can be
+     used without a lock while another thread adds codes. */
+
+#define codeBlockSize 4096		/* no of names in a block */
+#define codeMaxBlocks 16384		/* max no of blocks, so there can be 64M codes */
+char** codeBlocks[codeMaxBlocks]; /* the blocks with the names of the codes */
+int noCodes = 0;				/* no of codes */
+int* codeTable = NULL;			/* the hash of the codes: the no of a code, or 0 */
+unsigned int codeMask = 0;		/* size of codeTable - 1 */
+char* codePool = NULL;			/* room for more names */
+int codePoolLeft = 0;			/* no of chars left in codePool */
+#ifdef HAVE_PIPELINE
+/* the staging threads and the input thread of a pipeline may add codes */
+pthread_mutex_t codeMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* the name of code no */
+#define codeName(no) (codeBlocks[((no)-1)/codeBlockSize][((no)-1)%codeBlockSize])
+
+/* the hash of a name, FNV-1a with the bits mixed as for string hashes */
+unsigned int codeHash(char* name) {
+	unsigned char* k = (unsigned char*)name;
+	unsigned int h = 2166136261U;
+	while (*k) h = (h ^ *k++) * 16777619U;
+	return(hashMix(h));
+}
+
+/* double the table of the codes (or make it the first time) */
+void growCodes() {
+	int no;
+	codeMask = codeMask ? 2*codeMask+1 : 1023;
+	free(codeTable);
+	codeTable = allocarray(codeMask+1,sizeof(int));
+	for (no = 1; no <= noCodes; no++) {
+		unsigned int i = codeHash(codeName(no)) & codeMask;
+		while (codeTable[i]) i = (i+1) & codeMask;
+		codeTable[i] = no;
+	}
+}
+
+/* the no of the code with the name. a name not seen before gets the next no */
+int codeNo(char* name) {
+	unsigned int h, i;
+	int no;
+	if (!*name) return(0);
+	h = codeHash(name);
+#ifdef HAVE_PIPELINE
+	pthread_mutex_lock(&codeMutex);
+#endif
+	if (!codeTable) growCodes();
+	i = h & codeMask;
+	while ((no = codeTable[i]) && strcmp(codeName(no),name) != 0) i = (i+1) & codeMask;
+	if (!no) { /* a new code */
+		int len = strlen(name)+1;
+		if (noCodes == codeMaxBlocks*codeBlockSize) abortAndExit("Too many codes!\n");
+		if (noCodes % codeBlockSize == 0)
+			codeBlocks[noCodes/codeBlockSize] = alloc(codeBlockSize*sizeof(char*));
+		if (len > codePoolLeft) {
+			codePoolLeft = (len > 65536 ? len : 65536);
+			codePool = alloc(codePoolLeft);
+		}
+		memcpy(codePool,name,len);
+		no = ++noCodes;
+		codeName(no) = codePool;
+		codePool += len;
+		codePoolLeft -= len;
+		codeTable[i] = no;
+		if (2*(unsigned int)noCodes > codeMask) growCodes(); /* half full */
+	}
+#ifdef HAVE_PIPELINE
+	pthread_mutex_unlock(&codeMutex);
+#endif
+	return(no);
+}
+
+
+
+/* utility functions used to log the chains of a hash: the no of entries and chains,
+   the load factor, the no of chains with 0, 1, 2, 3, 4, 5-8 and 9 or more entries,
+   the longest chain and the mean no of entries looked at to find an entry */
+#define hashChainClass(n) ((n) <= 4 ? (n) : (n) <= 8 ? 5 : 6)
+void logHashRow(char* name, long noEntries, long noChains, long* hist, long max, double probes) {
+	logmsg("%-20.20s %8ld %8ld %5.2f %7ld %6ld %5ld %5ld %5ld %5ld %5ld %4ld %6.2f\n",
+		name ? name : "",noEntries,noChains,noChains ? (double)noEntries/noChains : 0.0,
+		hist[0],hist[1],hist[2],hist[3],hist[4],hist[5],hist[6],max,
+		noEntries ? probes/noEntries : 0.0);
+}
+void logHashChains(char* name, int size, int* lens) {
+	long hist[7];
+	long noEntries = 0;
+	double probes = 0.0;
+	long max = 0;
+	int i;
+	for (i = 0; i < 7; i++) hist[i] = 0;
+	for (i = 0; i < size; i++) {
+		int n = lens[i];
+		noEntries += n;
+		probes += n*(n+1)/2.0;
+		if (n > max) max = n;
+		hist[hashChainClass(n)]++;
+	}
+	logHashRow(name,noEntries,size,hist,max,probes);
+}
+void logHashHeader() {
+	logmsg("%-20s %8s %8s %5s %7s %6s %5s %5s %5s %5s %5s %4s %6s\n",
+		"hash","entries","chains","load","empty","1","2","3","4","5-8","9+","max","probes");
+}
+
+void logHashIntChains(HashInt* hash) {
+	int* lens = alloc(hash->size*sizeof(int));
+	int n;
+	for (n = 0; n < hash->size; n++) {
+		HashIntEntry* entry = hash->table[n];
+		lens[n] = 0;
+		while (entry) {lens[n]++; entry = entry->next;}
+	}
+	logHashChains(hash->name,hash->size,lens);
+	free(lens);
+}
+
+/* log the chains of all the hashes made. it is done with verbosity 70 or more */
+void logHashStats() {
+	HashInt* hashInt = hashInts;
+	HashStr* hashStr = hashStrs;
+	if (verbosity < 70) return;
+	logmsg("Hashes:\n");
+	logHashHeader();
+	while (hashInt) {
+		logHashIntChains(hashInt);
+		hashInt = hashInt->next;
+	}
+	while (hashStr) {
+		int* lens = alloc(hashStr->size*sizeof(int));
+		int n;
+		for (n = 0; n < hashStr->size; n++) {
+			HashStrEntry* entry = hashStr->table[n];
+			lens[n] = 0;
+			while (entry) {lens[n]++; entry = entry->next;}
+		}
+		logHashChains(hashStr->name,hashStr->size,lens);
+		free(lens);
+		hashStr = hashStr->next;
+	}
+	if (noCodes) { /* the chain of a code is the codes with the same place in the table */
+		int* lens = allocarray(codeMask+1,sizeof(int));
+		int no;
+		for (no = 1; no <= noCodes; no++) lens[codeHash(codeName(no)) & codeMask]++;
+		logHashChains("codes",codeMask+1,lens);
+		free(lens);
+	}
+	logmsg("\n");
+}
+
+
+/* log the memory of the arenas. it is done with verbosity 70 or more */
+void logArenas() {
+	Arena* arenas[3];
+	int i;
+	if (verbosity < 70) return;
+	arenas[0] = &treeArena; arenas[1] = &foodArena; arenas[2] = &scratchArena;
+	logmsg("Arenas:\n");
+	logmsg("%-20s %12s %8s\n","arena","bytes","blocks");
+	for (i = 0; i < 3; i++)
+		logmsg("%-20s %12lu %8ld\n",arenas[i]->name,(unsigned long)arenas[i]->bytes,
+			arenas[i]->noBlocks);
+	logmsg("\n");
 }
 
 
 
+
 /****************************************************************************/
 /*** Types, variables and functions for handling of input files */
 
@@ -707,15 +1284,15 @@ typedef struct {
 	int ch;				/* the last character read - the utility functions uses one read ahead */
 } File;
 
-/* the current file: */
-FILE* currentFile;
-char* currentFileName;
-FileType currentType;
-char separator;
-char decimalPoint;
-char comment;
-int lineNo;
-int ch;
+/* the current file (one for each thread): */
+threadLocal FILE* currentFile;
+threadLocal char* currentFileName;
+threadLocal FileType currentType;
+threadLocal char separator;
+threadLocal char decimalPoint;
+threadLocal char comment;
+threadLocal int lineNo;
+threadLocal int ch;
 
 
 /* set a file as current */
@@ -758,7 +1335,7 @@ int initFile(File* file, char* name, FileType type, char* mode,
 	file->decimalPoint = decimalPoint;
 	file->comment = comment;
 	file->lineNo = 1;
-	if ((file->ch = getc(file->file)) == EOF) file->ch = '\n';
+	if ((file->ch = fileGetc(file->file)) == EOF) file->ch = '\n';
 	return(1);
 }
 
@@ -774,15 +1351,15 @@ void fileError(char* str) {
 
 
 #define maxStrLen 2048
-char str[maxStrLen];		/* temporary storage for strings read */
-char strLen;				/* length of string in str */
-Num num;					/* temporary storage for number read */
+threadLocal char str[maxStrLen];	/* temporary storage for strings read */
+threadLocal char strLen;			/* length of string in str */
+threadLocal Num num;				/* temporary storage for number read */
 
 /* save the last read string in new memory */
-#define saveStr() allocStr(str,strLen)
+#define saveStr() arenaStr(&treeArena,str,strLen)
 
 /* get next char. return \n if eof */
-#define getch() ( ((ch = getc(currentFile)) == EOF) ? (ch = '\n') : (ch) )
+#define getch() ( ((ch = fileGetc(currentFile)) == EOF) ? (ch = '\n') : (ch) )
 
 /* unget last char */
 #define ungetch() ungetc(ch,currentFile)
@@ -1158,6 +1735,167 @@ void getSym() { /* get next symbol from current line */
 
 
 
+/****************************************************************************/
+/*** Timing of the steps and of the files read in them. The timings are logged as a
+     table at the end of the log, and written to a JSON file with the -t option. */
+
+
+char* timingFileName = NULL;	/* the JSON file of the -t option, or NULL */
+double timingStart;				/* wall time when FoodCalc started */
+
+typedef struct Timing_ {
+	char* name;			/* the name of the step or file */
+	int isFile;			/* 1 if it is a file read in the step before it */
+	double wall;		/* seconds it took */
+	double cpu;			/* cpu seconds used by all threads */
+	long bytes;			/* bytes read, or 0 */
+	long lines;			/* lines read, or 0 */
+	long rss;			/* peak resident memory in kB when done, or 0 if not known */
+	struct Timing_* next;
+} Timing;
+Chain(Timing, TimingChain);
+TimingChain timings;	/* all timings in the order they were started */
+
+
+/* the wall time in seconds */
+double wallTime() {
+#if defined(HAVE_POSIX)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return(t.tv_sec + t.tv_nsec/1e9);
+#else
+	return((double)time(NULL));
+#endif
+}
+
+
+/* the cpu time in seconds used by the process */
+double cpuTime() {
+	return((double)clock()/CLOCKS_PER_SEC);
+}
+
+
+/* the cpu time in seconds used by the calling thread */
+double threadCpuTime() {
+#if defined(HAVE_POSIX)
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&t);
+	return(t.tv_sec + t.tv_nsec/1e9);
+#else
+	return(cpuTime());
+#endif
+}
+
+
+/* the peak resident memory of the process in kB, or 0 if not known */
+long peakRss() {
+#if defined(HAVE_POSIX)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF,&usage) != 0) return(0);
+#if defined(__APPLE__)
+	return(usage.ru_maxrss/1024); /* in bytes on mac */
+#else
+	return(usage.ru_maxrss);
+#endif
+#else
+	return(0);
+#endif
+}
+
+
+/* the no of bytes read so far from the current file, or 0 if not known */
+long currentBytes() {
+	long pos = ftell(currentFile);
+	return(pos < 0 ? 0 : pos);
+}
+
+
+/* start timing a step or a file read in a step */
+Timing* startTiming(char* name, int isFile) {
+	Timing* timing = allocarray(1,sizeof(Timing));
+	timing->name = name;
+	timing->isFile = isFile;
+	timing->wall = -wallTime();
+	timing->cpu = -cpuTime();
+	link(timings,timing);
+	endlink(timings);
+	return(timing);
+}
+
+
+/* end timing a step or file */
+void endTiming(Timing* timing, long bytes, long lines) {
+	timing->wall += wallTime();
+	timing->cpu += cpuTime();
+	timing->bytes = bytes;
+	timing->lines = lines;
+	timing->rss = peakRss();
+}
+
+
+/* write a string as a JSON string */
+void writeJsonStr(FILE* file, char* str) {
+	fputc('"',file);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') fprintf(file,"\\%c",*str);
+		else if ((unsigned char)*str < ' ') fprintf(file,"\\u%04x",*str);
+		else fputc(*str,file);
+	}
+	fputc('"',file);
+}
+
+
+/* log the timings as a table, and write them to the -t file if it is used */
+void reportTimings() {
+	Timing* timing = timings.first;
+	char* step = "";
+
+	logmsg("Timing:\n");
+	logmsg("%-30s %9s %9s %9s %10s %10s %8s\n",
+		"step/file","wall s","cpu s","MB read","lines","lines/s","peak MB");
+	for (; timing; timing = timing->next) {
+		if (!timing->lines) /* nothing read */
+			logmsg("%-30s %9.3f %9.3f %9s %10s %10s %8.1f\n",timing->name,
+				timing->wall,timing->cpu,"","","",timing->rss/1024.0);
+		else
+			logmsg("%s%-*s %9.3f %9.3f %9.2f %10ld %10.0f %8.1f\n",
+				timing->isFile ? "  " : "",timing->isFile ? 28 : 30,timing->name,
+				timing->wall,timing->cpu,timing->bytes/1048576.0,timing->lines,
+				timing->wall > 0 ? timing->lines/timing->wall : 0.0,timing->rss/1024.0);
+	}
+	logmsg("%-30s %9.3f %9.3f %9s %10s %10s %8.1f\n\n",
+		"total",wallTime()-timingStart,cpuTime(),"","","",peakRss()/1024.0);
+
+	if (timingFileName) {
+		FILE* file = fopen(timingFileName,"w");
+		if (!file) {
+			error("Could not open timing file %s.\n",timingFileName);
+			return;
+		}
+		fprintf(file,"{\"program\": \"%s\", \"version\": \"%d.%d\",\n",
+			program,programMajor,programMinor);
+		fprintf(file," \"wall\": %.6f, \"cpu\": %.6f, \"peakRssKb\": %ld,\n \"steps\": [",
+			wallTime()-timingStart,cpuTime(),peakRss());
+		for (timing = timings.first; timing; timing = timing->next) {
+			if (!timing->isFile) step = timing->name;
+			fprintf(file,"%s\n  {\"step\": ",timing == timings.first ? "" : ",");
+			writeJsonStr(file,step);
+			if (timing->isFile) {
+				fprintf(file,", \"file\": ");
+				writeJsonStr(file,timing->name);
+			}
+			fprintf(file,", \"wall\": %.6f, \"cpu\": %.6f, \"bytes\": %ld, \"lines\": %ld,"
+				" \"linesPerSec\": %.0f, \"peakRssKb\": %ld}",
+				timing->wall,timing->cpu,timing->bytes,timing->lines,
+				timing->wall > 0 ? timing->lines/timing->wall : 0.0,timing->rss);
+		}
+		fprintf(file,"\n ]}\n");
+		fclose(file);
+	}
+}
+
+
+
 /****************************************************************************/
 /* functions for reading and optimizing expressions with the following EBNF 
    LL(1) syntax:
@@ -1223,7 +1961,7 @@ void linkExp(Exp* e, Num* c, ExpVal* v) {
 void optExp(Exp* e, Num* c, int neg) {
 	Exp* e1 = pExp1();
 	if (e1->no > 1) {
-		ExpVal* v = allocStruct(ExpVal);
+		ExpVal* v = arenaStruct(&treeArena,ExpVal);
 		v->neg = neg;
 		v->recip = 0;
 		v->type = expVal;
@@ -1247,7 +1985,7 @@ void optExp(Exp* e, Num* c, int neg) {
 }
 
 Exp* pExp() {	/* Exp  ::= Exp1 { ("+"|"-") Exp1 } */
-	Exp* e = allocStruct(Exp);
+	Exp* e = arenaStruct(&treeArena,Exp);
 	Num c = 0.0;
 	nolink(*e);
 	optExp(e,&c,0);
@@ -1257,7 +1995,7 @@ Exp* pExp() {	/* Exp  ::= Exp1 { ("+"|"-") Exp1 } */
 		optExp(e,&c,neg);
 	}
 	if (c != 0.0 || !e->no || e->first->neg) {
-		ExpVal* cv = allocStruct(ExpVal);
+		ExpVal* cv = arenaStruct(&treeArena,ExpVal);
 		cv->neg = 0; cv->recip = 0; cv->type = numVal; cv->u.num = c;
 		if (e->no && e->first->neg) {
 			link2(*e,cv);
@@ -1307,7 +2045,7 @@ void optExp1(Exp* e1, Num* c, int recip) {
 }
 
 Exp* pExp1() { /* Exp1 ::= Exp2 { ("*"|"/") Exp2 } */
-	Exp* e1 = allocStruct(Exp);
+	Exp* e1 = arenaStruct(&treeArena,Exp);
 	Num c = 1.0;
 	nolink(*e1);
 	optExp1(e1,&c,0);
@@ -1319,7 +2057,7 @@ Exp* pExp1() { /* Exp1 ::= Exp2 { ("*"|"/") Exp2 } */
 	if (c == -1.0 && e1->no == 1) {
 		e1->first->neg = 1;
 	} else if (c != 1.0 || !e1->no || e1->first->recip) {
-		ExpVal* cv1 = allocStruct(ExpVal);
+		ExpVal* cv1 = arenaStruct(&treeArena,ExpVal);
 		cv1->neg = 0; cv1->recip = 0; cv1->type = numVal; cv1->u.num = c;
 		if (e1->no && e1->first->recip) {
 			link2(*e1,cv1);
@@ -1332,7 +2070,7 @@ Exp* pExp1() { /* Exp1 ::= Exp2 { ("*"|"/") Exp2 } */
 }
 
 ExpVal* pExp2() { /* Exp2 ::= [-] ( Num | Field | "(" Exp ")" ) */
-	ExpVal* v1 = allocStruct(ExpVal);
+	ExpVal* v1 = arenaStruct(&treeArena,ExpVal);
 	v1->recip = v1->neg = 0;
 	if (sym == subSym) {
 		v1->neg = 1;
@@ -1472,7 +2210,7 @@ void linkLexp(Lexp* l, LexpVal* v) {
 void optLexp(Lexp* l, int not) {
 	Lexp* l1 = pLexp1(not);
 	if (l1->no > 1) {
-		LexpVal* v = allocStruct(ExpVal);
+		LexpVal* v = arenaStruct(&treeArena,LexpVal);
 		v->type = lexpVal;
 		v->u.lexp = l1;
 		linkLexp(l,v);
@@ -1492,7 +2230,7 @@ void optLexp(Lexp* l, int not) {
 }
 
 Lexp* pLexp(int not) { /* Lexp  ::= Lexp1 { "or" Lexp1} */
-	Lexp* l = allocStruct(Lexp);
+	Lexp* l = arenaStruct(&treeArena,Lexp);
 	nolink(*l);
 	optLexp(l,not);
 	while (sym == orSym) {
@@ -1526,7 +2264,7 @@ void optLexp1(Lexp* l1, int not) {
 }
 
 Lexp* pLexp1(int not) { /* Lexp1 ::= Lexp2 { "and" Lexp2} */
-	Lexp* l1 = allocStruct(Lexp);
+	Lexp* l1 = arenaStruct(&treeArena,Lexp);
 	nolink(*l1);
 	optLexp1(l1,not);
 	while (sym == andSym) {
@@ -1558,8 +2296,8 @@ LexpVal* and2or(LexpVal* v1) {
 		if (l->no == 1) {
 			return(l->first);
 		} else {
-			Lexp* l1 = allocStruct(Lexp);
-			LexpVal* v = allocStruct(LexpVal);
+			Lexp* l1 = arenaStruct(&treeArena,Lexp);
+			LexpVal* v = arenaStruct(&treeArena,LexpVal);
 			nolink(*l1);
 			link(*l1,v1);
 			endlink(*l1);
@@ -1576,7 +2314,7 @@ forward void pLexp2gt(LexpVal* v1, int not, LexpOp op, LVal* e);
 forward void pLexp2in(LexpVal* v1, int not, LVal* e);
 
 LexpVal* pLexp2(int not) {
-	LexpVal* v1 = allocStruct(ExpVal);
+	LexpVal* v1 = arenaStruct(&treeArena,LexpVal);
 	int lnot = 0;
 	if (sym == notSym) {
 		lnot = 1;
@@ -1617,7 +2355,7 @@ void setRelVal(LexpVal* v1, LexpOp op, LVal* e1, LVal* e2) {
 }
 
 void linkRelVal(Lexp* l1, LexpOp op, LVal* e1, LVal* e2) {
-	LexpVal* v1 = allocStruct(LexpVal);
+	LexpVal* v1 = arenaStruct(&treeArena,LexpVal);
 	setRelVal(v1,op,e1,e2);
 	link(*l1,v1);
 }
@@ -1627,8 +2365,8 @@ void pLexp2eq(LexpVal* v1, int not, LexpOp op, LVal* e)  {
 }
 
 void setAnd(LexpVal* v1, Lexp* l) {
-	LexpVal* vx = allocStruct(LexpVal);
-	Lexp* lx = allocStruct(Lexp);
+	LexpVal* vx = arenaStruct(&treeArena,LexpVal);
+	Lexp* lx = arenaStruct(&treeArena,Lexp);
 	vx->type = lexpVal;
 	vx->u.lexp = l;
 	nolink(*lx);
@@ -1643,7 +2381,7 @@ void pLexp2lt(LexpVal* v1, int not, LexpOp op, LVal* e) {
 	if (sym != ltSym) {
 		setRelVal(v1,notOp(not,op),e,e2);
 	} else {
-		Lexp* l1 = allocStruct(Lexp);
+		Lexp* l1 = arenaStruct(&treeArena,Lexp);
 		LexpOp op2 = ltOp;
 		getSym(); if (sym == eqSym) {getSym(); op2 = leOp;}
 		nolink(*l1);
@@ -1659,7 +2397,7 @@ void pLexp2gt(LexpVal* v1, int not, LexpOp op, LVal* e) {
 	if (sym != gtSym) {
 		setRelVal(v1,notOp(not,op),e,e2);
 	} else {
-		Lexp* l1 = allocStruct(Lexp);
+		Lexp* l1 = arenaStruct(&treeArena,Lexp);
 		LexpOp op2 = gtOp;
 		getSym(); if (sym == eqSym) {getSym(); op2 = geOp;}
 		nolink(*l1);
@@ -1671,7 +2409,7 @@ void pLexp2gt(LexpVal* v1, int not, LexpOp op, LVal* e) {
 }
 
 void pLexp2in(LexpVal* v1, int not, LVal* e) {
-	Lexp* l = allocStruct(Lexp);
+	Lexp* l = arenaStruct(&treeArena,Lexp);
 	if (sym != inSym) errorSym("in");
 	getSym(); if (sym != lparSym) errorSym("(");
 	nolink(*l);
@@ -1694,7 +2432,7 @@ void pLexp2in(LexpVal* v1, int not, LVal* e) {
 }
 
 LVal* pLVal() {
-	LVal* e = allocStruct(LVal);
+	LVal* e = arenaStruct(&treeArena,LVal);
 	if (sym == subSym) {
 		getSym();
 		if (sym != numSym) {
@@ -1798,7 +2536,7 @@ HashStr* commandsHash;
 /* initializes the hash. Should be called before readCommands() is called! */
 void commandsHashInit() {
 	CmdDef** p = cmdDefs;
-	commandsHash = newHashStr(89);
+	commandsHash = newHashStr(64,"commands");
 	while (*p) {
 		insertStr(commandsHash,(*p)->name,*p);
 		p++;
@@ -1807,6 +2545,46 @@ void commandsHashInit() {
 }
 
 
+/* an output block: command starts a block of commands for an extra output from the
+   same run. The output:, output format:, output fields:, group by: and where: commands
+   after it (until the next output block: command or the end of the commands file) are
+   read into the OutputBlockCmds of the block instead of into the usual Cmd's */
+typedef struct OutputBlockCmds_ {
+	char* name;				/* the name of the block */
+	Cmd* outputCmd;
+	Cmd* outputFormatCmd;
+	Cmd* outputFieldsCmd;
+	Cmd* groupByCmd;
+	Cmd* whereCmd;
+	struct OutputBlockCmds_* next;
+} OutputBlockCmds;
+Chain(OutputBlockCmds,OutputBlockCmdsChain);
+OutputBlockCmdsChain outputBlockCmds = {NULL,NULL,0};
+
+/* start a new output block. the CmdDefs of the commands in a block are changed to
+   read into the block */
+void beginOutputBlock(char* name) {
+	OutputBlockCmds* block = allocarray(1,sizeof(OutputBlockCmds));
+	block->name = name;
+	link(outputBlockCmds,block);
+	endlink(outputBlockCmds);
+	outputDef.cmd = &block->outputCmd;
+	outputFormatDef.cmd = &block->outputFormatCmd;
+	outputFieldsDef.cmd = &block->outputFieldsCmd;
+	groupByDef.cmd = &block->groupByCmd;
+	whereDef.cmd = &block->whereCmd;
+}
+
+/* end the current output block (if any) */
+void endOutputBlock() {
+	outputDef.cmd = &outputCmd;
+	outputFormatDef.cmd = &outputFormatCmd;
+	outputFieldsDef.cmd = &outputFieldsCmd;
+	groupByDef.cmd = &groupByCmd;
+	whereDef.cmd = &whereCmd;
+}
+
+
 /* read all commands from a commands file. It will read commands acording to the
    syntax defined in the CmdDef's defined ealier. The result will be syntax trees
    in the Cmd's also defined ealier. */
@@ -1918,9 +2696,9 @@ void readCommands(File* file) {
 			{cmdError("Too few arguments",cmdDef->name); goto cmderr;}
 		do {args[argno++] = NULL;} while (argno <= cmdDef->numArgs);
 		
-		cmd = allocStruct(Cmd);
+		cmd = arenaStruct(&treeArena,Cmd);
 		cmd->next = NULL;
-		cmd->args = cmdArgs = alloc(argno*sizeof(char*));
+		cmd->args = cmdArgs = arenaAlloc(&treeArena,argno*sizeof(char*));
 		do {argno--; cmdArgs[argno] = args[argno];} while (argno);
 		if (!*(cmdDef->cmd)) {
 			*(cmdDef->cmd) = cmd;
@@ -1929,11 +2707,13 @@ void readCommands(File* file) {
 			while (p->next) p = p->next;
 			p->next = cmd;
 		}
+		if (cmdDef == &outputBlockDef) beginOutputBlock(cmd->args[0]);
 
 		noCommands++;
 cmderr:	skipLine();
 
 	}
+	endOutputBlock();
 	closeCurrent();
 	logmsg("Read %d commands from file %s.\n",noCommands,currentFileName);
 }
@@ -1968,13 +2748,14 @@ typedef struct Field_ {
 	int fromPos;	/* 0 if not to be in food table, otherwise position in food table (first=1) */
 	int onlyRecipe;	/* 1 if only to be output if calulating recipes, 0 otherwise */
 	int text;		/* 1 if text field (= comment field), 0 otherwise */
+	int code;		/* 1 if code field, 0 otherwise */
 	struct Field_* next; /* the next field in the file */
 } Field;
 Chain(Field,FieldChain);
 
 /* allocate a new field */
 Field* allocField(char* name) {
-	Field* field = allocStruct(Field);
+	Field* field = arenaStruct(&treeArena,Field);
 	field->name = name;
 	field->toPos = 0;
 	field->noCalc = 0;
@@ -1982,11 +2763,12 @@ Field* allocField(char* name) {
 	field->fromPos = 0;
 	field->onlyRecipe = 0;
 	field->text = 0;
+	field->code = 0;
 	return(field);
 }
 int noTempFields = 0;
 Field* allocTempField() {
-	char* name = alloc(8);
+	char* name = arenaAlloc(&treeArena,8);
 	sprintf(name,"temp%d",++noTempFields);
 	return(allocField(name));
 }
@@ -2000,7 +2782,7 @@ Chain(FieldP,FieldPChain);
 
 /* allocate a new FieldP */
 FieldP* allocFieldP(Field* field) {
-	FieldP* fieldP = allocStruct(FieldP);
+	FieldP* fieldP = arenaStruct(&treeArena,FieldP);
 	fieldP->field = field;
 	return(fieldP);
 }
@@ -2012,6 +2794,23 @@ typedef enum {formatText,formatTextNoHead,formatBinNative} FileFormat;
 int saveBin;			/* one if save: used */
 char* saveFileName = NULL;/* name of save file if saveBin is one */
 
+/** -d and -j options */
+char* serverSocketName = NULL;/* name of the socket to serve jobs on, or NULL */
+int serverWorkers = 4;	/* max no of jobs done at the same time */
+
+/** the library (FoodCalc.h) */
+int library = 0;		/* one if fcLoad() is used instead of main() */
+
+/** food profile: command */
+char* profileFileName = NULL;/* name of the food profile file, or NULL */
+
+/** progress: command */
+char* progressFileName = NULL;/* file name or descriptor to write progress to, or NULL */
+int progressSeconds = 5;	/* seconds between the progress lines */
+
+/** food cache: command */
+char* cacheFileName = NULL;/* name of the food cache file, or NULL if no cache */
+
 /** input:, input fields:, input format:, input scale: commands */
 char* inputFileName = NULL;/* the name of the input file */
 char inputSep;			/* seperator for input file */
@@ -2046,9 +2845,9 @@ typedef struct Constant_ {
 Chain(Constant,ConstantChain);
 ConstantChain constants;
 Field* allocConstant(Num num) {
-	Constant* constant = allocStruct(Constant);
+	Constant* constant = arenaStruct(&treeArena,Constant);
 	Field* field;
-	char* cname = alloc(11);
+	char* cname = arenaAlloc(&treeArena,11);
 	sprintf(cname,"%10.2f",num);
 	constant->num = num;
 	constant->field = field = allocField(cname);
@@ -2067,7 +2866,7 @@ typedef struct SetOper_ {
 	struct SetOper_* next;
 } SetOper;
 SetOper* allocOper(SetOp op, Field* field) {
-	SetOper* oper = allocStruct(SetOper);
+	SetOper* oper = arenaStruct(&treeArena,SetOper);
 	oper->op = op;
 	oper->field = field;
 	return(oper);
@@ -2079,7 +2878,7 @@ typedef struct Set_ {
 	struct Set_* next;
 } Set;
 Set* allocSet(Field* field) {
-	Set* set = allocStruct(Set);
+	Set* set = arenaStruct(&treeArena,Set);
 	set->field = field;
 	nolink(set->opers);
 	return(set);
@@ -2156,7 +2955,7 @@ typedef struct Test_ {	/* a single test */
 	struct Test_* next;
 } Test;
 Test* allocTest(LexpOp op, Field* field1, Field* field2) {
-	Test* test = allocStruct(Test);
+	Test* test = arenaStruct(&treeArena,Test);
 	test->op = op;
 	test->field1 = field1;
 	test->field2 = field2;
@@ -2168,13 +2967,15 @@ typedef struct TestP_ { /* pointer to a Test */
 	struct TestP_* next;
 } TestP;
 TestP* allocTestP(Test* test) {
-	TestP* testP = allocStruct(TestP);
+	TestP* testP = arenaStruct(&treeArena,TestP);
 	testP->test = test;
 	return(testP);
 }
 Chain(TestP,TestPChain);
 TestChain tests;
 int simpleTest;	/* 1 if all tests are on the form no-calc filed Op constant */
+TestChain inputTests;	/* the tests from input where: */
+int whereInput = 0;	/* 1 while the input where: tests are made */
 
 /** transpose: commands */
 typedef struct Transpose_ {
@@ -2187,12 +2988,38 @@ typedef struct Transpose_ {
 Chain(Transpose,TransposeChain);
 TransposeChain transposes;
 
+/** output block: commands */
+typedef struct OutputBlock_ {
+	OutputBlockCmds* cmds;	/* the commands of the block */
+	char* outputFileName;	/* the name of the output file */
+	char outputSep;			/* the separator for the output file */
+	char outputDecPoint;	/* the decimal point for the output file */
+	FileFormat outputFormat;/* the format of the output file */
+	FieldPChain outputFields;/* the fields to output */
+	FieldPChain groupByFields;/* the input fields to group by */
+	FieldPChain groupByFoodFields;/* the food table fields to group by */
+	TestChain tests;		/* the tests from where: */
+	struct OutputBlock_* next;
+} OutputBlock;
+Chain(OutputBlock,OutputBlockChain);
+OutputBlockChain outputBlocks;
+
+/** rollup: commands */
+typedef struct Rollup_ {
+	char* outputFileName;	/* the name of the output file */
+	FieldPChain outputFields;/* the fields to output */
+	FieldPChain groupByFields;/* the first of the input fields in group by: */
+	FieldPChain groupByFoodFields;/* the other group by fields of the level */
+	struct Rollup_* next;
+} Rollup;
+Chain(Rollup,RollupChain);
+RollupChain rollups;
+
 /** output:, output format:, output fields: commands */
 char* outputFileName = NULL;/* the name of the output file */
 char outputSep;			/* the separator for the output file */
 char outputDecPoint;	/* the decimal point for the output file */
 FileFormat outputFormat;/* the format of the output file */
-FILE* output;			/* the output file */
 FieldPChain outputFields;/* the fields to output */
 int noRealOutputFields;	/* the number of "real" output fields. The first fields in
 outputFields are the real output fields; i.e. those given (possibly by default) in a
@@ -2200,12 +3027,50 @@ output fields: command. The calculate, recipe sum, if and if not commands may ad
 extra fields to the list. There should be room for those in the output buffer, and
 the are otherwise treated like output fields, but they are not to be finally output.*/
 
+/** summary output: command */
+int summaryOutput = 0;	/* 1 if the output file gets a summary of the output lines */
+int summaryStratify;	/* position of the stratify field in the output lines, or -1 */
+
+/** usda foods: command */
+/* the files of a USDA nutrient database in ASCII format. FOOD_DES.TXT has a line for
+   each food and NUT_DATA.TXT a line for each nutrient value of a food. the nutrients
+   are in NUTR_DEF.TXT, which is read with the fields. the fields of the foods are: */
+char* usdaFields[] = {"ndb_no","desc","shrt_desc","fdgp_cd","refuse","non_edible",
+	"n_factor","pro_factor","fat_factor","cho_factor",NULL};
+#define usdaNoFields 10	/* no of usdaFields, the nutrients are after these */
+typedef struct UsdaFiles_ {
+	File* foodDes;		/* FOOD_DES.TXT */
+	File* nutData;		/* NUT_DATA.TXT */
+	File* nutrDef;		/* NUTR_DEF.TXT (read and closed by setFoods()) */
+	int maxNutrNo;		/* the highest nutrient no in NUTR_DEF.TXT */
+	int* nutrPos;		/* array[maxNutrNo+1] of the position in a line of each nutrient
+						   no, or -1 if it is not a nutrient */
+} UsdaFiles;
+
+/** long foods: command */
+/* a long foods file has a line for each value of a food, with the food id, the nutrient
+   id and the value in three of its fields. each nutrient id becomes a field named by
+   the nutrient id field followed by the id, e.g. stof1, stof3, ... */
+typedef struct LongFoods_ {
+	int noFileFields;	/* no of fields in a line of the file */
+	int* fileSkip;		/* array[noFileFields], 0 for the three fields below, else 1 */
+	int foodCol;		/* the no of the food id field in a line (first=0) */
+	int nutrCol;		/* the no of the nutrient id field in a line */
+	int valueCol;		/* the no of the value field in a line */
+	int maxNutrNo;		/* the highest nutrient id in the file */
+	int* nutrPos;		/* array[maxNutrNo+1] of the position in a row of each nutrient
+						   id, or -1 if it is not in the file */
+} LongFoods;
+
 /** foods: command */
 typedef struct FoodsFile_ {
-	File* file;			/* the foods file */
+	File* file;			/* the foods file (not opened if usda) */
+	UsdaFiles* usda;	/* the USDA files if it is a usda foods: command, else NULL */
+	LongFoods* longFoods; /* the fields of a long foods: command, else NULL */
 	FieldPChain* fieldPs; /* the fields in the foods file */
 	int starFields;		/* no of star fields */
 	int noFromFields;	/* number of fields to be put in the food table */
+	struct Staging_* staging; /* the lines of the file, see stageFiles() */
 	struct FoodsFile_* next;
 } FoodsFile;
 Chain(FoodsFile, FoodsFileChain);
@@ -2224,17 +3089,31 @@ typedef enum {			/* types of entries in the food table: */
 	simpleRecipe,			/* a recipe aggregated to be just like a simpleFood */
 	expandedRecipe			/* a recipe. The value is a list of RecipeEntries, which each is an array of Num's */
 } FoodType;
-typedef struct RecipeEntry_ {Num* obs; struct RecipeEntry_* next;} RecipeEntry;
+/* a non-zero nutrient field of a row. a sparse row is an array of these sorted on pos,
+   ended by one with pos equal to the no of nutrient fields (see setSparseRows()) */
+typedef struct {int pos; Num num;} SparseNutri;
+#define sparseMinFields 16	/* no sparse rows if the plan has fewer nutrient fields */
+#define sparseMaxPct 50		/* max % of the nutrient fields non-zero in a sparse row */
+typedef struct RecipeEntry_ {
+	Num* obs;
+	SparseNutri* sparse; /* the sparse row of obs for the input plan, or NULL */
+	struct RecipeEntry_* next;
+} RecipeEntry;
 typedef struct FoodEntry_ {
 	FoodType foodType;
+	int no; /* no of the entry, used to index the counts of food profile: */
+	SparseNutri* sparse; /* the sparse row of u.obs for the input plan, or NULL */
 	union {
 		Num* obs; /* when foodType is simpleFood or simpleRecipe */
 		RecipeEntry* recipe; /* when foodType is expandedRecipe */
 	} u;
 } FoodEntry;
+int noFoodEntries = 0; /* no of food entries allocated */
 FoodEntry* allocFoodEntry(FoodType foodType, void* obs) { /* allocate a food entry */
-	FoodEntry* foodEntry = allocStruct(FoodEntry);
+	FoodEntry* foodEntry = arenaStruct(&foodArena,FoodEntry);
 	foodEntry->foodType = foodType;
+	foodEntry->no = noFoodEntries++;
+	foodEntry->sparse = NULL;
 	if (foodType == expandedRecipe) foodEntry->u.recipe = obs;
 	else foodEntry->u.obs = obs;
 	return(foodEntry);
@@ -2248,6 +3127,7 @@ typedef struct GroupsFile_ {
 	FieldPChain* groupIds;/* the group id fields */
 	int noFromFields;	/* number of fields to be put in the food table */
 	HashInt* hash;		/* hash with an entry for each group in the file, the value of an entry is an array of Num's */
+	struct Staging_* staging; /* the lines of the file, see stageFiles() */
 	struct GroupsFile_* next;
 } GroupsFile;
 Chain(GroupsFile, GroupsFileChain);
@@ -2421,6 +3301,284 @@ int readFoodsHeader(File* file, FieldPChain* fieldPs, char** idNames,
 }
 
 
+/* open one of the files of a USDA database in the directory dir. the files may also
+   be called e.g. FOOD_DES.txt or food_des.txt. returns NULL if any error */
+File* openUsdaFile(char* dir, char* name) {
+	char* ext[] = {".TXT",".txt",NULL};
+	int len = strlen(dir);
+	char* fileName = alloc(len+strlen(name)+6);
+	File* file = allocStruct(File);
+	int lower, i;
+	for (lower = 0; lower < 2; lower++) {
+		for (i = 0; ext[i]; i++) {
+			char* p;
+			if (len && dir[len-1] != '/' && dir[len-1] != '\\')
+				sprintf(fileName,"%s/%s%s",dir,name,ext[i]);
+			else sprintf(fileName,"%s%s%s",dir,name,ext[i]);
+			if (lower) for (p = fileName+len; *p; p++) *p = tolower(*p);
+			/* the fields are separated by ^, and there are no comments */
+			if (initFile(file,fileName,foodsFileT,"r",'^','.','\0')) return(file);
+		}
+	}
+	error("Could not open file %s/%s%s.\n",dir,name,ext[0]);
+	free(fileName);
+	free(file);
+	return(NULL);
+}
+
+/* read a field of a line of a USDA file and the separator after it. the fields are
+   separated by ^, and text fields are in ~, like ~01001~^~Butter, salted~^15.87. a
+   text field starting with a digit gets its number, other text fields and empty
+   fields are 0. the text of a text field is put in str. returns 0 if it was the last
+   field of the line */
+int getUsdaField(Num* value) {
+	int len = 0;
+	*value = (Num)0.0;
+	if (ch == '~') {
+		getch();
+		if (isdigit(ch)) {getNum(); *value = num;}
+		while (ch != '~' && !eol()) {
+			if (len < 100) str[len++] = ch;
+			getch();
+		}
+		if (ch == '~') getch();
+	} else if (isdigit(ch) || ch == '-' || ch == '+' || ch == decimalPoint) {
+		getNum(); *value = num;
+	}
+	str[len] = '\0';
+	strLen = len;
+	while (space()) getch();
+	if (ch == separator) {getch(); return(1);}
+	if (!eol()) {
+		fileError("Error in list of values");
+		while (!eol()) getch();
+	}
+	return(0);
+}
+
+/* read a line of a USDA file into the first no values of line (see getUsdaField()).
+   returns the no of fields in the line, or 0 at the end of the file */
+int readUsdaLine(Num* line, int no) {
+	int n = 0, more = 1;
+	Num value;
+	skipComment(); /* skip empty lines */
+	if (eof()) return(0);
+	while (more) {
+		more = getUsdaField(&value);
+		if (n < no) line[n] = value;
+		n++;
+	}
+	skipEol();
+	return(n);
+}
+
+/* open the files of a usda foods: command and read the nutrients in NUTR_DEF.TXT. the
+   fields are put in the lists as readFoodsHeader() does, with the INFOODS tagnames
+   of the nutrients as names. Returns NULL if there was any errors */
+UsdaFiles* readUsdaHeader(char* dir, FieldPChain* fieldPs, FieldPChain* idFields) {
+	UsdaFiles* usda = allocStruct(UsdaFiles);
+	int noFields = 0, noNoTag = 0;
+	char** name;
+
+	if (!(usda->foodDes = openUsdaFile(dir,"FOOD_DES")) ||
+		!(usda->nutData = openUsdaFile(dir,"NUT_DATA")) ||
+		!(usda->nutrDef = openUsdaFile(dir,"NUTR_DEF"))) return(NULL);
+	nolink(*fieldPs);
+
+	/* the fields before the nutrients. NDB_No is the id field, which gets the name
+	   of the id field of an earlier foods file. Desc and Shrt_Desc are text */
+	for (name = usdaFields; *name; name++) {
+		Field* field;
+		char* fieldName = (name == usdaFields && idFields->no ?
+			idFields->first->field->name : *name);
+		if (!(field = lookStr(foodFieldsHash,fieldName))) {
+			link(foodFields,(field = allocField(fieldName)));
+			insertStr(foodFieldsHash,fieldName,field);
+		}
+		if (name == usdaFields) {
+			if (!idFields->no) link(*idFields,allocFieldP(field));
+			field->noCalc = 1;
+		}
+		if (name == usdaFields+1 || name == usdaFields+2) field->text = field->noCalc = 1;
+		link(*fieldPs,allocFieldP(field));
+		noFields++;
+	}
+
+	/* the nutrients. a line is like ~203~^~g~^~PROCNT~^~Protein~^2^600, where the
+	   third field is the tagname */
+	usda->maxNutrNo = -1;
+	usda->nutrPos = NULL;
+	setCurrent(usda->nutrDef);
+	while (1) {
+		Num nutrNo, dummy;
+		skipComment(); /* skip empty lines */
+		if (eof()) break;
+		if (!getUsdaField(&nutrNo) || !getUsdaField(&dummy)) {
+			fileError("Error in list of values");
+		} else {
+			int more = getUsdaField(&dummy);
+			int no = (int)nutrNo;
+			if (no <= 0 || no > 99999) {
+				fileError("Bad nutrient no");
+			} else if (!strLen) {
+				noNoTag++;
+			} else {
+				Field* field;
+				char* tag;
+				strToLowercase(str);
+				tag = saveStr();
+				if (!(field = lookStr(foodFieldsHash,tag))) {
+					link(foodFields,(field = allocField(tag)));
+					insertStr(foodFieldsHash,tag,field);
+				}
+				link(*fieldPs,allocFieldP(field));
+				if (no > usda->maxNutrNo) { /* make room for the nutrient no */
+					int* nutrPos = alloc((no+1)*sizeof(int));
+					int i;
+					for (i = 0; i <= usda->maxNutrNo; i++) nutrPos[i] = usda->nutrPos[i];
+					for (; i <= no; i++) nutrPos[i] = -1;
+					free(usda->nutrPos);
+					usda->nutrPos = nutrPos;
+					usda->maxNutrNo = no;
+				}
+				usda->nutrPos[no] = noFields++;
+			}
+			while (more) more = getUsdaField(&dummy);
+		}
+		skipEol();
+	}
+	closeCurrent();
+	if (noNoTag)
+		warning("%d nutrients in %s have no tagname, and are not used.\n",
+			noNoTag,usda->nutrDef->name);
+
+	endlink(*fieldPs);
+	endlink(foodFields);
+	endlink(*idFields);
+	return(usda);
+}
+
+
+forward int readNumLine(Num* line, int no, int* skip, int star);
+
+/* read the header of a long foods file and find the fields in it. names are the food
+   id, nutrient id and value fields. The nutrient ids are found by reading the nutrient
+   id field of all the lines, and the file is then set back to the first line after the
+   header, so the values can be read by readLongFoods(). The food id field and a field
+   for each nutrient id, in the order of the ids, are put in the lists as
+   readFoodsHeader() does. Returns NULL if there was any errors */
+LongFoods* readLongHeader(File* file, char** names, FieldPChain* fieldPs,
+						  FieldPChain* idFields) {
+	LongFoods* longFoods = allocStruct(LongFoods);
+	int* cols[3];
+	int* scanSkip;		/* skip all but the nutrient id field */
+	Num* line;
+	long dataPos;		/* the position, lineNo and ch of the first line after the header */
+	int dataLineNo, dataCh;
+	int i, no, noFields = 0, status = 1;
+
+	cols[0] = &(longFoods->foodCol);
+	cols[1] = &(longFoods->nutrCol);
+	cols[2] = &(longFoods->valueCol);
+	for (i = 0; i < 3; i++) *cols[i] = -1;
+	longFoods->noFileFields = 0;
+	nolink(*fieldPs);
+	setCurrent(file);
+
+	skipComment(); /* skip any comment lines */
+	if (ch == '*') {
+		error("Star fields can not be used in the long foods file %s.\n",file->name);
+		closeCurrent();
+		return(NULL);
+	}
+	while (!eol()) {
+		if (!getFieldInList()) {closeCurrent(); return(NULL);}
+		for (i = 0; i < 3; i++)
+			if (strcmp(names[i],str) == 0) *cols[i] = longFoods->noFileFields;
+		longFoods->noFileFields++;
+	}
+	skipEol();
+	for (i = 0; i < 3; i++) if (*cols[i] < 0) {
+		error("Field '%s' not found in file %s.\n",names[i],file->name);
+		status = 0;
+	}
+	if ((dataPos = currentBytes()) <= 0 || currentFile == stdin) {
+		error("The long foods file %s can not be read from standard input.\n",file->name);
+		status = 0;
+	}
+	if (!status) {closeCurrent(); return(NULL);}
+	dataLineNo = lineNo;
+	dataCh = ch;
+
+	/* the nutrient ids, which are first marked with 0 in nutrPos */
+	longFoods->fileSkip = alloc(longFoods->noFileFields*sizeof(int));
+	scanSkip = alloc(longFoods->noFileFields*sizeof(int));
+	line = alloc(longFoods->noFileFields*sizeof(Num));
+	for (i = 0; i < longFoods->noFileFields; i++) longFoods->fileSkip[i] = scanSkip[i] = 1;
+	for (i = 0; i < 3; i++) longFoods->fileSkip[*cols[i]] = 0;
+	scanSkip[longFoods->nutrCol] = 0;
+	longFoods->maxNutrNo = -1;
+	longFoods->nutrPos = NULL;
+	while (readNumLine(line,longFoods->noFileFields,scanSkip,0)) {
+		no = (int)line[longFoods->nutrCol];
+		if (no < 0 || no > 99999 || (Num)no != line[longFoods->nutrCol]) {
+			error("Bad nutrient id in line %d of file %s.\n",lineNo-1,file->name);
+			continue;
+		}
+		if (no > longFoods->maxNutrNo) { /* make room for the nutrient id */
+			int* nutrPos = alloc((no+1)*sizeof(int));
+			for (i = 0; i <= longFoods->maxNutrNo; i++) nutrPos[i] = longFoods->nutrPos[i];
+			for (; i <= no; i++) nutrPos[i] = -1;
+			free(longFoods->nutrPos);
+			longFoods->nutrPos = nutrPos;
+			longFoods->maxNutrNo = no;
+		}
+		longFoods->nutrPos[no] = 0;
+	}
+	free(scanSkip);
+	free(line);
+
+	/* the fields. the food id field gets the name of the id field of an earlier
+	   foods file */
+	for (no = -1; no <= longFoods->maxNutrNo; no++) {
+		Field* field;
+		char* name;
+		if (no < 0) {
+			name = (idFields->no ? idFields->first->field->name : names[0]);
+		} else if (longFoods->nutrPos[no] == 0) {
+			sprintf(str,"%s%d",names[1],no);
+			strLen = strlen(str);
+			name = saveStr();
+			longFoods->nutrPos[no] = noFields;
+		} else continue;
+		if (!(field = lookStr(foodFieldsHash,name))) {
+			link(foodFields,(field = allocField(name)));
+			insertStr(foodFieldsHash,name,field);
+		}
+		if (no < 0) {
+			if (!idFields->no) link(*idFields,allocFieldP(field));
+			field->noCalc = 1;
+		}
+		link(*fieldPs,allocFieldP(field));
+		noFields++;
+	}
+	endlink(*fieldPs);
+	endlink(foodFields);
+	endlink(*idFields);
+
+	/* back to the first line after the header */
+	if (fseek(currentFile,dataPos,SEEK_SET) != 0) {
+		error("Could not read file %s again.\n",file->name);
+		closeCurrent();
+		return(NULL);
+	}
+	lineNo = dataLineNo;
+	ch = dataCh;
+	getCurrent(file);
+	return(longFoods);
+}
+
+
 /* handle the save: command */
 void setSave() {
 	if (saveCmd) {
@@ -2431,19 +3589,96 @@ void setSave() {
 	} else {
 		saveBin = 0;
 	}
+	if (serverSocketName && !inputFieldsCmd)
+		error("With the -d option the 'input fields' command must be used.\n");
+	if (library && !inputFieldsCmd)
+		error("In the library the 'input fields' command must be used.\n");
+}
+
+
+/* handle the food profile: command */
+void setProfile() {
+	if (foodProfileCmd) profileFileName = foodProfileCmd->args[0];
+}
+
+
+/* handle the progress: command */
+void setProgress() {
+	if (progressCmd) {
+#ifdef HAVE_PIPELINE
+		progressFileName = progressCmd->args[0];
+		if (progressCmd->args[1] && (progressSeconds = atoi(progressCmd->args[1])) < 1)
+			progressSeconds = 1;
+#else
+		warning("The progress: command can not be used on this system.\n");
+#endif
+	}
+}
+
+
+/* handle the food cache: command. without it the cache is next to the main commands
+   file */
+void setCache() {
+	if (foodCacheCmd) {
+		if (strcmp(foodCacheCmd->args[0],"none") != 0)
+			cacheFileName = foodCacheCmd->args[0];
+	} else if (strcmp(mainCommandsName,"-") != 0) {
+		cacheFileName = alloc(strlen(mainCommandsName)+5);
+		sprintf(cacheFileName,"%s.fcc",mainCommandsName);
+	}
 }
 
 
-/* handle all foods: commands */
+/* handle all foods:, usda foods: and long foods: commands */
 void setFoods() {
-	Cmd* cmd = foodsCmd;
+	Cmd* cmd;
 
 	FieldPChain idFields;
 	nolink(idFields);
 	nolink(foodsFiles);
+	if (!foodsCmd && !usdaFoodsCmd && !longFoodsCmd) {
+		error("Required command 'foods' not specified\n");
+		return;
+	}
+	/* the USDA foods are read first, so the foods files can change them */
+	for (cmd = usdaFoodsCmd; cmd; cmd = cmd->next) {
+		FieldPChain* fieldPs = arenaStruct(&treeArena,FieldPChain);
+		UsdaFiles* usda;
+		if ((usda = readUsdaHeader(cmd->args[0],fieldPs,&idFields))) {
+			FoodsFile* foodsFile = allocStruct(FoodsFile);
+			File* file = allocStruct(File);
+			memset(file,0,sizeof(File));
+			file->name = cmd->args[0];
+			file->type = foodsFileT;
+			foodsFile->file = file;
+			foodsFile->usda = usda;
+			foodsFile->longFoods = NULL;
+			foodsFile->fieldPs = fieldPs;
+			foodsFile->starFields = 0;
+			foodsFile->noFromFields = 0;
+			link(foodsFiles,foodsFile);
+		}
+	}
+	for (cmd = longFoodsCmd; cmd; cmd = cmd->next) {
+		File* file;
+		FieldPChain* fieldPs = arenaStruct(&treeArena,FieldPChain);
+		LongFoods* longFoods;
+		if ((file = openInFile(cmd->args[0],foodsFileT,cmd->args[4],cmd->args[5],NULL)) &&
+			(longFoods = readLongHeader(file,cmd->args+1,fieldPs,&idFields))) {
+			FoodsFile* foodsFile = allocStruct(FoodsFile);
+			foodsFile->file = file;
+			foodsFile->usda = NULL;
+			foodsFile->longFoods = longFoods;
+			foodsFile->fieldPs = fieldPs;
+			foodsFile->starFields = 0;
+			foodsFile->noFromFields = 0;
+			link(foodsFiles,foodsFile);
+		}
+	}
+	cmd = foodsCmd;
 	while (cmd) { /* handle the foods: commands one by one */
 		File* file;
-		FieldPChain* fieldPs = allocStruct(FieldPChain);
+		FieldPChain* fieldPs = arenaStruct(&treeArena,FieldPChain);
 		int star;
 		char* idnames[2];
 		idnames[0] = cmd->args[1]; idnames[1] = NULL;
@@ -2451,6 +3686,8 @@ void setFoods() {
 			readFoodsHeader(file,fieldPs,&(idnames[0]),&idFields,&star)) {
 			FoodsFile* foodsFile = allocStruct(FoodsFile);
 			foodsFile->file = file;
+			foodsFile->usda = NULL;
+			foodsFile->longFoods = NULL;
 			foodsFile->fieldPs = fieldPs;
 			foodsFile->starFields = star;
 			foodsFile->noFromFields = 0;
@@ -2459,7 +3696,7 @@ void setFoods() {
 		cmd = cmd->next;
 	}
 	endlink(foodsFiles);
-	foodId = idFields.first->field;
+	if (idFields.no) foodId = idFields.first->field;
 }
 
 /* handle all groups: commands */
@@ -2469,9 +3706,9 @@ void setGroups() {
 	nolink(groupsFiles);
 	while (cmd) { /* handle the groups: commands one by one */
 		File* file;
-		FieldPChain* fieldPs = allocStruct(FieldPChain);
+		FieldPChain* fieldPs = arenaStruct(&treeArena,FieldPChain);
 		int star;
-		FieldPChain* idFields = allocStruct(FieldPChain);
+		FieldPChain* idFields = arenaStruct(&treeArena,FieldPChain);
 		char** args = cmd->args+2;
 		nolink(*idFields);
 		while (*args++);
@@ -2557,7 +3794,7 @@ void setInput() {
 	}
 
 	nolink(inputFields);
-	inputFieldsHash = newHashStr(89);
+	inputFieldsHash = newHashStr(32,"input fields");
 	inputStarFields = 0;
 
 	if (inputFormat != formatText) {
@@ -2674,8 +3911,8 @@ void setRecipes() {
 			RecipesFile* recipesFile = allocStruct(RecipesFile);
 
 			recipesFile->file = file;
-			recipesFile->fields = allocStruct(FieldChain);
-			recipesFile->fieldsHash = newHashStr(13);
+			recipesFile->fields = arenaStruct(&treeArena,FieldChain);
+			recipesFile->fieldsHash = newHashStr(8,recipesFile->file->name);
 			recipesFile->starFields = 0;
 
 			/* get field names from the file */
@@ -2923,52 +4160,212 @@ void setText() {
 }
 
 
-/* handle the non-edible field: command */
-void setNonEdible() {
-	nonEdibleField = NULL;
-	nonEdibleFlagName = NULL;
-	if (nonEdibleFieldCmd) {
-		char **args = nonEdibleFieldCmd->args;
-		if (!(nonEdibleField = lookStr(foodFieldsHash,*args))) {
-			error("Non-edible field '%s' not found in food table.\n",*args);
-		} else {
-			checkText(nonEdibleField,"non-edible");
-			nonEdibleField->noCalc = 1;
-			nonEdibleFlagName = *++args;
-		}
+/* handle the code fields: command */
+void checkCode(Field* field, char* type) {
+	if (field->code) error("The %s field '%s' must not be a code field.\n",type,field->name);
+}
+void setCodeField(Field* field) {
+	if (field->text) error("Code field '%s' must not be a text field.\n",field->name);
+	field->code = field->noCalc = 1;
+}
+void setCode() {
+	Cmd* cmd = codeFieldsCmd;
+	while (cmd) {
+		char** args = cmd->args;
+		while (*args) {
+			Field* field;
+			if (*args == fieldRange) {
+				char* from;
+				char* to;
+				if (!(from = *++args) || !(to = *++args)) {
+					error("Error in format of range of fields in list of code fields.\n");
+					return;
+				}
+				if ((field = lookStr(foodFieldsHash,from))) {
+					while (1) {
+						setCodeField(field);
+						if (strcmp(field->name,to) == 0) break;
+						if (!(field = field->next)) {
+							error("Ending field in range '%s'--'%s' not found.\n",from,to);
+							break;
+						}
+					}
+				} else {
+					error("Code field '%s' not found.\n",from);
+				}
+			} else {
+				int found = 0;
+				if ((field = lookStr(inputFieldsHash,*args))) {
+					if (inputFormat == formatBinNative)
+						error("Code field '%s' can not be used with input format bin-native.\n",
+							field->name);
+					setCodeField(field);
+					found = 1;
+				}
+				if ((field = lookStr(foodFieldsHash,*args))) {
+					setCodeField(field);
+					found = 1;
+				}
+				{
+					RecipesFile* recipesFile = recipesFiles.first;
+					while (recipesFile) {
+						if ((field = lookStr(recipesFile->fieldsHash,*args))) {
+							setCodeField(field);
+							found = 1;
+						}
+						recipesFile = recipesFile->next;
+					}
+				}
+
+			    if (!found)	error("Code field '%s' not found.\n",*args);
+			}
+			args++;
+		}
+		cmd = cmd->next;
+	}
+	checkCode(inputAmountField,"input amount");
+	{
+		RecipesFile* recipesFile = recipesFiles.first;
+		while (recipesFile) {
+			checkCode(recipesFile->amountField,"recipe amount");
+			recipesFile = recipesFile->next;
+		}
 	}
 }
 
 
-/* handle the group by: command */
-void setGroupBy() {
+/* handle the non-edible field: command */
+void setNonEdible() {
+	nonEdibleField = NULL;
+	nonEdibleFlagName = NULL;
+	if (nonEdibleFieldCmd) {
+		char **args = nonEdibleFieldCmd->args;
+		if (!(nonEdibleField = lookStr(foodFieldsHash,*args))) {
+			error("Non-edible field '%s' not found in food table.\n",*args);
+		} else {
+			checkText(nonEdibleField,"non-edible");
+			nonEdibleField->noCalc = 1;
+			nonEdibleFlagName = *++args;
+		}
+	}
+}
+
+
+/* handle a group by: command. the input fields are linked to inputFields and the
+   food table fields to foodFields. groupBy is set for the fields if mark */
+void setGroupByFields(Cmd* cmd, FieldPChain* inputFields, FieldPChain* foodFields,
+					  int mark) {
 
-	nolink(groupByFields);
-	nolink(groupByFoodFields);
-	if (groupByCmd) {
-		char **args = groupByCmd->args;
-		FieldPChain* fields = &groupByFields;
+	nolink(*inputFields);
+	nolink(*foodFields);
+	if (cmd) {
+		char **args = cmd->args;
+		FieldPChain* fields = inputFields;
 		while (*args) { /* handle the fields in the group by: command one by one */
 			Field* field = NULL;
 			if (!(field = lookStr(inputFieldsHash,*args))) {
 				if (field = lookStr(foodFieldsHash,*args)) {
-					fields = &groupByFoodFields;
+					fields = foodFields;
 				} else {
 					error("Group By field '%s' not found in input file nor in food table.\n",*args); 
 				}
 			}
 			if (field) {
 				link(*fields,allocFieldP(field));
-				field->groupBy = 1;
+				if (mark) field->groupBy = 1;
 				field->noCalc = 1; /* group by fields are noCalc */
 				checkText(field,"group by");
 			}
 			args++;
 		}
-		endlink(groupByFields);
-		endlink(groupByFoodFields);
+		endlink(*inputFields);
+		endlink(*foodFields);
 	}
 }
+void setGroupBy() {
+	setGroupByFields(groupByCmd,&groupByFields,&groupByFoodFields,1);
+}
+
+
+/* handle the output block: commands. the output:, output format: and group by:
+   commands of each block. the group by fields of a block are noCalc like those of
+   the group by: command, but they are not group by fields of the main output */
+forward void setOutputFile(Cmd* cmd, Cmd* formatCmd, char** fileName, char* sep,
+						   char* decPoint, FileFormat* format);
+void setOutputBlocks() {
+	OutputBlockCmds* cmds = outputBlockCmds.first;
+	nolink(outputBlocks);
+	while (cmds) {
+		OutputBlock* block = allocarray(1,sizeof(OutputBlock));
+		block->cmds = cmds;
+		if (!cmds->outputCmd)
+			error("Output block '%s' has no output: command.\n",cmds->name);
+		else
+			setOutputFile(cmds->outputCmd,cmds->outputFormatCmd,&block->outputFileName,
+						  &block->outputSep,&block->outputDecPoint,&block->outputFormat);
+		if (!cmds->outputFieldsCmd)
+			error("Output block '%s' has no output fields: command.\n",cmds->name);
+		setGroupByFields(cmds->groupByCmd,&block->groupByFields,&block->groupByFoodFields,0);
+		link(outputBlocks,block);
+		cmds = cmds->next;
+	}
+	endlink(outputBlocks);
+	if (outputBlocks.no && (saveBin || serverSocketName || library))
+		error("The output block: command can not be used with save:, -d or the library.\n");
+}
+
+/* handle the rollup: commands. the input fields of a level must be the first of the
+   input fields of the group by: command, as the input file is sorted on these. the
+   other fields of a level are grouped on like food table fields */
+int isArg(char** args, char* name) {
+	while (*args) if (strcmp(*args++,name) == 0) return(1);
+	return(0);
+}
+void setRollups() {
+	Cmd* cmd = rollupCmd;
+	nolink(rollups);
+	if (cmd && !groupByCmd)
+		error("The rollup command can only be used if the group by command is also used.\n");
+	else if (cmd && (saveBin || serverSocketName || library))
+		error("The rollup: command can not be used with save:, -d or the library.\n");
+	else while (cmd) { /* handle the rollup: commands one by one */
+		Rollup* rollup = allocarray(1,sizeof(Rollup));
+		char** args = cmd->args+1;
+		FieldP* fieldP;
+		int gap = 0;
+		rollup->outputFileName = cmd->args[0];
+		nolink(rollup->groupByFields);
+		nolink(rollup->groupByFoodFields);
+		for (fieldP = groupByFields.first; fieldP; fieldP = fieldP->next) {
+			if (!isArg(args,fieldP->field->name)) {
+				gap = 1;
+			} else if (gap) {
+				error("The input fields in rollup: %s must be the first input fields in group by:.\n",
+					rollup->outputFileName);
+				break;
+			} else {
+				link(rollup->groupByFields,allocFieldP(fieldP->field));
+			}
+		}
+		for (; *args; args++) {
+			for (fieldP = groupByFields.first; fieldP; fieldP = fieldP->next)
+				if (strcmp(fieldP->field->name,*args) == 0) break;
+			if (fieldP) continue;
+			for (fieldP = groupByFoodFields.first; fieldP; fieldP = fieldP->next)
+				if (strcmp(fieldP->field->name,*args) == 0) break;
+			if (!fieldP) {
+				error("Rollup field '%s' is not a group by field.\n",*args);
+			} else {
+				link(rollup->groupByFoodFields,allocFieldP(fieldP->field));
+			}
+		}
+		endlink(rollup->groupByFields);
+		endlink(rollup->groupByFoodFields);
+		link(rollups,rollup);
+		cmd = cmd->next;
+	}
+	endlink(rollups);
+}
 
 /* handle the set: commands */
 forward void setSetH(Field* field, Exp* e, int add);
@@ -2979,7 +4376,7 @@ SetChain* currentSets;
 void setSet() {
 	Cmd* cmd = setCmd;
 
-	calculateFieldsHash = newHashStr(89);
+	calculateFieldsHash = newHashStr(32,"set fields");
 	nolink(calculateFields);
 	nolink(sets);
 	while (cmd) { /* handle the set: commands one by one */
@@ -3180,7 +4577,7 @@ void setRecipeSet2() {
 	
 	nolink(recipeSets);
 	nolink(setRecipeFields);
-	setRecipeFieldsHash = newHashStr(89);
+	setRecipeFieldsHash = newHashStr(8,"recipe set fields");
 	while (cmd) {
 		char* name = cmd->args[0];
 		Exp* e = (Exp*)cmd->args[1];
@@ -3212,10 +4609,10 @@ void setCookX(Cmd* cmd, ReducType reducType) {
 			error("Cook reduct field '%s' not found in food table.\n",name);
 		} else {
 			CookChain* cooks;
-			Cook* cook = allocStruct(Cook);
+			Cook* cook = arenaStruct(&treeArena,Cook);
 			/* se if we alrady has this cook type, if not we insert it in the hash */
 			if (!(cooks = lookStr(cookTypesHash,type))) {
-				cooks = allocStruct(CookChain);
+				cooks = arenaStruct(&treeArena,CookChain);
 				nolink(*cooks);
 				insertStr(cookTypesHash,type,cooks);
 			}
@@ -3247,7 +4644,7 @@ void setCookX(Cmd* cmd, ReducType reducType) {
 }
 void setCook() {
 
-	cookTypesHash = newHashStr(7);
+	cookTypesHash = newHashStr(8,"cook types");
 
 	if (weightCookCmd && !recipeSumCmd)
 		error("You must use the food weight: command when you use the weight cook command.\n");
@@ -3270,7 +4667,7 @@ void setCook() {
 			if (!(cooks = lookStr(cookTypesHash,*args))) {
 				error("Cook type '%s' not defined.\n",*args);
 			} else {
-				CookType* cookType = allocStruct(CookType);
+				CookType* cookType = arenaStruct(&treeArena,CookType);
 				cookType->type = *args;
 				cookType->cooks = cooks;
 				link(cookTypes,cookType);
@@ -3288,7 +4685,7 @@ void setReductX(Cmd* cmd, ReducType type) {
 		char** args = cmd->args;
 		char* name = *args++;
 
-		Reduct* reduct = allocStruct(Reduct);
+		Reduct* reduct = arenaStruct(&treeArena,Reduct);
 		link(reducts,reduct);
 		reduct->fieldName = name; /* we only save the name of the reduce field for now */
 		reduct->type = type;
@@ -3331,7 +4728,7 @@ void setRecipeReduct() {
 		char** args = cmd->args;
 		char* name = *args++;
 
-		RecipeReduct* recipeReduct = allocStruct(RecipeReduct);
+		RecipeReduct* recipeReduct = arenaStruct(&treeArena,RecipeReduct);
 		link(recipeReducts,recipeReduct);
 		recipeReduct->fieldName = name; /* we only save the name of the reduce field for now */
 		recipeReduct->next = NULL;
@@ -3366,7 +4763,7 @@ void setTranspose() {
 	nolink(transposes);
 	while (cmd) {
 		char** args = cmd->args;
-		Transpose* transpose = allocStruct(Transpose);
+		Transpose* transpose = arenaStruct(&treeArena,Transpose);
 		if (!(transpose->groupField = lookStr(foodFieldsHash,*args))) {
 			error("Transpose field '%s' not found in food table.\n",*args);
 		} else if ((transpose->noGroups = atoi(*++args)) < 1) {
@@ -3403,6 +4800,22 @@ forward Field* setWhereField(LVal* val, LValType* type);
 forward void setWhereBackPatch(TestPChain* back, int action);
 forward void setIf(TestPChain* backF);
 forward void setIfNot(TestPChain* backF);
+void setInputWhere() {
+	nolink(tests);
+	if (inputWhereCmd) {
+		TestPChain backT, backF;
+		nolink(backT);
+		nolink(backF);
+		whereInput = 1;
+		setWhereLexp((Lexp*)inputWhereCmd->args[0],0,&backT,&backF);
+		whereInput = 0;
+		setWhereBackPatch(&backT,tests.no);
+		setWhereBackPatch(&backF,tests.no+1);
+	}
+	endlink(constants);
+	endlink(tests);
+	inputTests = tests;
+}
 void setWhere() {
 	TestPChain backF;
 	nolink(backF);
@@ -3461,6 +4874,8 @@ Test* setWhereTest(LexpVal* v, int not, TestPChain* back) {
 		test->field1 = test->field2;
 		test->field2 = field;
 	}
+	if (whereInput && type1 == constLVal && type2 == constLVal)
+		error("Input where: tests must use an input field.\n");
 	if (type1 != noCalcLVal || type2 != constLVal) simpleTest = 0;
 	link(tests,test);
 	link(*back,allocTestP(test));
@@ -3479,6 +4894,14 @@ Field* setWhereField(LVal* val, LValType* type) {
 	if (val->type == numVal) {
 		field = allocConstant(val->u.num);
 		*type = constLVal;
+	} else if (whereInput) {
+		if ((field = lookStr(inputFieldsHash,val->u.name))) {
+			checkText(field,"input where");
+		} else {
+			error("Input where field '%s' not found in input file.\n",val->u.name);
+			field = allocTempField();
+		}
+		*type = noCalcLVal;
 	} else if ((field = lookStr(foodFieldsHash,val->u.name)) ||
 			   (field = lookStr(calculateFieldsHash,val->u.name))) {
 		checkText(field,"where");
@@ -3537,13 +4960,40 @@ void setIfNot(TestPChain* backF) {
 }
 
 
+/* handle the where: commands of the output blocks. the tests of the blocks are made
+   on the obs, so when there are output blocks the tests of where:, if: and if not:
+   are also made on the obs (simpleTest is 0) */
+void setWhereOutputBlocks() {
+	OutputBlock* block = outputBlocks.first;
+	TestChain mainTests;
+	mainTests = tests;
+	while (block) {
+		nolink(tests);
+		if (block->cmds->whereCmd) {
+			TestPChain backT, backF;
+			nolink(backT);
+			nolink(backF);
+			setWhereLexp((Lexp*)block->cmds->whereCmd->args[0],0,&backT,&backF);
+			setWhereBackPatch(&backT,tests.no);
+			setWhereBackPatch(&backF,tests.no+1);
+		}
+		endlink(constants);
+		endlink(tests);
+		block->tests = tests;
+		block = block->next;
+	}
+	tests = mainTests;
+	if (outputBlocks.no) simpleTest = 0;
+}
+
+
 /* handle the group set: command */
 void setGroupSet() {
 	Cmd* cmd = groupSetCmd;
 	
 	nolink(groupSets);
 	nolink(groupSetFields);
-	groupSetFieldsHash = newHashStr(89);
+	groupSetFieldsHash = newHashStr(8,"group set fields");
 	while (cmd) {
 		char* name = cmd->args[0];
 		Exp* e = (Exp*)cmd->args[1];
@@ -3605,69 +5055,88 @@ void setFieldToPosX(Field* field, int onlyRecipe) {
 
 
 
-/* handle the output format: and output fields: commands or uses defaults */
-void setToPos() {
+/* handle an output: and output format: command. the file name is only set if
+   *fileName is NULL */
+void setOutputFile(Cmd* cmd, Cmd* formatCmd, char** fileName, char* sep, char* decPoint,
+				   FileFormat* format) {
 	char dummy;
 
-	if (!outputFileName) outputFileName = outputCmd->args[0];
-	setSepDecPoint(outputCmd->args[1],outputCmd->args[2],&dummy,
-				   &outputSep,&outputDecPoint,&dummy);
+	if (!*fileName) *fileName = cmd->args[0];
+	setSepDecPoint(cmd->args[1],cmd->args[2],&dummy,sep,decPoint,&dummy);
 
 	/* decide the format of the format of the output file */
-	if (outputFormatCmd) {
-		if (strcmp(outputFormatCmd->args[0],"text") == 0) {
-			outputFormat = formatText;
-		} else if (strcmp(outputFormatCmd->args[0],"text-no-head") == 0) {
-			outputFormat = formatTextNoHead;
-		} else if (strcmp(outputFormatCmd->args[0],"bin-native") == 0) {
-			outputFormat = formatBinNative;
-			if (strcmp(outputFileName,"-") == 0)
+	if (formatCmd) {
+		if (strcmp(formatCmd->args[0],"text") == 0) {
+			*format = formatText;
+		} else if (strcmp(formatCmd->args[0],"text-no-head") == 0) {
+			*format = formatTextNoHead;
+		} else if (strcmp(formatCmd->args[0],"bin-native") == 0) {
+			*format = formatBinNative;
+			if (strcmp(*fileName,"-") == 0)
 				error("Output format bin-native can not be used with standard output.\n");
 		} else {
-			error("Unknown output format '%s'.\n",outputFormatCmd->args[0]);
+			error("Unknown output format '%s'.\n",formatCmd->args[0]);
 		}
 	} else {
-		outputFormat = formatText;
+		*format = formatText;
 	}
+}
 
-	if (outputFieldsCmd) {
-		/* handle the output fields: command. The fields may be from foods fiels,
-		   groups files or calculate: commands */
-		char** args = outputFieldsCmd->args;
-		while (*args) {
-			Field* field;
-			if (*args == fieldRange) {
-				char* from;
-				char* to;
-				if (!(from = *++args) || !(to = *++args)) {
-					error("Error in format of range of fields in list of output fields.\n");
-					return;
-				}
-				if (field = lookStr(foodFieldsHash,from)) {
-					while (1) {
-						setFieldToPos(field,0);
-						if (strcmp(field->name,to) == 0) break;
-						if (!(field = field->next)) {
-							error("Ending field in range '%s'--'%s' not found.\n",from,to);
-							break;
-						}
+
+/* handle an output fields: command. The fields may be from the input file, foods
+   files, groups files, calculate: commands or group set: commands. fun is called for
+   each field */
+void setOutputFieldList(Cmd* cmd, void (*fun)(Field*)) {
+	char** args = cmd->args;
+	while (*args) {
+		Field* field;
+		if (*args == fieldRange) {
+			char* from;
+			char* to;
+			if (!(from = *++args) || !(to = *++args)) {
+				error("Error in format of range of fields in list of output fields.\n");
+				return;
+			}
+			if ((field = lookStr(foodFieldsHash,from))) {
+				while (1) {
+					(*fun)(field);
+					if (strcmp(field->name,to) == 0) break;
+					if (!(field = field->next)) {
+						error("Ending field in range '%s'--'%s' not found.\n",from,to);
+						break;
 					}
-				} else {
-					error("Output field '%s' not found.\n",from);
 				}
-			} else if (field = lookStr(inputFieldsHash,*args)) {
-				setFieldToPos(field,0);
-			} else if (field = lookStr(foodFieldsHash,*args)) {
-				setFieldToPos(field,0);
-			} else if (field = lookStr(calculateFieldsHash,*args)) {
-				setFieldToPos(field,0);
-			} else if (field = lookStr(groupSetFieldsHash,*args)) {
-				setFieldToPos(field,0);
 			} else {
-				error("Output field '%s' not found.\n",*args);
-			}
-			args++;
+				error("Output field '%s' not found.\n",from);
+			}
+		} else if ((field = lookStr(inputFieldsHash,*args))) {
+			(*fun)(field);
+		} else if ((field = lookStr(foodFieldsHash,*args))) {
+			(*fun)(field);
+		} else if ((field = lookStr(calculateFieldsHash,*args))) {
+			(*fun)(field);
+		} else if ((field = lookStr(groupSetFieldsHash,*args))) {
+			(*fun)(field);
+		} else {
+			error("Output field '%s' not found.\n",*args);
 		}
+		args++;
+	}
+}
+void setToPosOutput(Field* field) {
+	setFieldToPos(field,0);
+}
+
+
+/* handle the output format: and output fields: commands or uses defaults */
+void setToPos() {
+
+	setOutputFile(outputCmd,outputFormatCmd,&outputFileName,
+				  &outputSep,&outputDecPoint,&outputFormat);
+
+	if (outputFieldsCmd) {
+		/* handle the output fields: command */
+		setOutputFieldList(outputFieldsCmd,&setToPosOutput);
 
 	} else {
 		/* no output fields: command used, so we output all meaningsfull fields (from 
@@ -3769,6 +5238,55 @@ void setToPosGroupBy() {
 }
 
 
+/* handle rollup: commands. a level outputs the output fields, except the group by
+   fields that are not in the level */
+int isRollupField(Rollup* rollup, Field* field) {
+	FieldP* fieldP;
+	for (fieldP = rollup->groupByFields.first; fieldP; fieldP = fieldP->next)
+		if (fieldP->field == field) return(1);
+	for (fieldP = rollup->groupByFoodFields.first; fieldP; fieldP = fieldP->next)
+		if (fieldP->field == field) return(1);
+	return(0);
+}
+void setToPosRollups() {
+	Rollup* rollup = rollups.first;
+	while (rollup) {
+		FieldP* fieldP = outputFields.first;
+		int n = noRealOutputFields;
+		nolink(rollup->outputFields);
+		while (n--) {
+			if (!fieldP->field->groupBy || isRollupField(rollup,fieldP->field))
+				link(rollup->outputFields,allocFieldP(fieldP->field));
+			fieldP = fieldP->next;
+		}
+		endlink(rollup->outputFields);
+		rollup = rollup->next;
+	}
+}
+
+
+/* handle summary output: command. the stratify field must be an output field */
+void setToPosSummary() {
+	if (summaryOutputCmd) {
+		char* name = summaryOutputCmd->args[0];
+		summaryOutput = 1;
+		summaryStratify = -1;
+		if (name) {
+			FieldP* fieldP = outputFields.first;
+			int i;
+			for (i = 0; i < noRealOutputFields; i++, fieldP = fieldP->next)
+				if (strcmp(fieldP->field->name,name) == 0) summaryStratify = i;
+			if (summaryStratify < 0)
+				error("Summary output field '%s' is not an output field.\n",name);
+		}
+		if (outputFormat == formatBinNative)
+			error("The summary output: command can not be used with output format bin-native.\n");
+		if (saveBin || library)
+			error("The summary output: command can not be used with save: or the library.\n");
+	}
+}
+
+
 /* handle recipe sum: command */	
 void setToPosRecipeSum() {
 	if (recipeSumField) {
@@ -3879,6 +5397,57 @@ void setToPosWhere() {
 }
 
 
+/* handle the output fields:, group by: and where: commands of the output blocks. all
+   the fields are added to the obs, if they are not already there */
+OutputBlock* currentOutputBlock;	/* the block setToPosBlockField() adds to */
+int isBlockGroupBy(OutputBlock* block, Field* field) {
+	FieldP* fieldP;
+	for (fieldP = block->groupByFields.first; fieldP; fieldP = fieldP->next)
+		if (fieldP->field == field) return(1);
+	for (fieldP = block->groupByFoodFields.first; fieldP; fieldP = fieldP->next)
+		if (fieldP->field == field) return(1);
+	return(0);
+}
+void setToPosBlockField(Field* field) {
+	OutputBlock* block = currentOutputBlock;
+	if (field->text) {
+		error("Output field '%s' must not be a text field.\n",field->name);
+	} else if ((block->groupByFields.no || block->groupByFoodFields.no) && field->noCalc
+			   && !isBlockGroupBy(block,field)) {
+		error("Can not output field '%s' in output block '%s' because it is a no-calc field and not a group by field.\n",
+			field->name,block->cmds->name);
+	} else if (groupByCmd && !(block->groupByFields.no || block->groupByFoodFields.no)
+			   && lookStr(groupSetFieldsHash,field->name) == field) {
+		error("Can not output group set field '%s' in output block '%s' without group by.\n",
+			field->name,block->cmds->name);
+	} else {
+		link(block->outputFields,allocFieldP(field));
+		setFieldToPosX(field,0);
+	}
+}
+void setToPosOutputBlocks() {
+	OutputBlock* block = outputBlocks.first;
+	while (block) {
+		FieldP* fieldP;
+		Test* test;
+		currentOutputBlock = block;
+		nolink(block->outputFields);
+		if (block->cmds->outputFieldsCmd)
+			setOutputFieldList(block->cmds->outputFieldsCmd,&setToPosBlockField);
+		endlink(block->outputFields);
+		for (fieldP = block->groupByFields.first; fieldP; fieldP = fieldP->next)
+			setFieldToPosX(fieldP->field,0);
+		for (fieldP = block->groupByFoodFields.first; fieldP; fieldP = fieldP->next)
+			setFieldToPosX(fieldP->field,0);
+		for (test = block->tests.first; test; test = test->next) {
+			setFieldToPosX(test->field1,0);
+			setFieldToPosX(test->field2,0);
+		}
+		block = block->next;
+	}
+}
+
+
 /* handle set: and recipe set: commands. We only do calculations if the new set field
    is an output field. All fields used in a calculation must be output, so they are
    reduced if they are food table fields or calculated if they them self are calculate
@@ -3987,11 +5556,10 @@ void logToPosSet() {
 	logToPosSetH(groupSets.first,"Group set");
 }
 
-void logToPosWhere() {
-	Test* test = tests.first;
+void logToPosWhere(Test* test, char* cmdName) {
 	int no = 0;
 	if (test) {
-		logmsg("+++where:\n");
+		logmsg("+++%s:\n",cmdName);
 		while (test) {
 			logmsg("          %d: ",no++);
 			logToPosField(test->field1);
@@ -4145,6 +5713,30 @@ void setFromPosGroups(GroupsFile* groupsFile) {
 }
 
 
+/* leave out the nutrient fields of a long foods file which are not in the food table,
+   so its rows only get room for the values that are kept */
+void setFromPosLongFoods(FoodsFile* foodsFile) {
+	LongFoods* longFoods = foodsFile->longFoods;
+	FieldPChain* fieldPs = arenaStruct(&treeArena,FieldPChain);
+	FieldP* fieldP = foodsFile->fieldPs->first;
+	int* newPos = alloc(foodsFile->fieldPs->no*sizeof(int));
+	int pos, no;
+
+	nolink(*fieldPs);
+	for (pos = 0; fieldP; fieldP = fieldP->next, pos++) {
+		if (pos == 0 || (fieldP->field->fromPos && !fieldP->field->text)) {
+			newPos[pos] = fieldPs->no;
+			link(*fieldPs,allocFieldP(fieldP->field));
+		} else newPos[pos] = -1;
+	}
+	endlink(*fieldPs);
+	for (no = 0; no <= longFoods->maxNutrNo; no++)
+		if (longFoods->nutrPos[no] > 0) longFoods->nutrPos[no] = newPos[longFoods->nutrPos[no]];
+	free(newPos);
+	foodsFile->fieldPs = fieldPs;
+}
+
+
 /* handle foods fields */
 void setFromPosFoods() {
 
@@ -4163,6 +5755,7 @@ void setFromPosFoods() {
 		if (foodsFile != foodsFiles.first && foodId->fromPos 
 			&& foodsFile->noFromFields == 1) 
 			foodsFile->noFromFields = 0;
+		if (foodsFile->noFromFields && foodsFile->longFoods) setFromPosLongFoods(foodsFile);
 		
 		foodsFile = foodsFile->next;
 	}
@@ -4180,11 +5773,14 @@ void setFromPosFoods() {
 void readFields() {
 
 	nolink(foodFields);
-	foodFieldsHash = newHashStr(547);
+	foodFieldsHash = newHashStr(256,"food fields");
 	initConstants();
 
 	/* sub-step A: check files and get list of fields from the files: */
 	setSave();
+	setProfile();
+	setProgress();
+	setCache();
 	setFoods();
 	setGroups();
 	setRecipeSet1();
@@ -4196,8 +5792,11 @@ void readFields() {
 	   for all fields: */
 	setNoCalc();
 	setText();
+	setCode();
 	setNonEdible();
 	setGroupBy();
+	setOutputBlocks();
+	setRollups();
 	setSet();
 	setCalculate();
 	setRecipeSum();
@@ -4206,7 +5805,9 @@ void readFields() {
 	setReduct();
 	setRecipeReduct();
 	setTranspose();
+	setInputWhere();
 	setWhere();
+	setWhereOutputBlocks();
 	setGroupSet();
 
 	/* sub-step C: set toPos and onlyRecipe for all fields: */
@@ -4214,15 +5815,22 @@ void readFields() {
 	setToPos();
 	setToPosTranspose();
 	setToPosGroupBy();
+	setToPosRollups();
+	setToPosSummary();
 	setToPosCook();
 	setToPosReduct();
 	setToPosRecipeSum();
 	setToPosRecipeReduct();
 	setToPosWhere();
+	setToPosOutputBlocks();
 	setToPosSet();
 	setToPosRecipes();
 	endlink(outputFields);
-	if (verbosity >= 95) {logToPosSet(); logToPosWhere();}
+	if (verbosity >= 95) {
+		logToPosSet();
+		logToPosWhere(tests.first,"where");
+		logToPosWhere(inputTests.first,"input where");
+	}
 	if (errors) return;
 
 	/* sub-step D: set fromPos for all food table fields. also check for type of fields: */
@@ -4247,12 +5855,15 @@ void readFields() {
 
 
 /* read a line from a data file. no should be number of values in lines. On return
-   the line array will contain the values read. Returns 1 if no errors, 0 otherwise */
-int readNumLine(Num* line, int no, int* text, int star) {
+   the line array will contain the values read. Returns 1 if no errors, 0 otherwise.
+   skip[i] should be 1 if value i is not to be converted to a number (text fields
+   and fields not used) - the value is then skipped and set to 0 - and 2 if value i
+   is a code, which is set to the no of the code */
+int readNumLine(Num* line, int no, int* skip, int star) {
 	while (1) { /* loop until we get a line without errors or reach eof */
 		Num* p = line;
 		int n = no;
-		int* t = text;
+		int* t = skip;
 		int inStar = 0;
 		skipComment(); /* skip any comment lines */
 		if (eof()) return(0); /* we reached the end of the file */
@@ -4270,7 +5881,15 @@ int readNumLine(Num* line, int no, int* text, int star) {
 				skipLine();
 				break;
 			}
-			if (*t++) {
+			if (*t == 2) {
+				t++;
+				if (!getStr2()) {
+					fileError("Error in list of values");
+					skipLine();
+					break;
+				}
+				*p++ = (Num)codeNo(str);
+			} else if (*t++) {
 				if (!skipStr2()) {
 					fileError("Error in list of values");
 					skipLine();
@@ -4307,7 +5926,7 @@ int readNumLine(Num* line, int no, int* text, int star) {
 					if (inStar) break; /* we read a star line with no errors */
 					else return(1); /* we read a non-star line with no errors */
 				}
-				if (ch = separator) {getch(); skipSpace();}
+				if (ch == separator) {getch(); skipSpace();}
 				else {
 					fileError("Error in list of values");
 					skipLine();
@@ -4322,7 +5941,7 @@ int readNumLine(Num* line, int no, int* text, int star) {
 /* read a line from a binary file. Use only this function if sizeof(Num) != sizeof(double).
    Used just like radNumLine(). Before it is called the first time you must allocate an
    array of doubles with length equal to no and assign it to read4buf. */
-double* read4buf;
+threadLocal double* read4buf;
 int readNumBinNative4(Num* line, int no, int* dummy1, int dummy2) {
 	int read;
 	double* b = read4buf;
@@ -4360,6 +5979,396 @@ int readNumBinNative(Num* line, int no, int* dummy1, int dummy2) {
 /*** STEP 3 */
 
 
+/* readGroups() and readFoods() get the lines of the groups and foods files from a
+   Staging. If more than one groups or foods file is to be read, stageFiles() starts a
+   thread for each of them reading the lines of the file into the rows of its Staging,
+   so the files are read at the same time. readGroups() and readFoods() still put the
+   lines into the food table one file after the other in the order of the commands, so
+   a later foods file overwrites the values of an earlier one just as if the files were
+   read one by one. Otherwise nextStaged() just reads the lines of the file. The files
+   of a usda foods: command are always read into the rows first, by readUsda(), and so
+   are the lines of a long foods: command, by readLongFoods() */
+typedef struct Staging_ {
+	File* file;			/* the file */
+	UsdaFiles* usda;	/* the USDA files, if it is a usda foods: command */
+	LongFoods* longFoods; /* the fields, if it is a long foods: command */
+	int noFields;		/* no of values in a line */
+	int* skip;			/* skip (text or not used) array */
+	int star;			/* no of star fields */
+	int threaded;		/* 1 if the file is read by a thread of its own */
+	int started;		/* 1 when nextStaged() has been called */
+	Num* rows;			/* array[size*noFields] of the lines read by the thread */
+	int* lineNos;		/* array[size] of lineNo after each line was read */
+	int noRows;			/* no of lines read by the thread */
+	int size;			/* no of lines there is room for in rows */
+	int next;			/* the next line nextStaged() gives */
+	long bytes;			/* bytes in the file, when all lines are read */
+	long lines;			/* lines in the file, when all lines are read */
+	int errors;			/* errors of the thread */
+	double wall;		/* wall and cpu seconds used on the file by its thread and by */
+	double cpu;			/* nextStaged() after the thread, if the file is threaded */
+#ifdef HAVE_PIPELINE
+	pthread_t thread;
+#endif
+} Staging;
+
+
+Staging* newStaging(File* file, FieldPChain* fieldPs, int star) {
+	Staging* staging = allocStruct(Staging);
+	FieldP* fieldP = fieldPs->first;
+	int* skipp;
+	memset(staging,0,sizeof(Staging));
+	staging->file = file;
+	staging->noFields = fieldPs->no;
+	staging->skip = skipp = alloc(staging->noFields*sizeof(int));
+	staging->star = star;
+	while (fieldP) {
+		*skipp++ = (fieldP->field->text || !fieldP->field->fromPos ? 1 :
+			fieldP->field->code ? 2 : 0);
+		fieldP = fieldP->next;
+	}
+	return(staging);
+}
+
+
+/* read the USDA files of a usda foods: command into the rows of its Staging. each food
+   in FOOD_DES.TXT gets a row, and each value in NUT_DATA.TXT is put in the row of its
+   food, which is found in a hash of the food ids. Foods without any values are left
+   out, as FCUSDA.PL does. It only uses alloc(), as it may run in a thread of its own */
+void readUsda(Staging* staging) {
+	UsdaFiles* usda = staging->usda;
+	int noFields = staging->noFields;
+	Num line[32];
+	int n, r, noUsed = 0;
+	int* hash;			/* the row no+1 of each food id, or 0 */
+	unsigned int mask;	/* size of hash - 1 */
+	char* used;			/* array[noRows] of 1 if the food has any values */
+	int noNoFood = 0, noNoNutr = 0;
+
+	staging->size = 1024;
+	staging->rows = alloc(staging->size*noFields*sizeof(Num));
+	staging->lineNos = alloc(staging->size*sizeof(int));
+
+	/* the foods. a line is like ~01001~^~0100~^~Butter, salted~^~BUTTER,WITH SALT~^
+	   ...^0^...^6.38^4.27^8.79^3.87, where the no of fields differs between the
+	   versions of the database. Refuse is always 6th field from the end */
+	setCurrent(usda->foodDes);
+	while ((n = readUsdaLine(line,32))) {
+		Num* row;
+		int i;
+		if (n < 11 || n > 32) {
+			error("Error in list of values in line %d of file %s.\n",lineNo-1,currentFileName);
+			continue;
+		}
+		if (staging->noRows == staging->size) { /* no more room, so double it */
+			Num* rows = alloc(2*staging->size*noFields*sizeof(Num));
+			int* lineNos = alloc(2*staging->size*sizeof(int));
+			memcpy(rows,staging->rows,staging->size*noFields*sizeof(Num));
+			memcpy(lineNos,staging->lineNos,staging->size*sizeof(int));
+			free(staging->rows); free(staging->lineNos);
+			staging->rows = rows; staging->lineNos = lineNos;
+			staging->size *= 2;
+		}
+		row = staging->rows+staging->noRows*noFields;
+		for (i = 0; i < noFields; i++) row[i] = (Num)0.0;
+		row[0] = line[0];		/* NDB_No */
+		row[3] = line[1];		/* FdGp_Cd */
+		row[4] = line[n-6];		/* Refuse */
+		row[5] = line[n-6]/(Num)100.0; /* Non_edible */
+		for (i = 0; i < 4; i++) row[6+i] = line[n-4+i]; /* the factors */
+		staging->lineNos[staging->noRows++] = lineNo;
+	}
+	staging->bytes = currentBytes();
+	staging->lines = lineNo-1;
+	closeCurrent();
+
+	{	/* the hash of the food ids. it is filled from the last row, so if a food id
+		   is in more rows the values are put in the last, which is the one used */
+		unsigned int size = 16;
+		while (size < 2*(unsigned int)staging->noRows) size *= 2;
+		mask = size-1;
+		hash = allocarray(size,sizeof(int));
+		for (r = staging->noRows-1; r >= 0; r--) {
+			int key = (int)staging->rows[r*noFields];
+			unsigned int h = hashMix(key) & mask;
+			while (hash[h] && (int)staging->rows[(hash[h]-1)*noFields] != key)
+				h = (h+1) & mask;
+			if (!hash[h]) hash[h] = r+1;
+		}
+		used = allocarray(staging->noRows+1,sizeof(char));
+	}
+
+	/* the values. a line is like ~01001~^~203~^0.85^16^0.074^~1~ with the food id,
+	   the nutrient no and the value first */
+	setCurrent(usda->nutData);
+	while ((n = readUsdaLine(line,3))) {
+		int key = (int)line[0];
+		int nutrNo = (int)line[1];
+		unsigned int h = hashMix(key) & mask;
+		if (n < 3) {
+			error("Error in list of values in line %d of file %s.\n",lineNo-1,currentFileName);
+			continue;
+		}
+		while (hash[h] && (int)staging->rows[(hash[h]-1)*noFields] != key)
+			h = (h+1) & mask;
+		if (!hash[h]) {noNoFood++; continue;}
+		if (nutrNo < 0 || nutrNo > usda->maxNutrNo || usda->nutrPos[nutrNo] < 0)
+			{noNoNutr++; continue;}
+		r = hash[h]-1;
+		staging->rows[r*noFields+usda->nutrPos[nutrNo]] = line[2];
+		used[r] = 1;
+	}
+	staging->bytes += currentBytes();
+	staging->lines += lineNo-1;
+	closeCurrent();
+
+	/* leave out the foods without values */
+	for (r = 0; r < staging->noRows; r++) {
+		if (used[r]) {
+			if (r != noUsed) {
+				memcpy(staging->rows+noUsed*noFields,staging->rows+r*noFields,
+					noFields*sizeof(Num));
+				staging->lineNos[noUsed] = staging->lineNos[r];
+			}
+			noUsed++;
+		}
+	}
+	if (noNoFood)
+		warning("%d values in %s are for foods not in %s.\n",noNoFood,
+			usda->nutData->name,usda->foodDes->name);
+	if (noNoNutr)
+		warning("%d values in %s are for nutrients not in %s.\n",noNoNutr,
+			usda->nutData->name,usda->nutrDef->name);
+	if (staging->noRows > noUsed)
+		warning("%d foods in %s have no values in %s, and are not used.\n",
+			staging->noRows-noUsed,usda->foodDes->name,usda->nutData->name);
+	staging->noRows = noUsed;
+	free(hash);
+	free(used);
+}
+
+
+/* read a long foods file into the rows of its Staging. a food gets a row the first time
+   its id is seen, and is found again in a hash of the food ids, which is doubled when
+   it is half full. each value is put in the row of its food at the field of its
+   nutrient id, so the rows are like the lines of a foods file with a field for each
+   nutrient. Values of nutrients not in the food table are not kept. It only uses
+   alloc(), as it may run in a thread of its own */
+void readLongFoods(Staging* staging) {
+	LongFoods* longFoods = staging->longFoods;
+	int noFields = staging->noFields;
+	Num* line = alloc(longFoods->noFileFields*sizeof(Num));
+	unsigned int mask = 63;	/* size of hash - 1 */
+	int* hash = allocarray(mask+1,sizeof(int)); /* the row no+1 of each food id, or 0 */
+
+	longFoods->fileSkip[longFoods->foodCol] = staging->skip[0]; /* 2 if a code */
+	staging->size = 1024;
+	staging->rows = alloc(staging->size*noFields*sizeof(Num));
+	staging->lineNos = alloc(staging->size*sizeof(int));
+	setCurrent(staging->file);
+	while (readNumLine(line,longFoods->noFileFields,longFoods->fileSkip,0)) {
+		int key = (int)line[longFoods->foodCol];
+		int no = (int)line[longFoods->nutrCol];
+		unsigned int h = hashMix(key) & mask;
+		Num* row;
+		int pos;
+
+		while (hash[h] && (int)staging->rows[(hash[h]-1)*noFields] != key)
+			h = (h+1) & mask;
+		if (hash[h]) {
+			row = staging->rows+(hash[h]-1)*noFields;
+		} else { /* a new food */
+			int i;
+			if (staging->noRows == staging->size) { /* no more room, so double it */
+				Num* rows = alloc(2*staging->size*noFields*sizeof(Num));
+				int* lineNos = alloc(2*staging->size*sizeof(int));
+				memcpy(rows,staging->rows,staging->size*noFields*sizeof(Num));
+				memcpy(lineNos,staging->lineNos,staging->size*sizeof(int));
+				free(staging->rows); free(staging->lineNos);
+				staging->rows = rows; staging->lineNos = lineNos;
+				staging->size *= 2;
+			}
+			row = staging->rows+staging->noRows*noFields;
+			for (i = 0; i < noFields; i++) row[i] = (Num)0.0;
+			row[0] = line[longFoods->foodCol];
+			staging->lineNos[staging->noRows++] = lineNo;
+			hash[h] = staging->noRows;
+			if (2*(unsigned int)staging->noRows > mask) { /* half full, so double it */
+				int r;
+				mask = 2*mask+1;
+				free(hash);
+				hash = allocarray(mask+1,sizeof(int));
+				for (r = 0; r < staging->noRows; r++) {
+					h = hashMix((int)staging->rows[r*noFields]) & mask;
+					while (hash[h]) h = (h+1) & mask;
+					hash[h] = r+1;
+				}
+			}
+		}
+		if (no >= 0 && no <= longFoods->maxNutrNo && (pos = longFoods->nutrPos[no]) > 0
+			&& !staging->skip[pos])
+			row[pos] = line[longFoods->valueCol];
+	}
+	staging->bytes = currentBytes();
+	staging->lines = lineNo-1;
+	closeCurrent();
+	free(hash);
+	free(line);
+}
+
+
+#ifdef HAVE_PIPELINE
+/* the thread reading all the lines of a file into the rows of its Staging */
+void* stageThread(void* arg) {
+	Staging* staging = arg;
+	int noFields = staging->noFields;
+	Num* line;
+
+	staging->wall = -wallTime();
+	staging->cpu = -threadCpuTime();
+	if (staging->usda || staging->longFoods) {
+		if (staging->usda) readUsda(staging); else readLongFoods(staging);
+		staging->errors = errors;
+		staging->wall += wallTime();
+		staging->cpu += threadCpuTime();
+		return(NULL);
+	}
+	line = alloc(noFields*sizeof(Num));
+	staging->size = 1024;
+	staging->rows = alloc(staging->size*noFields*sizeof(Num));
+	staging->lineNos = alloc(staging->size*sizeof(int));
+	setCurrent(staging->file);
+	while (readNumLine(line,noFields,staging->skip,staging->star)) {
+		if (staging->noRows == staging->size) { /* no more room, so double it */
+			Num* rows = alloc(2*staging->size*noFields*sizeof(Num));
+			int* lineNos = alloc(2*staging->size*sizeof(int));
+			memcpy(rows,staging->rows,staging->size*noFields*sizeof(Num));
+			memcpy(lineNos,staging->lineNos,staging->size*sizeof(int));
+			free(staging->rows); free(staging->lineNos);
+			staging->rows = rows; staging->lineNos = lineNos;
+			staging->size *= 2;
+		}
+		/* the whole line is kept, as star lines only set the star fields */
+		memcpy(staging->rows+staging->noRows*noFields,line,noFields*sizeof(Num));
+		staging->lineNos[staging->noRows++] = lineNo;
+	}
+	staging->bytes = currentBytes();
+	staging->lines = lineNo-1;
+	closeCurrent();
+	free(line);
+	staging->errors = errors;
+	staging->wall += wallTime();
+	staging->cpu += threadCpuTime();
+	return(NULL);
+}
+#endif
+
+
+/* make the Staging of each groups and foods file to be read, and if there is more than
+   one start reading them in threads of their own */
+void stageFiles() {
+	GroupsFile* groupsFile = groupsFiles.first;
+	FoodsFile* foodsFile = foodsFiles.first;
+	int noFiles = 0;
+
+	while (groupsFile) {
+		groupsFile->staging = NULL;
+		if (groupsFile->noFromFields) {
+			groupsFile->staging = newStaging(groupsFile->file,groupsFile->fieldPs,
+				groupsFile->starFields);
+			noFiles++;
+		}
+		groupsFile = groupsFile->next;
+	}
+	while (foodsFile) {
+		foodsFile->staging = NULL;
+		if (foodsFile->noFromFields) {
+			foodsFile->staging = newStaging(foodsFile->file,foodsFile->fieldPs,
+				foodsFile->starFields);
+			foodsFile->staging->usda = foodsFile->usda;
+			foodsFile->staging->longFoods = foodsFile->longFoods;
+			noFiles++;
+		}
+		foodsFile = foodsFile->next;
+	}
+
+#ifdef HAVE_PIPELINE
+	/* with code fields the files are read one by one, so the codes always get the
+	   same nos */
+	if (noFiles > 1 && !codeFieldsCmd) {
+		groupsFile = groupsFiles.first;
+		while (groupsFile) {
+			if (groupsFile->staging) {
+				Staging* staging = groupsFile->staging;
+				staging->threaded = !pthread_create(&staging->thread,NULL,stageThread,staging);
+			}
+			groupsFile = groupsFile->next;
+		}
+		foodsFile = foodsFiles.first;
+		while (foodsFile) {
+			if (foodsFile->staging) {
+				Staging* staging = foodsFile->staging;
+				staging->threaded = !pthread_create(&staging->thread,NULL,stageThread,staging);
+			}
+			foodsFile = foodsFile->next;
+		}
+		logmsg("Reading %d groups and foods files at the same time.\n\n",noFiles);
+	}
+#endif
+}
+
+
+/* get the next line of a staged file into line. returns 0 when there are no more */
+int nextStaged(Staging* staging, Num* line) {
+	if (!staging->threaded && !staging->usda && !staging->longFoods) {
+		if (!staging->started) {setCurrent(staging->file); staging->started = 1;}
+		if (readNumLine(line,staging->noFields,staging->skip,staging->star)) return(1);
+		staging->bytes = currentBytes();
+		staging->lines = lineNo-1;
+		closeCurrent();
+		return(0);
+	}
+	if (!staging->started) {
+#ifdef HAVE_PIPELINE
+		if (staging->threaded) { /* wait for the thread to read the file */
+			pthread_join(staging->thread,NULL);
+			errors += staging->errors;
+			staging->wall -= wallTime();
+			staging->cpu -= threadCpuTime();
+		} else
+#endif
+		if (staging->usda) readUsda(staging); else readLongFoods(staging);
+		currentFileName = staging->file->name;
+		staging->started = 1;
+		if (errors > 20) abortAndExit("Too many errors!\n");
+	}
+	if (staging->next < staging->noRows) {
+		memcpy(line,staging->rows+staging->next*staging->noFields,
+			staging->noFields*sizeof(Num));
+		lineNo = staging->lineNos[staging->next++];
+		return(1);
+	}
+	free(staging->rows); free(staging->lineNos);
+	staging->rows = NULL; staging->lineNos = NULL;
+	if (staging->threaded) {
+		staging->wall += wallTime();
+		staging->cpu += threadCpuTime();
+	}
+	return(0);
+}
+
+/* end the timing of a staged file. the time of a file read by a thread of its own is
+   the time of the thread and of getting the lines after it, without the time waiting
+   for the thread, and the cpu time of the other threads reading at the same time */
+void endStagedTiming(Timing* timing, Staging* staging) {
+	endTiming(timing,staging->bytes,staging->lines);
+	if (staging->threaded) {
+		timing->wall = staging->wall;
+		timing->cpu = staging->cpu;
+	}
+}
+
+
 /* this functions is STEP 3. It reads the groups files which contributes fields to
    the food table. The groups read are inserted in the hash'es in the GroupsFile
    structures. */
@@ -4370,21 +6379,22 @@ void readGroups() {
 		if (noFrom) { /* only if it has fields in the food table */
 			int noFields = groupsFile->fieldPs->no;
 			int noIds = groupsFile->groupIds->no;
-			HashInt* hash = newHashIntN(241,noIds);
-			Num* line = alloc(noFields*sizeof(Num));/* input buffer */
-			int* text = alloc(noFields*sizeof(int));/* text type array */
-			Num** ids = alloc(noIds*sizeof(Num*));	/* pointers to id fields in line */
-			int* key = alloc(noIds*sizeof(int));	/* key values */
-			int star = groupsFile->starFields;		/* no of star fields */
-			Num** move = alloc(noFrom*sizeof(Num*));/* pointers to fields in line to move to obs */
-			Num* obs = alloc(noFrom*sizeof(Num));	/* obs to insert in hash */
+			HashInt* hash = newHashIntN(64,noIds,groupsFile->file->name);
+			Num* line = arenaAlloc(&scratchArena,noFields*sizeof(Num));/* input buffer */
+			Num** ids = arenaAlloc(&scratchArena,noIds*sizeof(Num*));	/* pointers to id fields in line */
+			int* key = arenaAlloc(&scratchArena,noIds*sizeof(int));	/* key values */
+			Num** move = arenaAlloc(&scratchArena,noFrom*sizeof(Num*));/* pointers to fields in line to move to obs */
+			Num* obs;								/* obs to insert in hash */
 			int groups = 0;							/* no of groups read */
+			Timing* timing = startTiming(groupsFile->file->name,1);
 
-			{	/* build the move and text arrays and find the id fields */
+			hash->arena = &foodArena;
+			obs = arenaAlloc(&foodArena,noFrom*sizeof(Num));
+
+			{	/* build the move array and find the id fields */
 				FieldP* fieldP = groupsFile->fieldPs->first;
 				Num* linep = line;
 				Num** movep = move;
-				int* textp = text;
 				while (fieldP) {
 					Field* field = fieldP->field;
 					if (field->fromPos) {
@@ -4396,15 +6406,13 @@ void readGroups() {
 						}
 						*movep++ = linep;
 					}
-					*textp++ = field->text;
 					linep++;
 					fieldP = fieldP->next;
 				}
 			}
 
 			/* read the file */
-			setCurrent(groupsFile->file);
-			while (readNumLine(line,noFields,text,star)) {
+			while (nextStaged(groupsFile->staging,line)) {
 				int i = 0;
 				int n = noFrom;
 				Num* obsp = obs;
@@ -4424,12 +6432,12 @@ void readGroups() {
 					error("Dublicate group id at line %d of file %s.\n",
 						lineNo-1,currentFileName);
 				} else {
-					obs = alloc(noFrom*sizeof(Num)); /* new obs to insert in hash */
+					obs = arenaAlloc(&foodArena,noFrom*sizeof(Num)); /* new obs to insert in hash */
 					groups++;
 				}
 			}
-			closeCurrent();
 			groupsFile->hash = hash;
+			endStagedTiming(timing,groupsFile->staging);
 
 			{	/* log what we did */
 				int lineLen = 0;
@@ -4450,6 +6458,7 @@ void readGroups() {
 			logmsg("Did not have to read groups file %s.\n\n",groupsFile->file->name);
 		}
 
+		resetArena(&scratchArena); /* free the buffers used for the file */
 		groupsFile = groupsFile->next;
 	}
 }
@@ -4466,27 +6475,26 @@ void readFoods() {
 	FoodsFile* foodsFile = foodsFiles.first;
 	int noTableFields = foodTableFields.no;
 
-	foodTable = newHashInt(3571);
+	foodTable = newHashInt(1024,"food table");
+	foodTable->arena = &foodArena;
 
 	while (foodsFile) { /* the foods files are read one by one */
 		int noFrom = foodsFile->noFromFields;
 		if (noFrom) { /* only if it has fields in the food table */
 			int noFields = foodsFile->fieldPs->no;
-			Num* line = alloc(noFields*sizeof(Num));	/* input buffer */
-			int* text = alloc(noFields*sizeof(int));	/* text type array */
-			int star = foodsFile->starFields;			/* no of star fields */
+			Num* line = arenaAlloc(&scratchArena,noFields*sizeof(Num));	/* input buffer */
 			Num* id;									/* ponter to food id in line */
-			Num** move = alloc(noTableFields*sizeof(Num*)); /* pointers to fields to move from line to obs */
-			Num* obs = alloc(noTableFields*sizeof(Num)); /* obs to insert in foodEntry */
+			Num** move = arenaAlloc(&scratchArena,noTableFields*sizeof(Num*)); /* pointers to fields to move from line to obs */
+			Num* obs = arenaAlloc(&foodArena,noTableFields*sizeof(Num)); /* obs to insert in foodEntry */
 			FoodEntry* foodEntry = allocFoodEntry(simpleFood,obs); /* food entry to insert in foodTable hash */
 			int foods = 0;								/* no of foods read */
+			Timing* timing = startTiming(foodsFile->file->name,1);
 
-			{	/* build the move and text arraya and find the id field */
+			{	/* build the move array and find the id field */
 				FieldP* fieldP = foodsFile->fieldPs->first;
 				Num** zerop = move;
 				int n = noTableFields;
 				Num* linep = line;
-				int* textp = text;
 				while (n--) *zerop++ = NULL;
 				while (fieldP) {
 					Field* field = fieldP->field;
@@ -4494,15 +6502,13 @@ void readFoods() {
 						move[field->fromPos-1] = linep;
 						if (foodId == field) id = linep;
 					}
-					*textp++ = field->text;
 					linep++;
 					fieldP = fieldP->next;
 				}
 			}
 
-			setCurrent(foodsFile->file);
 			/* we read the whole file... */
-			while (readNumLine(line,noFields,text,star)) {
+			while (nextStaged(foodsFile->staging,line)) {
 				/* line read into an array. we try to insert the array into the food table */
 				int key = (int)*id;
 				int n = noTableFields;
@@ -4529,11 +6535,11 @@ void readFoods() {
 					}
 					foods++;
 					totFoods++;
-					obs = alloc(noTableFields*sizeof(Num));
+					obs = arenaAlloc(&foodArena,noTableFields*sizeof(Num));
 					foodEntry = allocFoodEntry(simpleFood,obs);
 				}
 			}
-			closeCurrent();
+			endStagedTiming(timing,foodsFile->staging);
 
 			{	/* log what we did */
 				int lineLen = 0;
@@ -4554,6 +6560,7 @@ void readFoods() {
 			logmsg("Did not have to read foods file %s.\n\n",foodsFile->file->name);
 		}
 
+		resetArena(&scratchArena); /* free the buffers used for the file */
 		foodsFile = foodsFile->next;
 	}
 
@@ -4573,10 +6580,10 @@ void expandGroups() {
 		if (noFrom) { /* only if it adds fields to the food table */
 			HashInt* hash = groupsFile->hash;
 			int noIds = groupsFile->groupIds->no;	/* no of id fields */
-			int* idPos = alloc(noIds*sizeof(int));	/* position of the group ids in the food table */
-			int* idGroupPos = alloc(noIds*sizeof(int));/* position of the group ids in the groups file */
-			int* movePos = alloc(noFrom*sizeof(int)); /* array with positions in the food table */
-			int* key = alloc(noIds*sizeof(int));
+			int* idPos = arenaAlloc(&scratchArena,noIds*sizeof(int));	/* position of the group ids in the food table */
+			int* idGroupPos = arenaAlloc(&scratchArena,noIds*sizeof(int));/* position of the group ids in the groups file */
+			int* movePos = arenaAlloc(&scratchArena,noFrom*sizeof(int)); /* array with positions in the food table */
+			int* key = arenaAlloc(&scratchArena,noIds*sizeof(int));
 
 			{	/* set idPos */
 				int i = 0;
@@ -4633,7 +6640,7 @@ void expandGroups() {
 								while (n--) 
 									obs[*movePosp++] = *groupObs++;
 							} else {
-								Num* groupObs = allocarray(noFrom,sizeof(Num));
+								Num* groupObs = arenaArray(&foodArena,noFrom,sizeof(Num));
 								int i = 0;
 								while (i < noIds) groupObs[idGroupPos[i]] = obs[idPos[i++]];
 								insertIntN(hash,key,groupObs);
@@ -4647,27 +6654,388 @@ void expandGroups() {
 			}
 
 		}
+		resetArena(&scratchArena); /* free the buffers used for the file */
 		groupsFile = groupsFile->next;
 	}
 }
 
 
 
-/****************************************************************************/
-/*** Utility functions to write lines to file output. These functions has type
-     void fun(Num*,int) */
-
+/*********************************************************************************/
+/*** FoodCalc() function. This function does the actual food calculations. It is
+     split in two: a FoodCalcPlan, which is the compiled version of the semantic
+     tree, and a FoodCalcContext, which is the state of a single run of the plan over
+     an input file. The plan is set by the set...Pos() functions below and is not
+     changed by foodCalc(), so one plan (and the food table) can be used by many runs
+     at the same time, each with its own context. Note that foodCalc() is used both to
+     calculate the output from the input, and to calculate recipes from recipes
+     files! */
 
-/* write a line to a data file. no should be number of values in lines and the obs
-   array should contain the values to write. */
-void outputLine(Num* obs, int no) {
 
-	while (no--) {
-		Num num = *obs++;
-		
-		if (num < 0.0001 && num > -0.0001) {
-			/* so near zero that we declare it zero */
-			putc('0',output);
+/*=== the plan. all positions are positions in the line (the input values) or in the
+   obs (the output values) of a context */
+
+typedef struct {		/* Cook reduction: */
+	int foodPos;			/* position of reduct field in food table */
+	int noOutput;			/* no of fields to reduce */
+	int noTestOutput;		/* no of the first fields in output needed by the tests */
+	int* output;			/* array[noOutput] of positions of fields to reduce in obs */
+} XCook;
+typedef struct {		/* Cook type: */
+	int no;					/* no of cook reductions */
+	XCook* cook;			/* array[no] of cook reductions */
+} XCookType;
+
+typedef struct {		/* reduction: */
+	int input;				/* position of reduct field in line */
+	int noOutput;			/* no of fields to reduce */
+	int noTestOutput;		/* no of the first fields in output needed by the tests */
+	int* output;			/* array[noOutput] of positions of fields to reduce in obs */
+} XReduct;
+
+typedef struct {		/* weight reduction: */
+	int input;				/* position of reduct field in line */
+	int output;				/* position of fraction field in obs */
+} XWeightReduct;
+
+typedef struct {		/* operation */
+	int output;				/* position of field in obs to operate on */
+	SetOp op;				/* operator */
+	union {
+		int operan;			/* position of field in obs to use as operands */
+		Num num;			/* number to use as operand */
+	} u;
+} XSet;
+
+typedef struct {		/* operation */
+	int pos;				/* position of field in obs to operate on */
+	SetOp op;				/* operator */
+	union {
+		int operan;			/* position of field in obs to use as operands */
+		Num num;			/* number to use as operand */
+	} u;
+} XGroupSet;
+
+typedef struct XSimpleTest_ {
+	LexpOp op;				/* operator */
+	int pos;				/* position of 1. operand in food table */
+	Num num;				/* value of 2. operand */
+	struct XSimpleTest_* action; /* continue with this, if the test was true */
+} XSimpleTest;
+
+typedef struct XTest_ {
+	LexpOp op;				/* operator */
+	int output1;			/* position of 1. operand in obs */
+	int output2;			/* position of 2. operand in obs */
+	struct XTest_* action; /* continue with this, if the test was true */
+} XTest;
+
+typedef struct XInputTest_ {
+	LexpOp op;				/* operator */
+	int pos1;				/* position of first field in line */
+	int pos2;				/* position of second field in line, or -1 to use num */
+	Num num;				/* constant to test against if pos2 is -1 */
+	struct XInputTest_* action; /* continue with this, if the test was true */
+} XInputTest;
+
+typedef struct {
+	int pos;				/* position of field in food table to transpose on */
+	int noGroups;			/* no of groups */
+	int groupPos;			/* position of first field in groupObs to transpose to */
+	int noOutput;			/* no of fields to transpose */
+	int* output;			/* array[noOutput] of positions of fields in obs to transpose */
+} XTranspose;
+
+typedef struct FoodCalcPlan_ {
+	int noOutput;			/* no of fields in the obs */
+	int noRealOutput;		/* no of fields to acutally output */
+	int* realOutput;		/* array[noRealOutput] of positions of the fields to output in
+							   obs, or NULL to output the first noRealOutput fields */
+
+	int noInput;			/* no of fields to input */
+	int* text;				/* array[noInput], is 1 if text field or not used (see setFileSkip()),
+							   and 2 if code field */
+	int star;				/* no of star fields */
+	int noInputMove;		/* no of fields to move unchanged from line to obs */
+	int* inputMove;			/* array[noInputMove] of positions of fields in line to move from */
+	int* outputInput;		/* array[noInputMove] of positions of fields in obs to move to */
+	int noInputGroupBy;		/* no of fields from input to group by */
+	int* inputGroupBy;		/* array[noInputGroupBy] of positions of fields in line to group by */
+	int* groupInputPos;		/* array[noInputGroupBy] of positions of fields in groupObs to group by */
+	int inputFood;			/* position of the food num field in line */
+	int inputAmount;		/* position of the amount field in line */
+	Num inputAmountScale;	/* scale of amount value */
+
+	int noInputCook;		/* 1 if cooking should be done */
+	int inputCook;			/* position of the cook field in line */
+
+	int noCookTypes;		/* no of cook types */
+	XCookType* cookType;	/* array[noCookTypes] of cook types, indexed by cook type no */
+
+	int noNonEdible;		/* 1 if reduction with non-edible par, else 0 */
+	int nonEdible;			/* position of field with non-edible fraction in food table */
+	int noNonEdibleFlag;	/* 1 if input field with flag for non-edible reduction */
+	int nonEdibleFlag;		/* position of flag in line */
+
+	int noFoodGroupBy;		/* no of fields from food table or input to group by */
+	int* outputGroupBy;		/* array[noFoodGroupBy] of positions of fields to group by in obs */
+	int* groupFoodPos;		/* array[noFoodGroupBy] of position of fields to group by in groupObs */
+
+	int noFoodMove;			/* no of fields to move unchanged from food table to obs */
+	int* foodMovePos;		/* array[noFoodMove] of positions of fields to move from in food table */
+	int* outputFood;		/* array[noFoodMove] of positions of fields in obs to move to */
+	int noFoodNutri;		/* no of fields in food table to calculate from */
+	int noTestNutri;		/* no of the first fields in foodNutriPos needed by the tests */
+	int* foodNutriPos;		/* array[noFoodNutri] of positions of fields to calculate from in food table */
+	int* outputNutri;		/* array[noFoodNutri] of positions of fields in obs to calculate to */
+	int noSparse;			/* no of rows in the food table with a sparse row for this
+							   plan, 0 if the sparse rows are not used */
+	int sparseGroup;		/* 1 if only the non-zero fields of a sparse row are added to
+							   the groups */
+
+	int noReduct;			/* no of reductions */
+	XReduct* reduct;		/* array[noReduct] of reductions */
+
+	int noWeightReduct;		/* no of reductions wich are weightReduc */
+	int noCalcWeightReduct;	/* 1 if any wightReduc uses the calcField */
+	XWeightReduct* weightReduct;
+
+	int noSet;				/* no of calculations */
+	int noSet2;				/* no of calculations to do a second time */
+	int noTestSet;			/* no of the first calculations in set needed by the tests */
+	XSet* set;
+
+	int noGroupSet;			/* no of group set calculations */
+	XGroupSet* groupSet;
+
+	int noSimpleTest;		/* no of simple tests */
+	XSimpleTest* simpleTest;/* array[noSimpleTest] of test */
+	int noTest;				/* no of tests */
+	XTest* test;			/* array[noTest] of test */
+	int lazyTest;			/* 1 if only the fields needed by the tests are calculated before
+							   the tests, and the rest only if the tests says use */
+
+	int noInputTest;		/* no of tests on input lines (input where:) */
+	XInputTest* inputTest;	/* array[noInputTest] of test */
+
+	int noTranspose;		/* no of transpose on fields */
+	XTranspose* transpose;	/* array[noTranspose] of transposes */
+
+	int noBlip;				/* blip value */
+	int lookAhead;			/* no of lines to read ahead and prefetch for (prefetch:) */
+	int pipeline;			/* no of lines in the rings of a pipelined run (pipeline:),
+							   0 if the run is not pipelined */
+
+	int noBlock;			/* no of output blocks */
+	struct FoodCalcPlan_* block;/* array[noBlock] of plans of the output blocks. they use
+							   the obs of this plan, with their own where: tests, group
+							   by: and output fields */
+
+	int noRollup;			/* no of rollup levels (rollup:) */
+	struct FoodCalcPlan_* rollup;/* array[noRollup] of plans of the rollup levels. their
+							   groups are added up from the groups of this plan */
+	int isRollup;			/* 1 if this is the plan of a rollup level. the line of
+							   a rollup level is the groupObs it adds up */
+} FoodCalcPlan;
+
+FoodCalcPlan* inputPlan;	/* the plan for the input file, set by STEP 7 or by get() */
+
+
+/*=== counters of what foodCalc() does, so the log can tell which parts of the
+   calculation a commands file uses. they are plain increments in the context, cheap
+   enough to always be on. the output blocks and rollup levels count in the counters of
+   their run */
+typedef struct {
+	long lookups;			/* foods looked up in the food table */
+	long misses;			/* foods not found in the food table */
+	long chainSteps;		/* entries looked at in the hash chains of the food table */
+	long ingredients;		/* ingredients of expanded recipes calculated */
+	long simpleSkips;		/* obs skipped by the simple tests */
+	long testSkips;			/* obs skipped by the other tests */
+	long* cooks;			/* array[plan->noCookTypes] of obs cooked with each cook id */
+	long zeroReducts;		/* cook factors and reductions skipped because they were zero */
+	long newGroups;			/* groups started */
+	long recycledGroups;	/* groups that got an entry from groupHashFree */
+	long groupSteps;		/* entries looked at in the hash chains of the groups */
+	long groupChains[7];	/* chains of the group hash with 0, 1, 2, 3, 4, 5-8 and 9+
+							   groups, counted each time the groups are output */
+	long maxGroupChain;		/* longest chain of the group hash */
+	long groupProbes;		/* entries looked at to find each group once */
+} FoodCalcCounters;
+
+
+/*=== the context of a run. make it with newFoodCalcContext() and set the input and
+   output before foodCalc() is called */
+typedef struct FoodCalcContext_ FoodCalcContext;
+struct FoodCalcContext_ {
+	FoodCalcPlan* plan;		/* the plan to run */
+	Num* obs;				/* array[plan->noOutput] of output values */
+	Num* line;				/* array[plan->noInput] of input values */
+
+	int (*inputFun)(Num*,int,int*,int);/* function to input a line from input */
+	File* input;			/* the file to read */
+	void (*outputFun)(FoodCalcContext*,Num*,int);/* function to output an obs */
+	FILE* output;			/* the file to write to */
+	char outputSep;			/* the separator outputLine() writes */
+	char outputDecPoint;	/* the decimal point outputLine() writes */
+	double* output4buf;		/* buffer for outputBinNative4() and outputRow() */
+	void (*rowFun)(void*,double*,int);/* function outputRow() gives the obs to */
+	void* rowArg;			/* first argument to rowFun */
+	void (*flush)();		/* hack, see comments in foodCalcLine() */
+	FoodCalcContext* block;	/* array[plan->noBlock] of contexts of the output blocks */
+	FoodCalcContext* rollup;/* array[plan->noRollup] of contexts of the rollup levels */
+	struct Summary_* summary;/* the summary made by outputSummary(), or NULL */
+	void (*pipeOutputFun)(FoodCalcContext*,Num*,int);/* the outputFun the writer thread
+							   calls in a pipelined run */
+	Num* realObs;			/* array[plan->noRealOutput] used if plan->realOutput */
+	int* outputCode;		/* array[plan->noRealOutput], 1 for a code field, or NULL if
+							   no code fields are output */
+	int* foodUses;			/* array[noFoodEntries] of the no of uses of each food, or
+							   NULL if they are not counted (see food profile:) */
+
+	/* these will be set by foodCalc() */
+	int noInputLines;		/* no of lines input */
+	int noSkipInputLines;	/* no of lines input skipped by input where: */
+	int noCalcLines;		/* no of lines input that has been calculated (or tried to) */
+	int noOutputObs;		/* no of obs output */
+	FoodCalcCounters* count;/* the counters of the run */
+	FoodCalcCounters counters;/* the counters, if this is the context of the run */
+
+	/* these are used by foodCalc() and its utility functions */
+	int groupBy;			/* no of fields to group by */
+	Num* groupObs;			/* array[plan->noOutput] of aggregated fields */
+	HashInt* groupHash;		/* groups when group by food table field */
+	HashIntEntry* groupHashFree;/* free hash entries for groupHash */
+	int noGroupAdd;			/* no of fields to aggregate in group */
+	int* groupPos;			/* array[noGroupAdd] of positions of fields to aggregate */
+	SparseNutri* sparse;	/* the sparse row of the food in obs if only its non-zero
+							   nutrient fields should be added to the group, else NULL */
+	int blip;				/* next blip when this number of lines input */
+	XSimpleTest* simpleUse;	/* if xsimpleTest->action == simpleUse then use this obs */
+	XTest* use;				/* if xsimpleTest->action == use then use this obs */
+	XInputTest* inputUse;	/* if xinputTest->action == inputUse then use this line */
+};
+
+
+/* make a new context to run the plan */
+FoodCalcContext* newFoodCalcContext(FoodCalcPlan* plan) {
+	FoodCalcContext* ctx = allocarray(1,sizeof(FoodCalcContext));
+	int i;
+	ctx->plan = plan;
+	ctx->obs = alloc(plan->noOutput*sizeof(Num));
+	ctx->line = alloc(plan->noInput*sizeof(Num));
+	ctx->count = &ctx->counters;
+	if (plan->noCookTypes) ctx->counters.cooks = allocarray(plan->noCookTypes,sizeof(long));
+	if (plan->noBlock) ctx->block = allocarray(plan->noBlock,sizeof(FoodCalcContext));
+	for (i = 0; i < plan->noBlock; i++) {
+		/* the output blocks share the obs and line with the run */
+		FoodCalcContext* block = ctx->block+i;
+		block->plan = plan->block+i;
+		block->obs = ctx->obs;
+		block->line = ctx->line;
+		block->count = ctx->count;
+		block->realObs = alloc(block->plan->noRealOutput*sizeof(Num));
+	}
+	if (plan->noRollup) ctx->rollup = allocarray(plan->noRollup,sizeof(FoodCalcContext));
+	for (i = 0; i < plan->noRollup; i++) {
+		/* the obs and line of a rollup level are set to each groupObs it adds up */
+		FoodCalcContext* level = ctx->rollup+i;
+		level->plan = plan->rollup+i;
+		level->count = ctx->count;
+		level->realObs = alloc(level->plan->noRealOutput*sizeof(Num));
+	}
+	return(ctx);
+}
+
+/* free the groups of a context */
+void freeFoodCalcGroups(FoodCalcContext* ctx) {
+	if (ctx->groupHash) {
+		int n = ctx->groupHash->size;
+		HashIntEntry** p1 = ctx->groupHash->table;
+		while (n--) {
+			HashIntEntry* p2 = *p1++;
+			while (p2) {
+				HashIntEntry* e = p2;
+				p2 = p2->next;
+				free(e->value);
+				free(e);
+			}
+		}
+		while (ctx->groupHashFree) {
+			HashIntEntry* e = ctx->groupHashFree;
+			ctx->groupHashFree = e->next;
+			free(e->value);
+			free(e);
+		}
+		free(ctx->groupHash->table);
+		free(ctx->groupHash);
+	}
+	if (!ctx->plan->noFoodGroupBy) free(ctx->groupObs); /* else it is in the groupHash */
+	free(ctx->groupPos);
+}
+
+/* free a context made by newFoodCalcContext(). the input and output are not closed */
+forward void freeSummary(struct Summary_* summary);
+void freeFoodCalcContext(FoodCalcContext* ctx) {
+	int i;
+	for (i = 0; i < ctx->plan->noBlock; i++) {
+		freeFoodCalcGroups(ctx->block+i);
+		free(ctx->block[i].realObs);
+		free(ctx->block[i].outputCode);
+		free(ctx->block[i].output4buf);
+	}
+	free(ctx->block);
+	for (i = 0; i < ctx->plan->noRollup; i++) {
+		freeFoodCalcGroups(ctx->rollup+i);
+		free(ctx->rollup[i].realObs);
+		free(ctx->rollup[i].outputCode);
+		free(ctx->rollup[i].output4buf);
+	}
+	free(ctx->rollup);
+	free(ctx->counters.cooks);
+	if (ctx->summary) freeSummary(ctx->summary);
+	freeFoodCalcGroups(ctx);
+	free(ctx->realObs);
+	free(ctx->outputCode);
+	free(ctx->foodUses);
+	free(ctx->output4buf);
+	free(ctx->line);
+	free(ctx->obs);
+	free(ctx);
+}
+
+
+/****************************************************************************/
+/*** Utility functions to write lines to the output file of a run. These functions
+     has type void fun(FoodCalcContext*,Num*,int) */
+
+
+/* write a line to a data file. no should be number of values in lines and the obs
+   array should contain the values to write. */
+void outputLine(FoodCalcContext* ctx, Num* obs, int no) {
+	FILE* output = ctx->output;
+	int* code = ctx->outputCode;
+
+	while (no--) {
+		Num num = *obs++;
+		
+		if (code && *code++ && num >= 1) {
+			/* the name of a code, in double quotes if it has a separator or a quote */
+			char* name = codeName((int)num);
+			if (strchr(name,ctx->outputSep) || strchr(name,'"') || strchr(name,' ')) {
+				filePutc('"',output);
+				for (; *name; name++) {
+					if (*name == '"') filePutc('"',output);
+					filePutc(*name,output);
+				}
+				filePutc('"',output);
+			} else {
+				fputs(name,output);
+			}
+
+		} else if (num < 0.0001 && num > -0.0001) {
+			/* so near zero that we declare it zero */
+			filePutc('0',output);
 
 		} else {
 			int e = 0;
@@ -4677,7 +7045,7 @@ void outputLine(Num* obs, int no) {
 			char* p = buf;
 
 			/* output sign */
-			if (num < 0.0) {putc('-',output); num = -num;}
+			if (num < 0.0) {filePutc('-',output); num = -num;}
 
 			/* we don't print more than max 4 decimals, so we round it */
 			num += (Num)0.00005;
@@ -4692,231 +7060,333 @@ void outputLine(Num* obs, int no) {
 					*p++ = '0' + (char)(numl%10l);
 					numl /= 10l;
 				} while (numl);
-				while (--p >= buf) putc(*p,output);
+				while (--p >= buf) filePutc(*p,output);
 			} else {
-				putc('0',output);
+				filePutc('0',output);
 			}
 
 			/* print the decimals */
 			numl = (long)((num-numl2)*10000l);
 			if (numl) {
-				putc(outputDecPoint,output);
+				filePutc(ctx->outputDecPoint,output);
 				if (numl > 9999l) numl = 9999l;
-				putc('0' + numl/1000l, output); numl %= 1000l;
+				filePutc('0' + numl/1000l, output); numl %= 1000l;
 				if (numl) {
-					putc('0' + numl/100l, output); numl %= 100l;
+					filePutc('0' + numl/100l, output); numl %= 100l;
 					if (numl) {
-						putc('0' + numl/10l, output); numl %= 10l;
+						filePutc('0' + numl/10l, output); numl %= 10l;
 						if (numl) {
-							putc('0' + numl, output);
+							filePutc('0' + numl, output);
 				}}}
 			}
 
 			/* print exponents */
 			if (e) {
-				putc('e',output);
+				filePutc('e',output);
 				p = buf;
 				do {
 					*p++ = '0' + e%10;
 					e /= 10;
 				} while (e);
-				while (--p >= buf) putc(*p,output);
+				while (--p >= buf) filePutc(*p,output);
 			}
 
 		}
-		if (no) putc(outputSep,output);
+		if (no) filePutc(ctx->outputSep,output);
 	}
-	putc('\n',output);
+	filePutc('\n',output);
 	if (ferror(output)) {abortAndExit("Error writing to output file\n");}
 }
 
 
 /* write a line to a binary file. Use only this function if sizeof(Num) != sizeof(double).
    Used just like outputLine(). Before it is called the first time you must allocate an
-   array of doubles with length equal to no and assign it to output4buf. */
-double* output4buf;
-void outputBinNative4(Num* obs, int no) {
-	double* b = output4buf;
+   array of doubles with length equal to no and assign it to ctx->output4buf. */
+void outputBinNative4(FoodCalcContext* ctx, Num* obs, int no) {
+	double* b = ctx->output4buf;
 	int n = no;
 	while (n--) *b++ = (double)*obs++;
-	fwrite(output4buf,sizeof(double),no,output);
-	if (ferror(output)) {abortAndExit("Error writing to output file\n");}
+	fwrite(ctx->output4buf,sizeof(double),no,ctx->output);
+	if (ferror(ctx->output)) {abortAndExit("Error writing to output file\n");}
 }
 
 
 /* write a line to a binary file. Use only this function if sizeof(Num) == sizeof(double).
    Used just like outputLine(). */
-void outputBinNative(Num* obs, int no) {
-	fwrite(obs,sizeof(double),no,output);
-	if (ferror(output)) {abortAndExit("Error writing to output file\n");}
+void outputBinNative(FoodCalcContext* ctx, Num* obs, int no) {
+	fwrite(obs,sizeof(double),no,ctx->output);
+	if (ferror(ctx->output)) {abortAndExit("Error writing to output file\n");}
 }
 
 
+/* give a line to the row function of a run opened with fcOpen() in the library. Used
+   just like outputBinNative4(), with the doubles in ctx->output4buf */
+void outputRow(FoodCalcContext* ctx, Num* obs, int no) {
+	double* b = ctx->output4buf;
+	int n = no;
+	while (n--) *b++ = (double)*obs++;
+	ctx->rowFun(ctx->rowArg,ctx->output4buf,no);
+}
 
-/*********************************************************************************/
-/*** FoodCalc() function. This function does the actual food calculations. Before
-     it is called you should set all the variables listed below. On return it will
-	 have set the variables listed futher down. Note that foodCalc() is used both to
-     calculate the output from the input, and to calculate recipes from recipes
-     files! */
-
-
-/*=== all the following variables should be set before foodCalc is called: */
-/* you can se these variables as a compiled version of the semantic tree! */
-
-void (*XoutputFun)(Num*,int);/* function to output an obs */
-int XnoOutput;			/* no of fields in output array Xobs*/
-Num* Xobs;				/* array[XnoOutput] of output values */
-int XnoRealOutput;		/* no of fields to acutally output */
-
-int (*XinputFun)(Num*,int,int*,int);/* function to input a line */
-void (*Xflush)();		/* hack, see comments in foodCalc() */
-int XnoInput;			/* no of fields to input */
-int* Xtext;				/* array[XnoInput], is 1 if text field */
-int Xstar;				/* no of star fields */
-Num* Xline;				/* array[XnoInput] of input values */
-int XnoInputMove;		/* no of fields to move unchanged from Xline to Xobs */
-Num** XinputMove;		/* array[XnoInputMove] of pointers to fields in Xline to move from */
-Num** XoutputInput;		/* array[XnoInputMove] of pointers to fields in Xobs to move to */
-int XnoInputGroupBy;	/* no of fields from input to group by */
-Num** XinputGroupBy;	/* array[XnoInputGroupBy] of pointers to fields in Xline to group by */
-int* XgroupInputPos;	/* array[XnoInputGroupBy] of positions of fields in groupObs to group by */
-Num* XinputFood;		/* pointer to the food num field in Xline */
-Num* XinputAmount;		/* pointer to the amount field in Xline */
-Num XinputAmountScale;	/* scale of amount value */
-
-int XnoInputCook;		/* 1 if cooking should be done */
-Num* XinputCook;		/* pointer to the cook field in Xline */
-
-int XnoCookTypes;		/* no of cook types */
-typedef struct {		/* Cook reduction: */
-	int foodPos;			/* position of reduct field in food table */
-	int noOutput;			/* no of fields to reduce */
-	Num** output;			/* array[noOutput] of pointers to fields to reduce in Xobs */
-} XCook;
-typedef struct {		/* Cook type: */
-	int no;					/* no of cook reductions */
-	XCook* cook;			/* array[no] of cook reductions */
-} XCookType;
-XCookType* XcookType;	/* array[XnoCookTypes] of cook types, indexed by cook type no */
-
-int XnoNonEdible;		/* 1 if reduction with non-edible par, else 0 */
-int XnonEdible;			/* position of field with non-edible fraction in food table */
-int XnoNonEdibleFlag;	/* 1 if input field with flag for non-edible reduction */
-Num* XnonEdibleFlag;	/* pointer to flag in Xline */
-
-int XnoFoodGroupBy;		/* no of fields from food table or input to group by */
-Num** XoutputGroupBy;	/* array[XnoFoodGroupBy] of pointers to fields to group by in food table */
-int* XgroupFoodPos;		/* array[XnoFoodGroupBy] of position of fields to group by in groupObs */
-
-int XnoFoodMove;		/* no of fields to move unchanged from food table to Xobs */
-int* XfoodMovePos;		/* array[XnoFoodMove] of positions of fields to move from in food table */
-Num** XoutputFood;		/* array[XnoFoodMove] of pointers to fields in Xobs to move to */
-int XnoFoodNutri;		/* no of fields in food table to calculate from */
-int* XfoodNutriPos;		/* array[XnoFoodNutri] of positions of fields to calculate from in food table */
-Num** XoutputNutri;		/* array[XnoFoodNutri] of pointers to fields in Xobs to calculate to */
 
-int XnoReduct;			/* no of reductions */
-typedef struct {		/* reduction: */
-	Num* input;				/* pointer to reduct field in Xline */
-	int noOutput;			/* no of fields to reduce */
-	Num** output;			/* array[noOutput] of pointers to fields to reduce in Xobs */
-} XReduct;
-XReduct* Xreduct;		/* array[XnoReduct] of reductions */
 
-int XnoWeightReduct;	/* no of reductions wich are weightReduc */
-int XnoCalcWeightReduct;/* 1 if any wightReduc uses the calcField */
-typedef struct {		/* weight reduction: */
-	Num* input;				/* pointer to reduct field in Xline */
-	Num* output;			/* pointer to fraction field in Xobs */
-} XWeightReduct;
-XWeightReduct* XweightReduct;
+/* the summary output: command gives a summary of each output field instead of the
+   output lines. the lines are given to outputSummary(), which adds each value to the
+   summary of its field: the mean and variance by Welford's method, and the quantiles
+   by a t-digest, a list of centroids (means with weights) kept sorted on the mean.
+   A centroid may only span the quantiles from q1 to q2 if k(q2)-k(q1) <= 1, where
+   k(q) = tDigestCompression/(2*pi)*asin(2*q-1), so there are small centroids at the
+   tails, where the quantiles then are good, and at most about tDigestCompression
+   centroids. New values are put in a buffer which is merged into the centroids when
+   it is full. If a stratify field is given, there is a summary for each of its
+   values */
+#define tDigestCompression 100
+#define tDigestBuffer (5*tDigestCompression)
+typedef struct {
+	double mean;
+	double weight;
+} Centroid;
+typedef struct {
+	double n;				/* no of values */
+	double mean;			/* the mean so far */
+	double m2;				/* the sum of squared differences from the mean */
+	double min;
+	double max;
+	int noCentroid;			/* no of centroids */
+	Centroid* centroid;		/* array[2*tDigestCompression] of centroids */
+	int noBuffer;			/* no of values in buffer */
+	Centroid* buffer;		/* array[tDigestBuffer+2*tDigestCompression] of values,
+							   the centroids are copied after them when merging */
+} FieldSummary;
+typedef struct Stratum_ {
+	int key;				/* the value of the stratify field */
+	FieldSummary* field;	/* array[noFields] of summaries */
+	struct Stratum_* next;
+} Stratum;
+typedef struct Summary_ {
+	int noFields;			/* no of fields in the lines */
+	int stratify;			/* position of the stratify field in the lines, or -1 */
+	Stratum* strata;		/* list of strata sorted on key */
+	Stratum* last;			/* the stratum of the last line */
+} Summary;
+
+Summary* newSummary(int noFields, int stratify) {
+	Summary* summary = allocarray(1,sizeof(Summary));
+	summary->noFields = noFields;
+	summary->stratify = stratify;
+	return(summary);
+}
+
+void freeSummary(Summary* summary) {
+	while (summary->strata) {
+		Stratum* stratum = summary->strata;
+		int i;
+		for (i = 0; i < summary->noFields; i++) {
+			free(stratum->field[i].centroid);
+			free(stratum->field[i].buffer);
+		}
+		free(stratum->field);
+		summary->strata = stratum->next;
+		free(stratum);
+	}
+	free(summary);
+}
 
-int XnoSet;				/* no of calculations */
-int XnoSet2;			/* no of calculations to do a second time */
-typedef struct {		/* operation */
-	Num* output;		/* pointer to field in Xobs to operate on */
-	SetOp op;				/* operator */
-	union {
-		Num* operan;		/* pointer to field in Xobs to use as operands */
-		Num num;			/* number to use as operand */
-	} u;
-} XSet;
-XSet* Xset;
+int compareCentroid(const void* a, const void* b) {
+	double d = ((Centroid*)a)->mean - ((Centroid*)b)->mean;
+	return(d < 0.0 ? -1 : (d > 0.0 ? 1 : 0));
+}
 
-int XnoGroupSet;		/* no of group set calculations */
-typedef struct {		/* operation */
-	int pos;				/* position of field in Xobs to operate on */
-	SetOp op;				/* operator */
-	union {
-		int operan;			/* position of field in Xobs to use as operands */
-		Num num;			/* number to use as operand */
-	} u;
-} XGroupSet;
-XGroupSet* XgroupSet;
+/* the weight of the values up to the quantile where a centroid starting after the
+   weight before must end */
+double tDigestLimit(double before, double n) {
+	double pi = 3.14159265358979;
+	double k = tDigestCompression/(2.0*pi)*asin(2.0*before/n-1.0) + 1.0;
+	if (k >= tDigestCompression/4.0) return(n);
+	return(n*(sin(k*2.0*pi/tDigestCompression)+1.0)/2.0);
+}
 
-int XnoSimpleTest;		/* no of simple tests */
-typedef struct XSimpleTest_ {
-	LexpOp op;				/* operator */
-	int pos;				/* position of 1. operand in food table */
-	Num num;				/* value of 2. operand */
-	struct XSimpleTest_* action; /* continue with this, if the test was true */
-} XSimpleTest;
-XSimpleTest* XsimpleTest;/* array[XnoSimpleTest] of test */
-int XnoTest;				/* no of tests */
-typedef struct XTest_ {
-	LexpOp op;				/* operator */
-	Num* output1;			/* pointer to 1. operand in Xobs */
-	Num* output2;			/* pointer to 2. operand in Xobs */
-	struct XTest_* action; /* continue with this, if the test was true */
-} XTest;
-XTest* Xtest;/* array[XnoSimpleTest] of test */
+/* merge the buffer into the centroids of a field */
+void tDigestMerge(FieldSummary* field) {
+	Centroid* all = field->buffer;
+	int noAll = field->noBuffer+field->noCentroid;
+	Centroid* c = field->centroid;
+	double before = 0.0;		/* weight of the centroids before c */
+	double limit = tDigestLimit(0.0,field->n);
+	int i;
+	if (!field->noBuffer) return;
+	memcpy(all+field->noBuffer,field->centroid,field->noCentroid*sizeof(Centroid));
+	qsort(all,noAll,sizeof(Centroid),compareCentroid);
+	*c = all[0];
+	for (i = 1; i < noAll; i++) {
+		double weight = c->weight+all[i].weight;
+		if (before+weight <= limit) {
+			c->mean += (all[i].mean-c->mean)*all[i].weight/weight;
+			c->weight = weight;
+		} else {
+			before += c->weight;
+			limit = tDigestLimit(before,field->n);
+			*++c = all[i];
+		}
+	}
+	field->noCentroid = c-field->centroid+1;
+	field->noBuffer = 0;
+}
 
-int XnoTranspose;		/* no of transpose on fields */
-typedef struct {
-	int pos;				/* position of field in food table to transpose on */
-	int noGroups;			/* no of groups */
-	int groupPos;			/* position of first field in groupObs to transpose to */
-	int noOutput;			/* no of fields to transpose */
-	Num** output;			/* array[noOutput] of pointers to fields to transpose */
-} XTranspose;
-XTranspose* Xtranspose;	/* array[XnoTranspose] of transposes */
+/* the quantile q of a field. the values are taken to be spread evenly around the
+   mean of each centroid, so we interpolate between the centroids */
+double tDigestQuantile(FieldSummary* field, double q) {
+	Centroid* c = field->centroid;
+	double index = q*field->n;
+	double weight;
+	int i;
+	if (field->n == 0.0) return(0.0);
+	tDigestMerge(field);
+	if (field->noCentroid == 1 || index < c->weight/2.0) {
+		if (c->weight <= 1.0) return(c->mean);
+		return(field->min + (c->mean-field->min)*index/(c->weight/2.0));
+	}
+	weight = c->weight/2.0;
+	for (i = 0; i < field->noCentroid-1; i++, c++) {
+		double dw = (c[0].weight+c[1].weight)/2.0;
+		if (weight+dw > index)
+			return(c[0].mean + (c[1].mean-c[0].mean)*(index-weight)/dw);
+		weight += dw;
+	}
+	if (c->weight <= 1.0) return(c->mean);
+	return(c->mean + (field->max-c->mean)*(index-weight)/(c->weight/2.0));
+}
+
+/* add a line to the summary of a run. used like outputLine() */
+void outputSummary(FoodCalcContext* ctx, Num* obs, int no) {
+	Summary* summary = ctx->summary;
+	Stratum* stratum = summary->last;
+	int key = (summary->stratify < 0 ? 0 : (int)obs[summary->stratify]);
+	FieldSummary* field;
+
+	if (!stratum || stratum->key != key) {
+		/* find the stratum, or make a new in the sorted list */
+		Stratum** p = &(summary->strata);
+		while (*p && (*p)->key < key) p = &((*p)->next);
+		if (!*p || (*p)->key != key) {
+			int i;
+			stratum = allocStruct(Stratum);
+			stratum->key = key;
+			stratum->field = allocarray(no,sizeof(FieldSummary));
+			for (i = 0; i < no; i++) {
+				stratum->field[i].centroid = alloc(2*tDigestCompression*sizeof(Centroid));
+				stratum->field[i].buffer =
+					alloc((tDigestBuffer+2*tDigestCompression)*sizeof(Centroid));
+			}
+			stratum->next = *p;
+			*p = stratum;
+		}
+		summary->last = stratum = *p;
+	}
+
+	field = stratum->field;
+	while (no--) {
+		double x = (double)*obs++;
+		double delta = x-field->mean;
+		if (field->n == 0.0 || x < field->min) field->min = x;
+		if (field->n == 0.0 || x > field->max) field->max = x;
+		field->n += 1.0;
+		field->mean += delta/field->n;
+		field->m2 += delta*(x-field->mean);
+		field->buffer[field->noBuffer].mean = x;
+		field->buffer[field->noBuffer++].weight = 1.0;
+		if (field->noBuffer == tDigestBuffer) tDigestMerge(field);
+		field++;
+	}
+}
+
+/* write the summary of a run to its output file. fieldP is the first of the fields
+   in the lines. there is a line for each field in each stratum */
+void writeSummary(FoodCalcContext* ctx, FileFormat format, FieldP* fieldP) {
+	static double quantiles[] = {0.05,0.25,0.5,0.75,0.95};
+	Summary* summary = ctx->summary;
+	FILE* output = ctx->output;
+	char sep = ctx->outputSep;
+	Stratum* stratum;
+	Num stats[10];
+	int noLines = 0;
+
+	if (format == formatText) {
+		if (summary->stratify >= 0) {
+			FieldP* p = fieldP;
+			int i;
+			for (i = 0; i < summary->stratify; i++) p = p->next;
+			fprintf(output,"%s%c",p->field->name,sep);
+		}
+		fprintf(output,"field%cn%cmean%csd%cmin%cp5%cp25%cmedian%cp75%cp95%cmax\n",
+			sep,sep,sep,sep,sep,sep,sep,sep,sep,sep);
+	}
+	for (stratum = summary->strata; stratum; stratum = stratum->next) {
+		FieldP* p = fieldP;
+		FieldSummary* field = stratum->field;
+		int i, j;
+		for (i = 0; i < summary->noFields; i++, field++, p = p->next) {
+			if (i == summary->stratify) continue;
+			stats[0] = (Num)field->n;
+			stats[1] = (Num)field->mean;
+			stats[2] = (Num)(field->n > 1.0 ? sqrt(field->m2/(field->n-1.0)) : 0.0);
+			stats[3] = (Num)field->min;
+			for (j = 0; j < 5; j++) stats[4+j] = (Num)tDigestQuantile(field,quantiles[j]);
+			stats[9] = (Num)field->max;
+			if (summary->stratify >= 0) fprintf(output,"%d%c",stratum->key,sep);
+			fprintf(output,"%s%c",p->field->name,sep);
+			outputLine(ctx,stats,10);
+			noLines++;
+		}
+	}
+	logmsg("Wrote summary of %d lines in %d lines.\n",ctx->noOutputObs,noLines);
+}
 
-int XnoBlip;			/* blip value */
 
-/*=== you must set all the above vars before calling foodCalc, */
- 
-/*=== the vars below will be set by foodCalc */
-int noInputLines;		/* no of lines input */
-int noOutputObs;		/* no of obs output */
 
+/*********************************************************************************/
+/*** The foodCalc() function and its utility functions */
 
-/* the following vars are used by FoodCalc and its utility function */
 
-int groupBy;			/* no of fields to group by */
-Num* groupObs;			/* array[XnoOutput] of aggregated fields */
-HashInt* groupHash;		/* groups when group by food table field */
-HashIntEntry* groupHashFree;/* free hash entries for groupHash */
-int noGroupAdd;			/* no of fields to aggregate in group */
-int* groupPos;			/* array[noGroupAdd] of positions of fields to aggregate in groupObs */
-Num** outputGroup;		/* array[noGroupAdd] of pointers to fields in Xobs to aggregate */
-int blip;				/* next blip when this number of lines input */
-XSimpleTest* simpleUse;	/* if xsimpleTest->action == simpleUse then use this obs */
-XTest* use;				/* if xsimpleTest->action == use then use this obs */
+/* this utility function outputs an obs or a groupObs */
+void foodCalcOutput(FoodCalcContext* ctx, Num* obs) {
+	FoodCalcPlan* plan = ctx->plan;
+	if (plan->realOutput) {
+		/* the fields to output are not the first in the obs, so we collect them */
+		int n = plan->noRealOutput;
+		int* poutput = plan->realOutput;
+		Num* prealObs = ctx->realObs;
+		while (n--) *prealObs++ = obs[*poutput++];
+		obs = ctx->realObs;
+	}
+	ctx->outputFun(ctx,obs,plan->noRealOutput);
+	countInc(ctx->noOutputObs);
+}
 
+/* this utility function is called when a group is output. it adds the group to the
+   rollup levels, does the group set: calculations and outputs groupObs */
+forward void foodCalcRollup(FoodCalcContext* level, Num* groupObs);
+void foodCalcGroupOutput(FoodCalcContext* ctx, Num* groupObs) {
+	FoodCalcPlan* plan = ctx->plan;
 
-void foodCalcGroupOutput(Num* groupObs) {
+	if (plan->noRollup) {
+		/* this must be done before the group set: calculations, as the group set
+		   fields are calculated again for the groups of the levels */
+		int n = plan->noRollup;
+		FoodCalcContext* level = ctx->rollup;
+		while (n--) foodCalcRollup(level++,groupObs);
+	}
 
-	if (XnoGroupSet) {
-		int n = XnoGroupSet;
-		XGroupSet* set = XgroupSet;
+	if (plan->noGroupSet) {
+		int n = plan->noGroupSet;
+		XGroupSet* set = plan->groupSet;
 		while (n--) {
 			switch (set->op) {
 			case cpyOp: groupObs[set->pos] = groupObs[set->u.operan]; break;
 			case addOp: groupObs[set->pos] += groupObs[set->u.operan]; break;
 			case subOp: groupObs[set->pos] -= groupObs[set->u.operan]; break;
 			case mulOp: groupObs[set->pos] *= groupObs[set->u.operan]; break;
-			case divOp: if (groupObs[set->u.operan]) groupObs[set->pos] /= groupObs[set->u.operan]; 
+			case divOp: if (groupObs[set->u.operan]) groupObs[set->pos] /= groupObs[set->u.operan];
 						else groupObs[set->pos] = (Num)0;
 						break;
 			case cpyOpC: groupObs[set->pos] = set->u.num; break;
@@ -4929,266 +7399,183 @@ void foodCalcGroupOutput(Num* groupObs) {
 		}
 	}
 
-	XoutputFun(groupObs,XnoRealOutput);
-	noOutputObs++;
+	foodCalcOutput(ctx,groupObs);
 }
 
-/* this utility function is called by foodCalcFood() and foodCalc() when group by: is
-   used and a group is finished and should be output */
-void foodCalcGroupFlush() {
-	if (noInputLines > 1) {
-		/* only if we read something should we output anything */
-		if (XnoFoodGroupBy) { 
-			/* we group by a food table field, so we have to output all groupObs in
-			   the groupHash */
-			int n = groupHash->size;
-			HashIntEntry** p1 = groupHash->table;
-			while (n--) {
-				if (*p1) {
-					HashIntEntry* p2 = *p1;
-					while (p2) {
-						HashIntEntry* e = p2;
-						Num* groupObs = e->value;
-						foodCalcGroupOutput(groupObs);
-						p2 = p2->next;
-						e->next = groupHashFree;
-						groupHashFree = e;
-					}
-					*p1 = NULL;
+/* this utility function is called by foodCalcGroupCheck() and foodCalcEnd() when
+   group by: is used and the groups are finished and should be output */
+void foodCalcGroupFlush(FoodCalcContext* ctx) {
+	FoodCalcPlan* plan = ctx->plan;
+	if (plan->noFoodGroupBy) {
+		/* we group by a food table field, so we have to output all groupObs in
+		   the groupHash */
+		int n = ctx->groupHash->size;
+		HashIntEntry** p1 = ctx->groupHash->table;
+		while (n--) {
+			long len = 0;
+			if (*p1) {
+				HashIntEntry* p2 = *p1;
+				while (p2) {
+					HashIntEntry* e = p2;
+					Num* groupObs = e->value;
+					foodCalcGroupOutput(ctx,groupObs);
+					p2 = p2->next;
+					e->next = ctx->groupHashFree;
+					ctx->groupHashFree = e;
+					len++;
 				}
-				p1++;
+				*p1 = NULL;
 			}
-		} else {
-			/* we only group by input fields, so we just output the groupObs */
-			foodCalcGroupOutput(groupObs);
-		}
-	}
-	if (XnoInputGroupBy) {
-		if (!XnoFoodGroupBy) {
-			/* initialize all groupObs fields to zero */
-			int n = XnoOutput;
-			Num* pgroupObs = groupObs;
-			while (n--) *pgroupObs++ = 0.0;
-		}
-		{ /* initialize the groupObs with the input group by fields */
-			int n = XnoInputGroupBy;
-			Num** pinput = XinputGroupBy;
-			int* pgroupPos = XgroupInputPos;
-			while (n--) groupObs[*pgroupPos++] = **pinput++;
+			ctx->count->groupChains[hashChainClass(len)]++;
+			ctx->count->groupProbes += len*(len+1)/2;
+			if (len > ctx->count->maxGroupChain) ctx->count->maxGroupChain = len;
+			p1++;
 		}
+	} else {
+		/* we only group by input fields, so we just output the groupObs */
+		foodCalcGroupOutput(ctx,ctx->groupObs);
 	}
 }
 
-
-/* this utility function is called by foodCalc() to calculate an ingredients or a
-   simple food */
-void foodCalcFood(Num* foodObs, FoodType foodType) {
-
-	Num amount = *XinputAmount;
-
-	if (XnoSimpleTest) {
-		XSimpleTest* test = XsimpleTest;
-		while (test < simpleUse) {
-			switch (test->op) {
-			case eqOp: if (foodObs[test->pos] == test->num) test = test->action; else test++; break;
-			case neOp: if (foodObs[test->pos] != test->num) test = test->action; else test++; break;
-			case gtOp: if (foodObs[test->pos] > test->num) test = test->action; else test++; break;
-			case geOp: if (foodObs[test->pos] >= test->num) test = test->action; else test++; break;
-			case ltOp: if (foodObs[test->pos] < test->num) test = test->action; else test++; break;
-			case leOp: if (foodObs[test->pos] <= test->num) test = test->action; else test++; break;
-			}
-		}
-		if (test > simpleUse) return; /* skip! */
-	}
-
-	if (XnoInputMove) {
-		/* move all fields from line to obs */
-		int n = XnoInputMove;
-		Num** pinput = XinputMove;
-		Num** poutput = XoutputInput;
-		while (n--) **poutput++ = **pinput++;
-	}
-
-	if (XnoFoodMove) {
-		/* move all noCalc fields from foodObs to obs */
-		int n = XnoFoodMove;
-		int* pfoodPos = XfoodMovePos;
-		Num** poutput = XoutputFood;
-		while (n--) **poutput++ = foodObs[*pfoodPos++];
+/* this utility function is called by foodCalcGroupCheck() to start a new group when
+   group by: input fields is used */
+void foodCalcGroupInit(FoodCalcContext* ctx) {
+	FoodCalcPlan* plan = ctx->plan;
+	Num* groupObs = ctx->groupObs;
+	if (!plan->noFoodGroupBy) {
+		/* initialize all groupObs fields to zero */
+		int n = plan->noOutput;
+		Num* pgroupObs = groupObs;
+		while (n--) *pgroupObs++ = 0.0;
+		ctx->count->newGroups++;
 	}
-
-	if (XnoNonEdible) {
-		if (foodType == simpleFood && (!XnoNonEdibleFlag || *XnonEdibleFlag))
-			amount *= (Num)1.0 - foodObs[XnonEdible];
+	{ /* initialize the groupObs with the input group by fields */
+		int n = plan->noInputGroupBy;
+		int* pinput = plan->inputGroupBy;
+		int* pgroupPos = plan->groupInputPos;
+		while (n--) groupObs[*pgroupPos++] = ctx->line[*pinput++];
 	}
+}
 
-	if (XnoFoodNutri) {
-		/* calculate all nutrient fields from foodObs to obs */
-		int n = XnoFoodNutri;
-		int* pfoodPos = XfoodNutriPos;
-		Num** poutput = XoutputNutri;
-		while (n--) 
-			**poutput++ = amount*XinputAmountScale*foodObs[*pfoodPos++];
-	}
 
-	if (XnoWeightReduct) {
-		if (XnoCalcWeightReduct) {
-			/* calculate new fields - will be recalculated after reductions */
-			int n = XnoSet;
-			XSet* set = Xset;
-			while (n--) {
-				switch (set->op) {
-				case cpyOp: *(set->output) = *(set->u.operan); break;
-				case addOp: *(set->output) += *(set->u.operan); break;
-				case subOp: *(set->output) -= *(set->u.operan); break;
-				case mulOp: *(set->output) *= *(set->u.operan); break;
-				case divOp: if (*(set->u.operan)) *(set->output) /= *(set->u.operan); 
-							else *(set->output) = (Num)0;
-							break;
-				case cpyOpC: *(set->output) = set->u.num; break;
-				case addOpC: *(set->output) += set->u.num; break;
-				case subOpC: *(set->output) -= set->u.num; break;
-				case mulOpC: *(set->output) *= set->u.num; break;
-				case divOpC: *(set->output) /= set->u.num; break;
-				}
-				set++;
-			}
-		}
-		{ /* change fractions */
-			int n = XnoWeightReduct;
-			XWeightReduct* weightReduct = XweightReduct;
+/* this utility function is called by foodCalcFood() to do n calculations on obs */
+void foodCalcSet(Num* obs, XSet* set, int n) {
+	while (n--) {
+		switch (set->op) {
+		case cpyOp: obs[set->output] = obs[set->u.operan]; break;
+		case addOp: obs[set->output] += obs[set->u.operan]; break;
+		case subOp: obs[set->output] -= obs[set->u.operan]; break;
+		case mulOp: obs[set->output] *= obs[set->u.operan]; break;
+		case divOp: if (obs[set->u.operan]) obs[set->output] /= obs[set->u.operan];
+					else obs[set->output] = (Num)0;
+					break;
+		case cpyOpC: obs[set->output] = set->u.num; break;
+		case addOpC: obs[set->output] += set->u.num; break;
+		case subOpC: obs[set->output] -= set->u.num; break;
+		case mulOpC: obs[set->output] *= set->u.num; break;
+		case divOpC: obs[set->output] /= set->u.num; break;
+		}
+		set++;
+	}
+}
+
+/* this utility function is called by foodCalcFood() to do the reductions by
+   cooking. if rest, only the fields not needed by the tests are reduced, else
+   only the fields needed by the tests (which is all fields if not plan->lazyTest) */
+void foodCalcCook(FoodCalcContext* ctx, Num* foodObs, FoodType foodType, int rest) {
+	FoodCalcPlan* plan = ctx->plan;
+	int cookId = (int)ctx->line[plan->inputCook];
+	if (cookId) {
+		if (foodType != simpleFood) {
+			if (!rest) error("You can not cook a recipe at line %d in %s.\n",
+				lineNo,currentFileName);
+		} else if (cookId < 0 || cookId > plan->noCookTypes) {
+			if (!rest) error("Cook id %d not defined at line %d in %s.\n",
+				cookId,lineNo,currentFileName);
+		} else {
+			Num* obs = ctx->obs;
+			XCookType* cookType = plan->cookType+cookId-1;
+			int n = cookType->no;
+			XCook* cook = cookType->cook;
+			if (!rest) ctx->count->cooks[cookId-1]++;
 			while (n--) {
-				if (*(weightReduct->output) == (Num)0.0) 
-					*(weightReduct->input) = (Num)0.0;
-				else
-					*(weightReduct->input) = 
-						amount * *(weightReduct->input) / *(weightReduct->output);
-				weightReduct++;
-			}
-		}
-	}
-
-	if (XnoInputCook) {
-		/* do reductions by cooking */
-		int cookId = (int)*XinputCook;
-		if (cookId) {
-			if (foodType != simpleFood) {
-				error("You can not cook a recipe at line %d in %s.\n",
-					lineNo,currentFileName);
-			} else if (cookId < 0 || cookId > XnoCookTypes) {
-				error("Cook id %d not defined at line %d in %s.\n",
-					cookId,lineNo,currentFileName);
-			} else {
-				XCookType* cookType = XcookType+cookId-1;
-				int n = cookType->no;
-				XCook* cook = cookType->cook;
-				while (n--) {
-					if (foodObs[cook->foodPos] != (Num)0.0) {
-						Num factor = (Num)1.0-foodObs[cook->foodPos];
-						int n = cook->noOutput;
-						Num** poutput = cook->output;
-						while (n--) **poutput++ *= factor;
-					}
-					cook++;
-				}
+				if (foodObs[cook->foodPos] != (Num)0.0) {
+					Num factor = (Num)1.0-foodObs[cook->foodPos];
+					int n = (rest? cook->noOutput-cook->noTestOutput : cook->noTestOutput);
+					int* poutput = (rest? cook->output+cook->noTestOutput : cook->output);
+					while (n--) obs[*poutput++] *= factor;
+				} else if (!rest) ctx->count->zeroReducts++;
+				cook++;
 			}
 		}
 	}
+}
 
-	if (XnoReduct) {
-		/* do reductions by input fields */
-		int n = XnoReduct;
-		XReduct* reduct = Xreduct;
-		while (n--) {
-			if (*(reduct->input) != (Num)0.0) {
-				Num factor = (Num)1.0-*(reduct->input);
-				int n = reduct->noOutput;
-				Num** poutput = reduct->output;
-				while (n--) **poutput++ *= factor;
-			}
-			reduct++;
-		}
+/* this utility function is called by foodCalcFood() to do the reductions by
+   input fields. rest is as for foodCalcCook() */
+void foodCalcReduct(FoodCalcContext* ctx, int rest) {
+	FoodCalcPlan* plan = ctx->plan;
+	Num* obs = ctx->obs;
+	Num* line = ctx->line;
+	int n = plan->noReduct;
+	XReduct* reduct = plan->reduct;
+	while (n--) {
+		if (line[reduct->input] != (Num)0.0) {
+			Num factor = (Num)1.0-line[reduct->input];
+			int n = (rest? reduct->noOutput-reduct->noTestOutput : reduct->noTestOutput);
+			int* poutput = (rest? reduct->output+reduct->noTestOutput : reduct->output);
+			while (n--) obs[*poutput++] *= factor;
+		} else if (!rest) ctx->count->zeroReducts++;
+		reduct++;
 	}
+}
 
-	if (XnoSet) {
-		/* calculate new fields */
-		int n = ((XnoSet2 && foodType != simpleFood)? XnoSet2 : XnoSet);
-			/* calculations after XnoSet2 are recipe set: calculations; we only
-			   do these for simple foods! */
-		XSet* set = Xset;
-		while (n--) {
-			switch (set->op) {
-			case cpyOp: *(set->output) = *(set->u.operan); break;
-			case addOp: *(set->output) += *(set->u.operan); break;
-			case subOp: *(set->output) -= *(set->u.operan); break;
-			case mulOp: *(set->output) *= *(set->u.operan); break;
-			case divOp: if (*(set->u.operan)) *(set->output) /= *(set->u.operan); 
-						else *(set->output) = (Num)0;
-						break;
-			case cpyOpC: *(set->output) = set->u.num; break;
-			case addOpC: *(set->output) += set->u.num; break;
-			case subOpC: *(set->output) -= set->u.num; break;
-			case mulOpC: *(set->output) *= set->u.num; break;
-			case divOpC: *(set->output) /= set->u.num; break;
-			}
-			set++;
-		}
-		if (XnoSet2) {
-			int n = XnoSet2;
-			XSet* set = Xset;
-			while (n--) {
-				switch (set->op) {
-				case cpyOp: *(set->output) = *(set->u.operan); break;
-				case addOp: *(set->output) += *(set->u.operan); break;
-				case subOp: *(set->output) -= *(set->u.operan); break;
-				case mulOp: *(set->output) *= *(set->u.operan); break;
-				case divOp: if (*(set->u.operan)) *(set->output) /= *(set->u.operan); 
-							else *(set->output) = (Num)0;
-							break;
-				case cpyOpC: *(set->output) = set->u.num; break;
-				case addOpC: *(set->output) += set->u.num; break;
-				case subOpC: *(set->output) -= set->u.num; break;
-				case mulOpC: *(set->output) *= set->u.num; break;
-				case divOpC: *(set->output) /= set->u.num; break;
-				}
-				set++;
-			}
+/* this utility function is called by foodCalcFood() to do the where: tests on
+   ctx->obs. returns 1 if the obs should be used, 0 if it should be skipped */
+int foodCalcTest(FoodCalcContext* ctx) {
+	Num* obs = ctx->obs;
+	XTest* test = ctx->plan->test;
+	while (test < ctx->use) {
+		switch (test->op) {
+		case eqOp: if (obs[test->output1] == obs[test->output2]) test = test->action; else test++; break;
+		case neOp: if (obs[test->output1] != obs[test->output2]) test = test->action; else test++; break;
+		case gtOp: if (obs[test->output1] > obs[test->output2]) test = test->action; else test++; break;
+		case geOp: if (obs[test->output1] >= obs[test->output2]) test = test->action; else test++; break;
+		case ltOp: if (obs[test->output1] < obs[test->output2]) test = test->action; else test++; break;
+		case leOp: if (obs[test->output1] <= obs[test->output2]) test = test->action; else test++; break;
 		}
 	}
+	return(test <= ctx->use);
+}
 
-	if (XnoTest) {
-		XTest* test = Xtest;
-		while (test < use) {
-			switch (test->op) {
-			case eqOp: if (*(test->output1) == *(test->output2)) test = test->action; else test++; break;
-			case neOp: if (*(test->output1) != *(test->output2)) test = test->action; else test++; break;
-			case gtOp: if (*(test->output1) > *(test->output2)) test = test->action; else test++; break;
-			case geOp: if (*(test->output1) >= *(test->output2)) test = test->action; else test++; break;
-			case ltOp: if (*(test->output1) < *(test->output2)) test = test->action; else test++; break;
-			case leOp: if (*(test->output1) <= *(test->output2)) test = test->action; else test++; break;
-			}
-		}
-		if (test > use) return; /* skip! */
-	}
+/* this utility function is called by foodCalcFood() to output ctx->obs, or add it to
+   its group if group by: is used */
+void foodCalcUse(FoodCalcContext* ctx, Num* foodObs) {
+	FoodCalcPlan* plan = ctx->plan;
+	Num* obs = ctx->obs;
+	Num* line = ctx->line;
 
-	if (!groupBy) {
+	if (!ctx->groupBy) {
 		/* output the obs */
-		XoutputFun(Xobs,XnoRealOutput);
-		noOutputObs++;
+		foodCalcOutput(ctx,obs);
 	} else {
 
-		if (XnoFoodGroupBy) {
+		HashInt* groupHash = ctx->groupHash;
+		Num* groupObs = ctx->groupObs;
+
+		if (plan->noFoodGroupBy) {
 			/* we group by a food table fields. if this field has a value wich is not
 			   already in the groupHash we make a new initialized enty in the hash. We
 			   set groupObs to the found/new group from the groupHash */
-			if (XnoFoodGroupBy == 1) {
+			if (plan->noFoodGroupBy == 1) {
 
-				int key = (int)**XoutputGroupBy;
+				int key = (int)obs[*plan->outputGroupBy];
 				int hkey = key % groupHash->size;
 				HashIntEntry* entry;
 				HashIntEntry* newEntry = NULL;
 				if (entry = groupHash->table[hkey]) {
 					while (1) {
+						ctx->count->groupSteps++;
 						if (entry->key[0] == key) {
 							/* found entry */
 							groupObs = entry->value;
@@ -5196,12 +7583,13 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 						}
 						if (!entry->next) {
 							/* entry not found */
-							if (groupHashFree) {
-								entry->next = newEntry = groupHashFree;
-								groupHashFree = groupHashFree->next;
+							if (ctx->groupHashFree) {
+								entry->next = newEntry = ctx->groupHashFree;
+								ctx->groupHashFree = ctx->groupHashFree->next;
+								ctx->count->recycledGroups++;
 							} else {
 								entry->next = newEntry = allocStruct(HashIntEntry);
-								newEntry->value = alloc(XnoOutput*sizeof(Num));
+								newEntry->value = alloc(plan->noOutput*sizeof(Num));
 							}
 							break;
 						}
@@ -5209,35 +7597,37 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 					}
 				} else {
 					/* entry not found */
-					if (groupHashFree) {
-						groupHash->table[hkey] = newEntry = groupHashFree;
-						groupHashFree = groupHashFree->next;
+					if (ctx->groupHashFree) {
+						groupHash->table[hkey] = newEntry = ctx->groupHashFree;
+						ctx->groupHashFree = ctx->groupHashFree->next;
+						ctx->count->recycledGroups++;
 					} else {
 						groupHash->table[hkey] = newEntry = allocStruct(HashIntEntry);
-						newEntry->value = alloc(XnoOutput*sizeof(Num));
+						newEntry->value = alloc(plan->noOutput*sizeof(Num));
 					}
 				}
 				if (newEntry) {
 					/* we did not find the entry, so we make a new one */
+					ctx->count->newGroups++;
 					newEntry->key[0] = key;
 					newEntry->next = NULL;
 					groupObs = newEntry->value;
 					{ /* initialize all groupObs fields to zero */
-						int n = XnoOutput;
+						int n = plan->noOutput;
 						Num* pgroupObs = groupObs;
 						while (n--) *pgroupObs++ = 0.0;
 					}
-					groupObs[*XgroupFoodPos] = **XoutputGroupBy;
-					if (XnoInputGroupBy) {
+					groupObs[*plan->groupFoodPos] = obs[*plan->outputGroupBy];
+					if (plan->noInputGroupBy) {
 						/* initialize the groupObs with the input group by fields */
-						int n = XnoInputGroupBy;
-						Num** pinput = XinputGroupBy;
-						int* pgroupPos = XgroupInputPos;
-						while (n--) groupObs[*pgroupPos++] = **pinput++;
+						int n = plan->noInputGroupBy;
+						int* pinput = plan->inputGroupBy;
+						int* pgroupPos = plan->groupInputPos;
+						while (n--) groupObs[*pgroupPos++] = line[*pinput++];
 					}
 				}
 
-			} else { /*(XnoFoodGroupBy > 1)*/
+			} else { /*(plan->noFoodGroupBy > 1)*/
 
 				int key[20];
 				int hkey = 0;
@@ -5245,19 +7635,20 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 				HashIntEntry* newEntry = NULL;
 
 				{ /* set key og hkey */
-					int n = XnoFoodGroupBy;
+					int n = plan->noFoodGroupBy;
 					int* keyp = &(key[0]);
-					Num** output = XoutputGroupBy;
-					while (n--) hkey = (hkey << 10) + (*keyp++ = (int)**output++);
+					int* output = plan->outputGroupBy;
+					while (n--) hkey = (hkey << 10) + (*keyp++ = (int)obs[*output++]);
 					hkey %= groupHash->size;
 				}
 
 				if (entry = groupHash->table[hkey]) {
 					while (1) {
 						int eq = 1;
-						int n = XnoFoodGroupBy;
+						int n = plan->noFoodGroupBy;
 						int* keyp = &(key[0]);
 						int* ekeyp = &(entry->key[0]);
+						ctx->count->groupSteps++;
 						while (n--) if (*keyp++ != *ekeyp++) {eq = 0; break;}
 						if (eq) {
 							/* found entry */
@@ -5266,12 +7657,13 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 						}
 						if (!entry->next) {
 							/* entry not found */
-							if (groupHashFree) {
-								entry->next = newEntry = groupHashFree;
-								groupHashFree = groupHashFree->next;
+							if (ctx->groupHashFree) {
+								entry->next = newEntry = ctx->groupHashFree;
+								ctx->groupHashFree = ctx->groupHashFree->next;
+								ctx->count->recycledGroups++;
 							} else {
 								entry->next = newEntry = alloc(groupHash->entrySize);
-								newEntry->value = alloc(XnoOutput*sizeof(Num));
+								newEntry->value = alloc(plan->noOutput*sizeof(Num));
 							}
 							break;
 						}
@@ -5279,18 +7671,20 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 					}
 				} else {
 					/* entry not found */
-					if (groupHashFree) {
-						groupHash->table[hkey] = newEntry = groupHashFree;
-						groupHashFree = groupHashFree->next;
+					if (ctx->groupHashFree) {
+						groupHash->table[hkey] = newEntry = ctx->groupHashFree;
+						ctx->groupHashFree = ctx->groupHashFree->next;
+						ctx->count->recycledGroups++;
 					} else {
 						groupHash->table[hkey] = newEntry = alloc(groupHash->entrySize);
-						newEntry->value = alloc(XnoOutput*sizeof(Num));
+						newEntry->value = alloc(plan->noOutput*sizeof(Num));
 					}
 				}
 				if (newEntry) {
 					/* we did not find the entry, so we make a new one */
+					ctx->count->newGroups++;
 					{ /* set key */
-						int n = XnoFoodGroupBy;
+						int n = plan->noFoodGroupBy;
 						int* keyp = &(key[0]);
 						int* ekeyp = &(newEntry->key[0]);
 						while (n--) {
@@ -5300,45 +7694,60 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 					newEntry->next = NULL;
 					groupObs = newEntry->value;
 					{ /* initialize all groupObs fields to zero */
-						int n = XnoOutput;
+						int n = plan->noOutput;
 						Num* pgroupObs = groupObs;
 						while (n--) *pgroupObs++ = 0.0;
 					}
 					{ /* initialize the groupObs with the food group by fields */
-						int n = XnoFoodGroupBy;
-						Num** output = XoutputGroupBy;
-						int* pos = XgroupFoodPos;
-						while (n--) groupObs[*pos++] = **output++;
+						int n = plan->noFoodGroupBy;
+						int* output = plan->outputGroupBy;
+						int* pos = plan->groupFoodPos;
+						while (n--) groupObs[*pos++] = obs[*output++];
 					}
-					if (XnoInputGroupBy) {
+					if (plan->noInputGroupBy) {
 						/* initialize the groupObs with the input group by fields */
-						int n = XnoInputGroupBy;
-						Num** pinput = XinputGroupBy;
-						int* pgroupPos = XgroupInputPos;
-						while (n--) groupObs[*pgroupPos++] = **pinput++;
+						int n = plan->noInputGroupBy;
+						int* pinput = plan->inputGroupBy;
+						int* pgroupPos = plan->groupInputPos;
+						while (n--) groupObs[*pgroupPos++] = line[*pinput++];
 					}
 				}
 			}
+			ctx->groupObs = groupObs;
 		}
 
 		{ /* add the obs to the groupObs */
-			int n = noGroupAdd;
-			int* pgroupPos = groupPos;
-			Num** poutput = outputGroup;
-			while (n--) 
-				groupObs[*pgroupPos++] += **poutput++;
-		}
-		if (XnoTranspose) {
-			int n = XnoTranspose;
-			XTranspose* transpose = Xtranspose;
+			int n = ctx->noGroupAdd;
+			int* pgroupPos = ctx->groupPos;
+			if (ctx->sparse) {
+				/* the nutrient fields are the first in groupPos. the zero fields of a
+				   sparse row would add nothing */
+				SparseNutri* sparse = ctx->sparse;
+				int* poutput = plan->outputNutri;
+				while (sparse->pos < plan->noFoodNutri) {
+					int pos = poutput[sparse++->pos];
+					groupObs[pos] += obs[pos];
+				}
+				n -= plan->noFoodNutri;
+				pgroupPos += plan->noFoodNutri;
+			}
+			while (n--) {
+				groupObs[*pgroupPos] += obs[*pgroupPos];
+				pgroupPos++;
+			}
+		}
+		if (plan->noTranspose && !plan->isRollup) {
+			/* a rollup level adds up the transposed fields as the other fields */
+			int n = plan->noTranspose;
+			XTranspose* transpose = plan->transpose;
 			while (n--) {
 				int key = (int)foodObs[transpose->pos];
 				if (key > 0 && key <= transpose->noGroups) {
 					int groupPos = transpose->groupPos - 1;
 					int n = transpose->noOutput;
-					Num** poutput = transpose->output;
+					int* poutput = transpose->output;
 					while (n--) {
-						groupObs[groupPos+key] += **poutput++;
+						groupObs[groupPos+key] += obs[*poutput++];
 						groupPos += transpose->noGroups;
 					}
 				}
@@ -5348,117 +7757,737 @@ void foodCalcFood(Num* foodObs, FoodType foodType) {
 	}
 }
 
-
-/* this is the foodCalc() function - see comments above! */
-void foodCalc() {
-
-	/* initialize variables */
-	noInputLines = 0;
-	noOutputObs = 0;
-	groupBy = XnoInputGroupBy+XnoFoodGroupBy;
-	blip = XnoBlip;
-	simpleUse = XsimpleTest+XnoSimpleTest;
-	use = Xtest+XnoTest;
-
-	if (groupBy) {
-		/* initialize group by work variables */
-		int n = XnoOutput;
-		Num* pgroupObs = groupObs = alloc(XnoOutput*sizeof(Num));
-		while (n--) *pgroupObs++ = 0.0;
-		if (XnoFoodGroupBy) {
-			if (XnoFoodGroupBy == 1) groupHash = newHashInt(241);
-			else groupHash = newHashIntN(241,XnoFoodGroupBy);
-			groupHashFree = NULL;
-		}
-		{	/* count group add positions */
-			XSet* set = Xset;
-			int n = XnoSet;
-			noGroupAdd = XnoFoodNutri;
-			while (n--) {
-				if (set->op == cpyOp || set->op == cpyOpC) noGroupAdd++;
-				set++;
-			}
+/* this utility function is called by foodCalc() to calculate an ingredients or a
+   simple food */
+void foodCalcFood(FoodCalcContext* ctx, Num* foodObs, SparseNutri* sparse,
+				  FoodType foodType) {
+
+	FoodCalcPlan* plan = ctx->plan;
+	Num* obs = ctx->obs;
+	Num* line = ctx->line;
+	Num amount = line[plan->inputAmount];
+	Num zero; /* the value of a nutrient field that is zero in a sparse row */
+
+	if (plan->noSimpleTest) {
+		XSimpleTest* test = plan->simpleTest;
+		while (test < ctx->simpleUse) {
+			switch (test->op) {
+			case eqOp: if (foodObs[test->pos] == test->num) test = test->action; else test++; break;
+			case neOp: if (foodObs[test->pos] != test->num) test = test->action; else test++; break;
+			case gtOp: if (foodObs[test->pos] > test->num) test = test->action; else test++; break;
+			case geOp: if (foodObs[test->pos] >= test->num) test = test->action; else test++; break;
+			case ltOp: if (foodObs[test->pos] < test->num) test = test->action; else test++; break;
+			case leOp: if (foodObs[test->pos] <= test->num) test = test->action; else test++; break;
+			}
 		}
-		{	/* set group add positions */
-			int* pos = groupPos = alloc(noGroupAdd*sizeof(int));
-			Num** output = outputGroup = alloc(noGroupAdd*sizeof(Num*));
-			Num** xoutputNutri = XoutputNutri;
-			XSet* set = Xset;
-			int n = XnoFoodNutri;
-			while (n--) {
-				*pos++ = *xoutputNutri - Xobs;
-				*output++ = *xoutputNutri++;
+		if (test > ctx->simpleUse) {ctx->count->simpleSkips++; return;} /* skip! */
+	}
+
+	if (plan->noInputMove) {
+		/* move all fields from line to obs */
+		int n = plan->noInputMove;
+		int* pinput = plan->inputMove;
+		int* poutput = plan->outputInput;
+		while (n--) obs[*poutput++] = line[*pinput++];
+	}
+
+	if (plan->noFoodMove) {
+		/* move all noCalc fields from foodObs to obs */
+		int n = plan->noFoodMove;
+		int* pfoodPos = plan->foodMovePos;
+		int* poutput = plan->outputFood;
+		while (n--) obs[*poutput++] = foodObs[*pfoodPos++];
+	}
+
+	if (plan->noNonEdible) {
+		if (foodType == simpleFood && (!plan->noNonEdibleFlag || line[plan->nonEdibleFlag]))
+			amount *= (Num)1.0 - foodObs[plan->nonEdible];
+	}
+
+	if (sparse) {
+		/* the zero fields are calculated as the others, so a negative amount gives
+		   -0 and a NaN amount gives NaN, just as a dense row. in that last case
+		   all the fields must be added to the group */
+		zero = amount*plan->inputAmountScale*(Num)0.0;
+		ctx->sparse = (plan->sparseGroup && zero == (Num)0.0 ? sparse : NULL);
+	} else ctx->sparse = NULL;
+
+	if (plan->noTestNutri) {
+		/* calculate nutrient fields from foodObs to obs (only the fields needed
+		   by the tests, if plan->lazyTest) */
+		int n = plan->noTestNutri;
+		int* pfoodPos = plan->foodNutriPos;
+		int* poutput = plan->outputNutri;
+		if (sparse) {
+			/* set all the fields to zero, and then calculate the non-zero fields */
+			while (n--) obs[*poutput++] = zero;
+			poutput = plan->outputNutri;
+			while (sparse->pos < plan->noTestNutri) {
+				obs[poutput[sparse->pos]] = amount*plan->inputAmountScale*sparse->num;
+				sparse++;
 			}
-			n = XnoSet;
+		} else {
+			while (n--)
+				obs[*poutput++] = amount*plan->inputAmountScale*foodObs[*pfoodPos++];
+		}
+	}
+
+	if (plan->noWeightReduct) {
+		if (plan->noCalcWeightReduct) {
+			/* calculate new fields - will be recalculated after reductions */
+			foodCalcSet(obs,plan->set,plan->noSet);
+		}
+		{ /* change fractions */
+			int n = plan->noWeightReduct;
+			XWeightReduct* weightReduct = plan->weightReduct;
 			while (n--) {
-				if (set->op == cpyOp || set->op == cpyOpC) {
-					*pos++ = set->output - Xobs;
-					*output++ = set->output;
-				}
-				set++;
+				if (obs[weightReduct->output] == (Num)0.0)
+					line[weightReduct->input] = (Num)0.0;
+				else
+					line[weightReduct->input] =
+						amount * line[weightReduct->input] / obs[weightReduct->output];
+				weightReduct++;
 			}
 		}
 	}
 
-	while (XinputFun(Xline,XnoInput,Xtext,Xstar)) {
-		FoodEntry* foodEntry;
-		
-		if (++noInputLines == blip) {
-			fprintf(stderr," %d\r",blip);
-			blip += XnoBlip;
+	if (plan->noInputCook) foodCalcCook(ctx,foodObs,foodType,0);
+
+	if (plan->noReduct) foodCalcReduct(ctx,0);
+
+	if (plan->noSet) {
+		/* calculate new fields */
+		foodCalcSet(obs,plan->set,
+			((plan->noSet2 && foodType != simpleFood)? plan->noSet2 : plan->noTestSet));
+			/* calculations after noSet2 are recipe set: calculations; we only
+			   do these for simple foods! */
+		if (plan->noSet2) foodCalcSet(obs,plan->set,plan->noSet2);
+	}
+
+	if (plan->noBlock) {
+		/* the output blocks use the obs with their own where: and group by: */
+		int n = plan->noBlock;
+		FoodCalcContext* block = ctx->block;
+		while (n--) {
+			if (!block->plan->noTest || foodCalcTest(block)) foodCalcUse(block,foodObs);
+			block++;
 		}
+	}
 
-		if (XnoInputGroupBy) {
-			/* check if we have reached a new group. if we have, we call 
-			   foodCalcGroupFlush() to output the current group */
-			int n = XnoInputGroupBy;
-			Num** pinput = XinputGroupBy;
-			int* pgroupPos = XgroupInputPos;
-			while (n--) {
-				if (**pinput != groupObs[*pgroupPos]) {
-					if (**pinput < groupObs[*pgroupPos])
-						abortAndExit("File %s not sorted on the group by fields.\n",currentFileName);
-					foodCalcGroupFlush();
-					break;
-				}
-				pinput++; pgroupPos++;
+	if (plan->noTest && !foodCalcTest(ctx)) {ctx->count->testSkips++; return;} /* skip! */
+
+	if (plan->lazyTest) {
+		/* the obs is used, so now we calculate the fields not needed by the tests */
+		int n = plan->noFoodNutri-plan->noTestNutri;
+		int* pfoodPos = plan->foodNutriPos+plan->noTestNutri;
+		int* poutput = plan->outputNutri+plan->noTestNutri;
+		if (sparse) {
+			/* sparse is at the first field not needed by the tests */
+			while (n--) obs[*poutput++] = zero;
+			poutput = plan->outputNutri;
+			while (sparse->pos < plan->noFoodNutri) {
+				obs[poutput[sparse->pos]] = amount*plan->inputAmountScale*sparse->num;
+				sparse++;
+			}
+		} else {
+			while (n--)
+				obs[*poutput++] = amount*plan->inputAmountScale*foodObs[*pfoodPos++];
+		}
+		if (plan->noInputCook) foodCalcCook(ctx,foodObs,foodType,1);
+		if (plan->noReduct) foodCalcReduct(ctx,1);
+		foodCalcSet(obs,plan->set+plan->noTestSet,plan->noSet-plan->noTestSet);
+	}
+
+	foodCalcUse(ctx,foodObs);
+}
+
+
+/* this utility function is called by foodCalc() for each line read. it counts the
+   line and returns 0 if the line should be skipped because of input where: */
+int foodCalcRead(FoodCalcContext* ctx, Num* line) {
+	FoodCalcPlan* plan = ctx->plan;
+
+	countInc(ctx->noInputLines);
+	if (ctx->noInputLines == ctx->blip) {
+		fprintf(stderr," %d\r",ctx->blip);
+		ctx->blip += plan->noBlip;
+	}
+
+	if (plan->noInputTest) {
+		/* skip the line before anything else is done, if the input where: tests
+		   says so */
+		XInputTest* test = plan->inputTest;
+		while (test < ctx->inputUse) {
+			Num num = (test->pos2 < 0? test->num : line[test->pos2]);
+			switch (test->op) {
+			case eqOp: if (line[test->pos1] == num) test = test->action; else test++; break;
+			case neOp: if (line[test->pos1] != num) test = test->action; else test++; break;
+			case gtOp: if (line[test->pos1] > num) test = test->action; else test++; break;
+			case geOp: if (line[test->pos1] >= num) test = test->action; else test++; break;
+			case ltOp: if (line[test->pos1] < num) test = test->action; else test++; break;
+			case leOp: if (line[test->pos1] <= num) test = test->action; else test++; break;
 			}
 		}
+		if (test > ctx->inputUse) {ctx->noSkipInputLines++; return(0);} /* skip! */
+	}
+
+	return(1);
+}
+
+/* this utility function is called by foodCalcLine() when group by: input fields is
+   used. it checks if we have reached a new group. if we have, it calls
+   foodCalcGroupFlush() to output the current group (if this is not the first
+   line) and starts the new group */
+void foodCalcGroupCheck(FoodCalcContext* ctx) {
+	FoodCalcPlan* plan = ctx->plan;
+	Num* line = ctx->line;
+	int n = plan->noInputGroupBy;
+	int* pinput = plan->inputGroupBy;
+	int* pgroupPos = plan->groupInputPos;
+	while (n--) {
+		if (line[*pinput] != ctx->groupObs[*pgroupPos]) {
+			if (line[*pinput] < ctx->groupObs[*pgroupPos])
+				abortAndExit("File %s not sorted on the group by fields.\n",currentFileName);
+			if (ctx->noCalcLines > 1) foodCalcGroupFlush(ctx);
+			foodCalcGroupInit(ctx);
+			break;
+		}
+		pinput++; pgroupPos++;
+	}
+}
+
+/* this utility function is called by foodCalcGroupOutput() to add a finished group of
+   the plan to its group in a rollup level */
+void foodCalcRollup(FoodCalcContext* level, Num* groupObs) {
+	level->obs = level->line = groupObs;
+	level->noCalcLines++;
+	if (level->plan->noInputGroupBy) foodCalcGroupCheck(level);
+	foodCalcUse(level,NULL);
+}
+
+/* this utility function is called by foodCalc() to calculate the line in ctx->line.
+   foodEntry is the food of the line if it has already been looked up, else NULL */
+void foodCalcLine(FoodCalcContext* ctx, FoodEntry* foodEntry) {
+	FoodCalcPlan* plan = ctx->plan;
+	Num* line = ctx->line;
 
-		/* find the food in the table */
-		if (!(foodEntry = lookInt(foodTable,(int)*XinputFood))) {
-			/* food not found */
-			/* if Xflush is not NULL we call it and the we try to look for the
-			   food again. This is used when we read a recipe file and
-			   keepIngredients is 1. A realy ugly hack! */
-			if (!Xflush || 
-				!((*Xflush)(), (foodEntry = lookInt(foodTable,(int)*XinputFood)))) {
+	ctx->noCalcLines++;
+	if (plan->noInputGroupBy) foodCalcGroupCheck(ctx);
+
+	if (plan->noBlock) {
+		int n = plan->noBlock;
+		FoodCalcContext* block = ctx->block;
+		while (n--) {
+			block->noCalcLines++;
+			if (block->plan->noInputGroupBy) foodCalcGroupCheck(block);
+			block++;
+		}
+	}
+
+	/* find the food in the table */
+	ctx->count->lookups++;
+	if (!foodEntry && !(foodEntry = lookIntCount(foodTable,(int)line[plan->inputFood],
+												 &ctx->count->chainSteps))) {
+		/* food not found */
+		/* if ctx->flush is not NULL we call it and the we try to look for the
+		   food again. This is used when we read a recipe file and
+		   keepIngredients is 1. A realy ugly hack! */
+		if (!ctx->flush ||
+			!((*ctx->flush)(), (foodEntry = lookInt(foodTable,(int)line[plan->inputFood])))) {
+			if (plan->text[plan->inputFood] == 2 && line[plan->inputFood] > 0)
+				error("Food code '%s' not found in food table at line %d in %s.\n",
+					codeName((int)line[plan->inputFood]),lineNo,currentFileName);
+			else
 				error("Food id %d not found in food table at line %d in %s.\n",
-					(int)*XinputFood,lineNo,currentFileName);
-				continue;
+					(int)line[plan->inputFood],lineNo,currentFileName);
+			ctx->count->misses++;
+			return;
+		}
+	}
+
+	/* food found */
+	if (ctx->foodUses) ctx->foodUses[foodEntry->no]++;
+	if (foodEntry->foodType == expandedRecipe) {
+		RecipeEntry* recipeEntry = foodEntry->u.recipe;
+		while (recipeEntry) {
+			ctx->count->ingredients++;
+			foodCalcFood(ctx,recipeEntry->obs,(plan->noSparse ? recipeEntry->sparse : NULL),
+				foodEntry->foodType);
+			recipeEntry = recipeEntry->next;
+		}
+	} else {
+		foodCalcFood(ctx,foodEntry->u.obs,(plan->noSparse ? foodEntry->sparse : NULL),
+			foodEntry->foodType);
+	}
+}
+
+
+/* this utility function is called by foodCalc() before the first line. it
+   initializes the context */
+void foodCalcStart(FoodCalcContext* ctx) {
+
+	FoodCalcPlan* plan = ctx->plan;
+
+	/* initialize variables */
+	countSet(ctx->noInputLines,0);
+	ctx->noSkipInputLines = ctx->noCalcLines = 0;
+	countSet(ctx->noOutputObs,0);
+	ctx->groupBy = plan->noInputGroupBy+plan->noFoodGroupBy;
+	if (plan->isRollup) ctx->groupBy = 1; /* also a level with no fields has a group */
+	ctx->blip = plan->noBlip;
+	ctx->simpleUse = plan->simpleTest+plan->noSimpleTest;
+	ctx->use = plan->test+plan->noTest;
+	ctx->inputUse = plan->inputTest+plan->noInputTest;
+
+	if (ctx->groupBy) {
+		/* initialize group by work variables */
+		int n = plan->noOutput;
+		Num* pgroupObs = ctx->groupObs = alloc(plan->noOutput*sizeof(Num));
+		while (n--) *pgroupObs++ = 0.0;
+		if (plan->noFoodGroupBy) {
+			/* the groups are output in the order of the chains, so the group hash
+			   keeps the fixed prime size and the key % size index of earlier versions.
+			   it is not in the list of all hashes, as it belongs to the run */
+			HashInt* hash = ctx->groupHash = allocStruct(HashInt);
+			hash->size = 241;
+			hash->noKeys = plan->noFoodGroupBy;
+			hash->entrySize = sizeof(HashIntEntry)+(hash->noKeys-1)*sizeof(int);
+			hash->noEntries = 0;
+			hash->table = allocarray(hash->size,sizeof(HashIntEntry*));
+			hash->name = "group by";
+			hash->arena = NULL; /* the entries are freed one by one */
+			hash->next = NULL;
+			ctx->groupHashFree = NULL;
+		}
+		{	/* count group add positions */
+			XSet* set = plan->set;
+			int n = plan->noSet;
+			ctx->noGroupAdd = plan->noFoodNutri;
+			while (n--) {
+				if (set->op == cpyOp || set->op == cpyOpC) ctx->noGroupAdd++;
+				set++;
+			}
+			if (plan->isRollup) {
+				XTranspose* transpose = plan->transpose;
+				n = plan->noTranspose;
+				while (n--) {
+					ctx->noGroupAdd += transpose->noOutput*transpose->noGroups;
+					transpose++;
+				}
+			}
+		}
+		{	/* set group add positions */
+			int* pos = ctx->groupPos = alloc(ctx->noGroupAdd*sizeof(int));
+			XSet* set = plan->set;
+			int n = plan->noFoodNutri;
+			memcpy(pos,plan->outputNutri,n*sizeof(int));
+			pos += n;
+			n = plan->noSet;
+			while (n--) {
+				if (set->op == cpyOp || set->op == cpyOpC) *pos++ = set->output;
+				set++;
+			}
+			if (plan->isRollup) {
+				/* the transposed fields of a transpose are after each other */
+				XTranspose* transpose = plan->transpose;
+				n = plan->noTranspose;
+				while (n--) {
+					int k = transpose->noOutput*transpose->noGroups;
+					int p = transpose->groupPos;
+					while (k--) *pos++ = p++;
+					transpose++;
+				}
 			}
 		}
+	}
+
+	{	/* initialize the output blocks and rollup levels */
+		int i;
+		for (i = 0; i < plan->noBlock; i++) foodCalcStart(ctx->block+i);
+		for (i = 0; i < plan->noRollup; i++) foodCalcStart(ctx->rollup+i);
+	}
+}
+
+/* this utility function is called by foodCalc() after the last line */
+void foodCalcEnd(FoodCalcContext* ctx) {
+	int i;
+	if (ctx->groupBy && ctx->noCalcLines) foodCalcGroupFlush(ctx);
+	for (i = 0; i < ctx->plan->noBlock; i++) foodCalcEnd(ctx->block+i);
+	for (i = 0; i < ctx->plan->noRollup; i++) foodCalcEnd(ctx->rollup+i);
+}
+
+
+#ifdef HAVE_PIPELINE
+/* with the pipeline: command foodCalc() runs in three threads: a reader thread reads
+   the lines of the input file and does the input where: tests, the calling thread
+   calculates the lines, and a writer thread writes the output lines of the run (and
+   of its output blocks and rollup levels). The threads give the lines to each other
+   through rings of preallocated slots, each with one thread putting slots in and
+   another taking them out, so no locks are needed: the producer only writes head and
+   the consumer only writes tail. A thread waiting for a ring is idle, and the busy
+   and idle times of the threads are logged */
+typedef struct {
+	Num* row;				/* array[size*noRow] of the values of the slots */
+	int* no;				/* array[size] of line numbers or numbers of values */
+	FoodCalcContext** ctx;	/* array[size] of the contexts of output lines */
+	int noRow;				/* no of values in a slot */
+	unsigned size;			/* no of slots */
+	char pad1[64];
+	unsigned head;			/* no of slots put in, only written by the producer */
+	int done;				/* set by the producer when the last slot is put in */
+	char pad2[64];
+	unsigned tail;			/* no of slots taken out, only written by the consumer */
+	char pad3[64];
+} Ring;
+
+typedef struct {
+	double start;			/* time the thread started */
+	double busy;			/* seconds the thread was busy */
+	double idle;			/* seconds the thread waited for a ring */
+	int errors;				/* errors of the thread */
+} PipeStage;
 
-		/* food found */
-		if (foodEntry->foodType == expandedRecipe) {
-			RecipeEntry* recipeEntry = foodEntry->u.recipe;
-			while (recipeEntry) {
-				foodCalcFood(recipeEntry->obs,foodEntry->foodType);
-				recipeEntry = recipeEntry->next;
+typedef struct {
+	FoodCalcContext* ctx;	/* the run */
+	double* read4buf;		/* read4buf of the calling thread */
+	Ring lines;				/* the lines read */
+	Ring rows;				/* the lines to output */
+	PipeStage reader;
+	PipeStage calc;
+	PipeStage writer;
+} Pipeline;
+
+threadLocal Pipeline* pipeRun;/* the run outputPipe() puts lines in the ring of */
+
+void newRing(Ring* ring, unsigned size, int noRow) {
+	memset(ring,0,sizeof(Ring));
+	ring->size = size;
+	ring->noRow = noRow;
+	ring->row = alloc(size*noRow*sizeof(Num));
+	ring->no = alloc(size*sizeof(int));
+	ring->ctx = alloc(size*sizeof(FoodCalcContext*));
+}
+
+void freeRing(Ring* ring) {
+	free(ring->row); free(ring->no); free(ring->ctx);
+}
+
+/* wait until the ring has a free slot and return its index */
+unsigned ringPut(Ring* ring, PipeStage* stage) {
+	unsigned head = ring->head;
+	if (head - __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE) == ring->size) {
+		double t = wallTime();
+		while (head - __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE) == ring->size)
+			sched_yield();
+		stage->idle += wallTime()-t;
+	}
+	return(head % ring->size);
+}
+
+/* give the slot from ringPut() to the consumer */
+void ringPutDone(Ring* ring) {
+	__atomic_store_n(&ring->head,ring->head+1,__ATOMIC_RELEASE);
+}
+
+/* tell the consumer that no more slots will be put in */
+void ringEnd(Ring* ring) {
+	__atomic_store_n(&ring->done,1,__ATOMIC_RELEASE);
+}
+
+/* wait until the ring has a slot and return its index, or -1 if the ring is empty
+   and ended */
+int ringGet(Ring* ring, PipeStage* stage) {
+	unsigned tail = ring->tail;
+	if (tail == __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE)) {
+		double t = wallTime();
+		while (tail == __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&ring->done,__ATOMIC_ACQUIRE)) {
+				/* done is set after the last head, so look at head again */
+				if (tail == __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE)) {
+					stage->idle += wallTime()-t;
+					return(-1);
+				}
+				break;
+			}
+			sched_yield();
+		}
+		stage->idle += wallTime()-t;
+	}
+	return((int)(tail % ring->size));
+}
+
+/* give the slot from ringGet() back to the producer */
+void ringGetDone(Ring* ring) {
+	__atomic_store_n(&ring->tail,ring->tail+1,__ATOMIC_RELEASE);
+}
+
+/* the outputFun of the contexts of a pipelined run. the line is put in the ring of
+   the writer thread */
+void outputPipe(FoodCalcContext* ctx, Num* obs, int no) {
+	Ring* ring = &pipeRun->rows;
+	unsigned i = ringPut(ring,&pipeRun->calc);
+	memcpy(ring->row+i*ring->noRow,obs,no*sizeof(Num));
+	ring->no[i] = no;
+	ring->ctx[i] = ctx;
+	ringPutDone(ring);
+}
+
+/* the reader thread of a pipelined run */
+void* pipeReader(void* arg) {
+	Pipeline* pipe = arg;
+	FoodCalcContext* ctx = pipe->ctx;
+	FoodCalcPlan* plan = ctx->plan;
+	Ring* ring = &pipe->lines;
+	Num* line = allocarray(plan->noInput+1,sizeof(Num)); /* star fields are kept */
+	pipe->reader.start = wallTime();
+	read4buf = pipe->read4buf;
+	setCurrent(ctx->input);
+	while (ctx->inputFun(line,plan->noInput,plan->text,plan->star)) {
+		unsigned i;
+		if (!foodCalcRead(ctx,line)) continue;
+		i = ringPut(ring,&pipe->reader);
+		memcpy(ring->row+i*ring->noRow,line,plan->noInput*sizeof(Num));
+		ring->no[i] = lineNo;
+		ringPutDone(ring);
+	}
+	ringEnd(ring);
+	getCurrent(ctx->input);
+	free(line);
+	pipe->reader.errors = errors;
+	pipe->reader.busy = wallTime()-pipe->reader.start-pipe->reader.idle;
+	return(NULL);
+}
+
+/* the writer thread of a pipelined run */
+void* pipeWriter(void* arg) {
+	Pipeline* pipe = arg;
+	Ring* ring = &pipe->rows;
+	int i;
+	pipe->writer.start = wallTime();
+	while ((i = ringGet(ring,&pipe->writer)) >= 0) {
+		FoodCalcContext* ctx = ring->ctx[i];
+		ctx->pipeOutputFun(ctx,ring->row+i*ring->noRow,ring->no[i]);
+		ringGetDone(ring);
+	}
+	pipe->writer.errors = errors;
+	pipe->writer.busy = wallTime()-pipe->writer.start-pipe->writer.idle;
+	return(NULL);
+}
+
+/* let the output of a context go through the ring of the writer thread. returns the
+   max no of values in its lines */
+int pipeOutput(FoodCalcContext* ctx, int undo) {
+	int i;
+	int noRow = ctx->plan->noRealOutput;
+	if (!undo) {
+		ctx->pipeOutputFun = ctx->outputFun;
+		ctx->outputFun = outputPipe;
+	} else {
+		ctx->outputFun = ctx->pipeOutputFun;
+	}
+	for (i = 0; i < ctx->plan->noBlock; i++) {
+		int n = pipeOutput(ctx->block+i,undo);
+		if (n > noRow) noRow = n;
+	}
+	for (i = 0; i < ctx->plan->noRollup; i++) {
+		int n = pipeOutput(ctx->rollup+i,undo);
+		if (n > noRow) noRow = n;
+	}
+	return(noRow);
+}
+
+/* this is called by foodCalc() to run a pipelined run. it calculates the lines from
+   the reader thread in the calling thread */
+void foodCalcPipeline(FoodCalcContext* ctx) {
+	FoodCalcPlan* plan = ctx->plan;
+	Pipeline* pipe = allocarray(1,sizeof(Pipeline));
+	pthread_t reader, writer;
+	int i;
+
+	pipe->ctx = ctx;
+	pipe->read4buf = read4buf;
+	pipe->calc.start = wallTime();
+	newRing(&pipe->lines,plan->pipeline,plan->noInput);
+	newRing(&pipe->rows,plan->pipeline,pipeOutput(ctx,0));
+	pipeRun = pipe;
+	if (pthread_create(&reader,NULL,pipeReader,pipe) ||
+		pthread_create(&writer,NULL,pipeWriter,pipe))
+		abortAndExit("Could not start the threads of the pipeline.\n");
+
+	while ((i = ringGet(&pipe->lines,&pipe->calc)) >= 0) {
+		memcpy(ctx->line,pipe->lines.row+i*pipe->lines.noRow,plan->noInput*sizeof(Num));
+		lineNo = pipe->lines.no[i];
+		ringGetDone(&pipe->lines);
+		foodCalcLine(ctx,NULL);
+	}
+	foodCalcEnd(ctx);
+	ringEnd(&pipe->rows);
+	pipe->calc.busy = wallTime()-pipe->calc.start-pipe->calc.idle;
+
+	pthread_join(reader,NULL);
+	pthread_join(writer,NULL);
+	pipeOutput(ctx,1);
+	pipeRun = NULL;
+	errors += pipe->reader.errors + pipe->writer.errors;
+	setCurrent(ctx->input); /* the state the reader thread left the file in */
+
+	logmsg("Pipeline: reader busy %.2fs idle %.2fs, calculation busy %.2fs idle %.2fs, writer busy %.2fs idle %.2fs.\n",
+		pipe->reader.busy,pipe->reader.idle,pipe->calc.busy,pipe->calc.idle,
+		pipe->writer.busy,pipe->writer.idle);
+	freeRing(&pipe->lines);
+	freeRing(&pipe->rows);
+	free(pipe);
+}
+#endif
+
+
+/* this is the foodCalc() function - see comments above! it reads ctx->input until
+   the end, and leaves the file in the state it is in then */
+void foodCalc(FoodCalcContext* ctx) {
+
+	FoodCalcPlan* plan = ctx->plan;
+
+	foodCalcStart(ctx);
+	setCurrent(ctx->input);
+
+#ifdef HAVE_PIPELINE
+	if (plan->pipeline) {
+		foodCalcPipeline(ctx);
+		getCurrent(ctx->input);
+		return;
+	}
+#endif
+
+	if (plan->lookAhead < 2) {
+
+		while (ctx->inputFun(ctx->line,plan->noInput,plan->text,plan->star))
+			if (foodCalcRead(ctx,ctx->line)) foodCalcLine(ctx,NULL);
+
+	} else {
+
+		/* we read plan->lookAhead lines ahead of the line we calculate, and prefetch
+		   the food table entries and rows for the lines read, so they are (hopefully)
+		   in the cache when we get to them. the lookup of a line is done half way
+		   through the ring, and the row is prefetched just before the line before
+		   it is calculated. the food found is given to foodCalcLine(), so it does not
+		   look it up again */
+		int k = plan->lookAhead;
+		int half = k/2;
+		Num** ringLine = alloc(k*sizeof(Num*));		/* lines read */
+		int* ringLineNo = alloc(k*sizeof(int));		/* lineNo after each line */
+		FoodEntry** ringFood = alloc(k*sizeof(FoodEntry*)); /* food found, or NULL if not
+												   found or not looked up yet */
+		Num* starLine = allocarray(plan->star+1,sizeof(Num)); /* the star fields of the
+												   last line read, also a skipped one */
+		int head = 0;		/* no of lines read into the ring */
+		int tail = 0;		/* no of lines calculated */
+		int eofReached = 0;
+		int i;
+		for (i = 0; i < k; i++) ringLine[i] = alloc(plan->noInput*sizeof(Num));
+
+		while (1) {
+			while (!eofReached && head-tail < k) {
+				Num* line = ringLine[head%k];
+				int foodPos = plan->inputFood;
+				if (plan->star) /* star fields are only read on star lines */
+					memcpy(line,starLine,plan->star*sizeof(Num));
+				if (!ctx->inputFun(line,plan->noInput,plan->text,plan->star)) {
+					eofReached = 1;
+					break;
+				}
+				if (plan->star) memcpy(starLine,line,plan->star*sizeof(Num));
+				if (!foodCalcRead(ctx,line)) continue;
+				ringLineNo[head%k] = lineNo;
+				ringFood[head%k] = NULL;
+				prefetch(foodTable->table+hashIntIndex(foodTable,(int)line[foodPos]));
+				head++;
+				if (head-tail > half) {
+					/* look up the food half way through the ring */
+					int j = (head-1-half)%k;
+					int key = (int)ringLine[j][foodPos];
+					if (key > 0 && (ringFood[j] = lookIntCount(foodTable,key,
+															   &ctx->count->chainSteps)))
+						prefetch(ringFood[j]);
+				}
+			}
+			if (tail == head) break;
+			if (tail+1 < head && ringFood[(tail+1)%k]) {
+				/* prefetch the row for the next line, its sparse row if it has one, as
+				   foodCalcFood() then takes the nutrient fields from that. the length
+				   of a sparse row is only known by walking it, so its lines are
+				   prefetched up to the longest it can be */
+				FoodEntry* foodEntry = ringFood[(tail+1)%k];
+				Num* obs = (foodEntry->foodType == expandedRecipe?
+					foodEntry->u.recipe->obs : foodEntry->u.obs);
+				SparseNutri* sparse = (!plan->noSparse ? NULL :
+					foodEntry->foodType == expandedRecipe?
+					foodEntry->u.recipe->sparse : foodEntry->sparse);
+				int n;
+				if (sparse) {
+					n = (plan->noFoodNutri*sparseMaxPct/100+1)*sizeof(SparseNutri);
+					while (n > 0) {prefetch((char*)sparse+n-1); n -= 64;}
+					prefetch(sparse);
+				} else {
+					n = foodTableFields.no*sizeof(Num);
+					while (n > 0) {prefetch((char*)obs+n-1); n -= 64;}
+					prefetch(obs);
+				}
+			}
+			{	/* calculate the line at the tail of the ring */
+				int readLineNo = lineNo;
+				memcpy(ctx->line,ringLine[tail%k],plan->noInput*sizeof(Num));
+				lineNo = ringLineNo[tail%k];
+				foodCalcLine(ctx,ringFood[tail%k]);
+				lineNo = readLineNo;
+				tail++;
 			}
-		} else {
-			foodCalcFood(foodEntry->u.obs,foodEntry->foodType);
 		}
+
+		for (i = 0; i < k; i++) free(ringLine[i]);
+		free(ringLine); free(ringLineNo); free(ringFood); free(starLine);
 	}
 
-	if (groupBy && noInputLines) foodCalcGroupFlush();
+	foodCalcEnd(ctx);
+	getCurrent(ctx->input);
 }
 
 
 
 /************************************************************************************/
-/*** these utility functions are used to set set the foodCalc() variables before
-     calling foodCalc() */
+/*** these utility functions are used to set the FoodCalcPlan before calling
+     foodCalc(). the plan should be allocated with zeros */
+
+
+/* utility function to make the array of the group set: calculations. no is set to
+   the no of calculations */
+XGroupSet* setGroupSetPos(int* no) {
+	Set* set;
+	XGroupSet* xsets;
+	XGroupSet* xset;
+	*no = 0;
+	for (set = groupSets.first; set; set = set->next)
+		if (set->field->toPos) *no += set->opers.no;
+	xset = xsets = alloc(*no*sizeof(XGroupSet));
+	for (set = groupSets.first; set; set = set->next) {
+		Field* setField = set->field;
+		if (setField->toPos) {
+			SetOper* oper = set->opers.first;
+			while (oper) {
+				xset->pos = setField->toPos - 1;
+				if (oper->field->noCalc == 9/*constant*/) {
+					xset->op = oper->op+5;
+					xset->u.num = *(Num*)oper->field->next;
+				} else {
+					xset->op = oper->op;
+					xset->u.operan = oper->field->toPos - 1;
+				}
+				xset++;
+				oper = oper->next;
+			}
+		}
+	}
+	return(xsets);
+}
 
 
 /* utility function to count number of toPos fields in a list */
@@ -5473,43 +8502,45 @@ int countToPos(FieldP* fieldP, int recipe) {
 }
 
 
-/* this functions should be call once before all recipes files and then once before
-   the input file. it sets variables which are mostly the same for recipes files and
-   the input file, and which do not change between recipes files. */
-void setFoodCalcPos(int recipe) {
+/* this functions should be call once for the plan of the recipes files and once for
+   the plan of the input file. it sets the parts of the plan which are mostly the same
+   for recipes files and the input file, and which do not change between recipes
+   files. */
+void setFoodCalcPos(FoodCalcPlan* plan, int recipe) {
 
-	XnoOutput = outputFields.no;
-	XnoRealOutput = (recipe?XnoOutput:noRealOutputFields);
-	Xobs = alloc(XnoOutput*sizeof(Num));
+	plan->noOutput = outputFields.no;
+	plan->noRealOutput = (recipe?plan->noOutput:noRealOutputFields);
+	plan->lazyTest = 0; /* may be set by setInputPos() */
 
 	{ /* food fields */
 		{	/* count fields */
 			FieldP* fieldP = foodTableFields.first;
-			XnoFoodNutri = XnoFoodMove = 0;
+			plan->noFoodNutri = plan->noFoodMove = 0;
 			while (fieldP) {
 				Field* field = fieldP->field;
 				if (field->toPos && field->onlyRecipe <= recipe) {
-					if (!field->noCalc) XnoFoodNutri++;
-					else XnoFoodMove++;
+					if (!field->noCalc) plan->noFoodNutri++;
+					else plan->noFoodMove++;
 				}
 				fieldP = fieldP->next;
 			}
+			plan->noTestNutri = plan->noFoodNutri;
 		}
 		{	/* set positions */
 			FieldP* fieldP = foodTableFields.first;
-			int* movePos = XfoodMovePos = alloc(XnoFoodMove*sizeof(int));
-			Num** moveOutput = XoutputFood = alloc(XnoFoodMove*sizeof(Num*));
-			int* nutriPos = XfoodNutriPos = alloc(XnoFoodNutri*sizeof(int));
-			Num** nutriOutput = XoutputNutri = alloc(XnoFoodNutri*sizeof(Num*));
+			int* movePos = plan->foodMovePos = alloc(plan->noFoodMove*sizeof(int));
+			int* moveOutput = plan->outputFood = alloc(plan->noFoodMove*sizeof(int));
+			int* nutriPos = plan->foodNutriPos = alloc(plan->noFoodNutri*sizeof(int));
+			int* nutriOutput = plan->outputNutri = alloc(plan->noFoodNutri*sizeof(int));
 			while (fieldP) {
 				Field* field = fieldP->field;
 				if (field->toPos && field->onlyRecipe <= recipe) {
 					if (!field->noCalc) {
 						*nutriPos++ = field->fromPos - 1;
-						*nutriOutput++ = Xobs + field->toPos - 1;
+						*nutriOutput++ = field->toPos - 1;
 					} else {
 						*movePos++ = field->fromPos - 1;
-						*moveOutput++ = Xobs + field->toPos - 1;
+						*moveOutput++ = field->toPos - 1;
 					}
 				}
 				fieldP = fieldP->next;
@@ -5519,8 +8550,8 @@ void setFoodCalcPos(int recipe) {
 
 	{	/* cook types */
 		CookType* cookType = cookTypes.first;
-		XCookType* xcookType = XcookType = alloc(cookTypes.no*sizeof(XCookType));
-		XnoCookTypes = cookTypes.no;
+		XCookType* xcookType = plan->cookType = alloc(cookTypes.no*sizeof(XCookType));
+		plan->noCookTypes = cookTypes.no;
 		while (cookType) {
 			{ /* count used */
 				Cook* cook = cookType->cooks->first;
@@ -5537,13 +8568,13 @@ void setFoodCalcPos(int recipe) {
 				while (cook) {
 					if (cook->used) {
 						FieldP* fieldP = cook->fields.first;
-						Num** output = xcook->output = alloc(cook->used*sizeof(Num*));
+						int* output = xcook->output = alloc(cook->used*sizeof(int));
 						xcook->foodPos = cook->field->fromPos - 1;
-						xcook->noOutput = cook->used;
+						xcook->noOutput = xcook->noTestOutput = cook->used;
 						while (fieldP) {
 							Field* field = fieldP->field;
 							if (field->toPos && field->onlyRecipe <= recipe) 
-								*output++ = Xobs + fieldP->field->toPos - 1;
+								*output++ = fieldP->field->toPos - 1;
 							fieldP = fieldP->next;
 						}
 						xcook++;
@@ -5558,35 +8589,36 @@ void setFoodCalcPos(int recipe) {
 
 	{	/* calculates */
 		{ /* count used */
-			XnoSet = XnoSet2 = XnoGroupSet = 0;
+			plan->noSet = plan->noSet2 = plan->noGroupSet = 0;
 			{ /* operations in set: commands */
 				Set* set = sets.first;
 				while (set) {
 					Field* field = set->field;
-					if (field->toPos && field->onlyRecipe <= recipe) XnoSet += set->opers.no;
+					if (field->toPos && field->onlyRecipe <= recipe) plan->noSet += set->opers.no;
 					set = set->next;
 				}
 			}
 			if (recipe) { /* operations in recipe set: commands */
 				Set* set = recipeSets.first;
-				XnoSet2 = XnoSet;
+				plan->noSet2 = plan->noSet;
 				while (set) {
 					Field* field = set->field;
-					if (field->toPos) XnoSet += set->opers.no;
+					if (field->toPos) plan->noSet += set->opers.no;
 					set = set->next;
 				}
 			} else { /* operations in group set: commands */
 				Set* set = groupSets.first;
-				int* no = (groupByCmd? &XnoGroupSet : &XnoSet);
+				int* no = (groupByCmd? &plan->noGroupSet : &plan->noSet);
 				while (set) {
 					Field* field = set->field;
 					if (field->toPos) *no += set->opers.no;
 					set = set->next;
 				}
 			}
+			plan->noTestSet = plan->noSet;
 		}
 		{ /* set positions */
-			XSet* xset = Xset = alloc(XnoSet*sizeof(XSet));
+			XSet* xset = plan->set = alloc(plan->noSet*sizeof(XSet));
 			{ /* operations in set: commands */
 				Set* set = sets.first;
 				while (set) {
@@ -5594,13 +8626,13 @@ void setFoodCalcPos(int recipe) {
 					if (setField->toPos && setField->onlyRecipe <= recipe) {
 						SetOper* oper = set->opers.first;
 						while (oper) {
-							xset->output = Xobs + setField->toPos - 1;
+							xset->output = setField->toPos - 1;
 							if (oper->field->noCalc == 9/*constant*/) {
 								xset->op = oper->op+5;
 								xset->u.num = *(Num*)oper->field->next;
 							} else {
 								xset->op = oper->op;
-								xset->u.operan = Xobs + oper->field->toPos - 1;
+								xset->u.operan = oper->field->toPos - 1;
 							}
 							xset++;
 							oper = oper->next;
@@ -5616,13 +8648,13 @@ void setFoodCalcPos(int recipe) {
 					if (setField->toPos) {
 						SetOper* oper = set->opers.first;
 						while (oper) {
-							xset->output = Xobs + setField->toPos - 1;
+							xset->output = setField->toPos - 1;
 							if (oper->field->noCalc == 9/*constant*/) {
 								xset->op = oper->op+5;
 								xset->u.num = *(Num*)oper->field->next;
 							} else {
 								xset->op = oper->op;
-								xset->u.operan = Xobs + oper->field->toPos - 1;
+								xset->u.operan = oper->field->toPos - 1;
 							}
 							xset++;
 							oper = oper->next;
@@ -5638,29 +8670,7 @@ void setFoodCalcPos(int recipe) {
 						if (setField->toPos) {
 							SetOper* oper = set->opers.first;
 							while (oper) {
-								xset->output = Xobs + setField->toPos - 1;
-								if (oper->field->noCalc == 9/*constant*/) {
-									xset->op = oper->op+5;
-									xset->u.num = *(Num*)oper->field->next;
-								} else {
-									xset->op = oper->op;
-									xset->u.operan = Xobs + oper->field->toPos - 1;
-								}
-								xset++;
-								oper = oper->next;
-							}
-						}
-						set = set->next;
-					}
-				} else { /*(groupByCmd)*/
-					Set* set = groupSets.first;
-					XGroupSet* xset = XgroupSet = alloc(XnoGroupSet*sizeof(XGroupSet));
-					while (set) {
-						Field* setField = set->field;
-						if (setField->toPos) {
-							SetOper* oper = set->opers.first;
-							while (oper) {
-								xset->pos = setField->toPos - 1;
+								xset->output = setField->toPos - 1;
 								if (oper->field->noCalc == 9/*constant*/) {
 									xset->op = oper->op+5;
 									xset->u.num = *(Num*)oper->field->next;
@@ -5674,6 +8684,8 @@ void setFoodCalcPos(int recipe) {
 						}
 						set = set->next;
 					}
+				} else { /*(groupByCmd)*/
+					plan->groupSet = setGroupSetPos(&plan->noGroupSet);
 				}
 			}
 		}
@@ -5684,11 +8696,11 @@ void setFoodCalcPos(int recipe) {
 /* call this function before each recipe file and before the input file. it sets
    variables which depents on the file, but are set the same way for recipes fiels
    and the input file */
-void setFilePos(HashStr* fieldsHash, FieldChain* fields, char* fileName, int recipe) { 
+void setFilePos(FoodCalcPlan* plan, HashStr* fieldsHash, FieldChain* fields, char* fileName,
+				int recipe) { 
 
-	XnoInput = fields->no;
-	Xline = alloc(XnoInput*sizeof(Num));
-	Xtext = alloc(XnoInput*sizeof(int));
+	plan->noInput = fields->no;
+	plan->text = alloc(plan->noInput*sizeof(int));
 
 	{ /* non-edible field */
 		if (nonEdibleField) {
@@ -5696,41 +8708,41 @@ void setFilePos(HashStr* fieldsHash, FieldChain* fields, char* fileName, int rec
 			if (nonEdibleFlagName && !(field = lookStr(fieldsHash,nonEdibleFlagName))) {
 				warning("Non-edible field '%s' not found in file %s.\n",
 					nonEdibleFlagName,fileName);
-				XnoNonEdible = 0;
+				plan->noNonEdible = 0;
 			} else {
-				XnoNonEdible = 1;
-				XnonEdible = nonEdibleField->fromPos - 1;
+				plan->noNonEdible = 1;
+				plan->nonEdible = nonEdibleField->fromPos - 1;
 				if (nonEdibleFlagName) {
-					XnoNonEdibleFlag = 1;
-					XnonEdibleFlag = Xline + field->fromPos - 1;
+					plan->noNonEdibleFlag = 1;
+					plan->nonEdibleFlag = field->fromPos - 1;
 				} else {
-					XnoNonEdibleFlag = 0;
+					plan->noNonEdibleFlag = 0;
 				}
 			}
 		} else {
-			XnoNonEdible = 0;
+			plan->noNonEdible = 0;
 		}
 	}
 
 	{ /* input positions */
 		{ /* count fields and set the text array */
 			Field* field = fields->first;
-			int* text = Xtext;
-			XnoInputMove = 0;
+			int* text = plan->text;
+			plan->noInputMove = 0;
 			while (field) {
-				if (field->toPos) XnoInputMove++;
-				*text++ = field->text;
+				if (field->toPos) plan->noInputMove++;
+				*text++ = (field->text ? 1 : field->code ? 2 : 0);
 				field = field->next;
 			}
 		}
 		{ /* set positions */
 			Field* field = fields->first;
-			Num** input = XinputMove = alloc(XnoInputMove*sizeof(Num*));
-			Num** output = XoutputInput = alloc(XnoInputMove*sizeof(Num*));
+			int* input = plan->inputMove = alloc(plan->noInputMove*sizeof(int));
+			int* output = plan->outputInput = alloc(plan->noInputMove*sizeof(int));
 			while (field) {
 				if (field->toPos) {
-					*input++ = Xline + field->fromPos - 1;
-					*output++ = Xobs + field->toPos - 1;
+					*input++ = field->fromPos - 1;
+					*output++ = field->toPos - 1;
 				}
 				field = field->next;
 			}
@@ -5742,16 +8754,16 @@ void setFilePos(HashStr* fieldsHash, FieldChain* fields, char* fileName, int rec
 			Field* field;
 			if (!(field = lookStr(fieldsHash,cookFieldName))) {
 				warning("Cook field '%s' not found in file %s.\n",cookFieldName,fileName);
-				XnoInputCook = 0;
+				plan->noInputCook = 0;
 			} else if (field->text) {
 				error("Cook field '%s' must not be a text field in file %s.\n",cookFieldName,fileName);
-				XnoInputCook = 0;
+				plan->noInputCook = 0;
 			} else {
-				XnoInputCook = 1;
-				XinputCook = Xline + field->fromPos - 1;
+				plan->noInputCook = 1;
+				plan->inputCook = field->fromPos - 1;
 			}
 		} else {
-			XnoInputCook = 0;
+			plan->noInputCook = 0;
 		}
 	}
 
@@ -5759,9 +8771,9 @@ void setFilePos(HashStr* fieldsHash, FieldChain* fields, char* fileName, int rec
 		Reduct* reduct = reducts.first;
 		XReduct* xreduct;
 		XWeightReduct* xweightReduct;
-		XnoReduct = 0;
-		XnoWeightReduct = 0;
-		XnoCalcWeightReduct = 0;
+		plan->noReduct = 0;
+		plan->noWeightReduct = 0;
+		plan->noCalcWeightReduct = 0;
 		while (reduct) { /* first we only count the used reducts */
 			if (reduct->used = countToPos(reduct->fields.first,recipe)) {
 				if (!(reduct->field = lookStr(fieldsHash,reduct->fieldName))) {
@@ -5771,36 +8783,36 @@ void setFilePos(HashStr* fieldsHash, FieldChain* fields, char* fileName, int rec
 					error("Reduce field '%s' must not be a text field in file %s.\n",reduct->fieldName,fileName);
 					reduct->used = 0;
 				} else {
-					XnoReduct++;
+					plan->noReduct++;
 					if (reduct->type == weightReduc) {
-						XnoWeightReduct++;
-						if (reduct->calcField) XnoCalcWeightReduct++;
+						plan->noWeightReduct++;
+						if (reduct->calcField) plan->noCalcWeightReduct++;
 					}
 				}
 			}
 			reduct = reduct->next;
 		}
-		xreduct = Xreduct = alloc(XnoReduct*sizeof(XReduct));
-		xweightReduct = XweightReduct = alloc(XnoWeightReduct*sizeof(XWeightReduct));
+		xreduct = plan->reduct = alloc(plan->noReduct*sizeof(XReduct));
+		xweightReduct = plan->weightReduct = alloc(plan->noWeightReduct*sizeof(XWeightReduct));
 		reduct = reducts.first;
 		while (reduct) { /* then we set the positions */
 			if (reduct->used) {
 				FieldP* fieldP = reduct->fields.first;
-				Num** output = xreduct->output = alloc(reduct->used*sizeof(Num*));
-				xreduct->input = Xline + reduct->field->fromPos - 1;
-				xreduct->noOutput = reduct->used;
+				int* output = xreduct->output = alloc(reduct->used*sizeof(int));
+				xreduct->input = reduct->field->fromPos - 1;
+				xreduct->noOutput = xreduct->noTestOutput = reduct->used;
 				while (fieldP) {
 					Field* field = fieldP->field;
 					if (field->toPos && field->onlyRecipe <= recipe)
-						*output++ =  Xobs + fieldP->field->toPos - 1;
+						*output++ =  fieldP->field->toPos - 1;
 					fieldP = fieldP->next;
 				}
 				if (reduct->type == weightReduc) {
 					Field* field;
 					if (reduct->calcField) field = reduct->calcField;
 					else field = reduct->fields.first->field;
-					xweightReduct->input = Xline + reduct->field->fromPos - 1;
-					xweightReduct->output = Xobs + field->toPos - 1;
+					xweightReduct->input = reduct->field->fromPos - 1;
+					xweightReduct->output = field->toPos - 1;
 					xweightReduct++;
 				}
 				xreduct++;
@@ -5811,134 +8823,415 @@ void setFilePos(HashStr* fieldsHash, FieldChain* fields, char* fileName, int rec
 }
 
 
+/* call this function when all positions in the line are set. it also marks the fields
+   which are not used in plan->text, so readNumLine() does not convert them to numbers */
+void setFileSkip(FoodCalcPlan* plan) {
+	char* used = allocarray(plan->noInput,sizeof(char));
+	int i;
+	for (i = 0; i < plan->noInputMove; i++) used[plan->inputMove[i]] = 1;
+	for (i = 0; i < plan->noInputGroupBy; i++) used[plan->inputGroupBy[i]] = 1;
+	used[plan->inputFood] = used[plan->inputAmount] = 1;
+	if (plan->noNonEdible && plan->noNonEdibleFlag) used[plan->nonEdibleFlag] = 1;
+	if (plan->noInputCook) used[plan->inputCook] = 1;
+	for (i = 0; i < plan->noReduct; i++) used[plan->reduct[i].input] = 1;
+	for (i = 0; i < plan->noWeightReduct; i++) used[plan->weightReduct[i].input] = 1;
+	for (i = 0; i < plan->noInputTest; i++) {
+		used[plan->inputTest[i].pos1] = 1;
+		if (plan->inputTest[i].pos2 >= 0) used[plan->inputTest[i].pos2] = 1;
+	}
+	for (i = 0; i < plan->noBlock; i++) {
+		int j;
+		for (j = 0; j < plan->block[i].noInputGroupBy; j++)
+			used[plan->block[i].inputGroupBy[j]] = 1;
+	}
+	for (i = 0; i < plan->noInput; i++) if (!used[i]) plan->text[i] = 1;
+	free(used);
+}
+
+
 /* call this function before each recipes files. it sets variables specially for
    recipes files */
-void setRecipesPos(RecipesFile* recipesFile) {
+void setRecipesPos(FoodCalcPlan* plan, RecipesFile* recipesFile) {
 
-	setFilePos(recipesFile->fieldsHash,recipesFile->fields,recipesFile->file->name,1);
-	XnoBlip = 0;
-	Xstar = recipesFile->starFields;
+	setFilePos(plan,recipesFile->fieldsHash,recipesFile->fields,recipesFile->file->name,1);
+	plan->noBlip = 0;
+	plan->lookAhead = 0; /* prefetch: can not be used with the flush hack */
+	plan->star = recipesFile->starFields;
 
 	{ /* input positions */
-		XinputFood = Xline + recipesFile->foodId->fromPos - 1;
-		XinputAmount = Xline + recipesFile->amountField->fromPos - 1;
-		XinputAmountScale = (Num)(1.0/recipeSum);
+		plan->inputFood = recipesFile->foodId->fromPos - 1;
+		plan->inputAmount = recipesFile->amountField->fromPos - 1;
+		plan->inputAmountScale = (Num)(1.0/recipeSum);
 	}
 
 	{ /* no group by or if or transpose */
-		XnoInputGroupBy = 0;
-		XnoFoodGroupBy = 0;
-		XnoSimpleTest = 0;
-		XnoTest = 0;
-		XnoTranspose = 0;
+		plan->noInputGroupBy = 0;
+		plan->noFoodGroupBy = 0;
+		plan->noSimpleTest = 0;
+		plan->noTest = 0;
+		plan->noInputTest = 0;
+		plan->noTranspose = 0;
 	}
+
+	setFileSkip(plan);
 }
 
 
-/* call this function before the input file is read. it sets variables specially
-   for the input file */
-void setInputPos() {
+/* utility function to stable sort the n fields in output (and pos, if not NULL) so
+   the fields needed by the tests comes first. returns the no of needed fields */
+int setLazyTestSort(int* output, int* pos, int n, char* need) {
+	int* output2 = alloc((n+1)*sizeof(int));
+	int* pos2 = alloc((n+1)*sizeof(int));
+	int no = 0, no2 = 0, i;
+	for (i = 0; i < n; i++) {
+		if (need[output[i]]) {
+			output[no] = output[i];
+			if (pos) pos[no] = pos[i];
+			no++;
+		} else {
+			output2[no2] = output[i];
+			if (pos) pos2[no2] = pos[i];
+			no2++;
+		}
+	}
+	for (i = 0; i < no2; i++) {
+		output[no+i] = output2[i];
+		if (pos) pos[no+i] = pos2[i];
+	}
+	free(output2);
+	free(pos2);
+	return(no);
+}
 
-	setFilePos(inputFieldsHash,&inputFields,inputFileName,0);
-	if (blipCmd) XnoBlip = atoi(*(blipCmd->args)); else XnoBlip = 0;
-	Xstar = inputStarFields;
+/* called by setInputPos() if there is where: tests on calculated fields. we only
+   want to calculate the fields needed by the tests before the tests, and the rest
+   only if the tests says the obs should be used. so we find the fields needed by
+   the tests (and by the calculations of these fields), and move these fields to the
+   front of plan->foodNutriPos, the cook and reduct outputs, and plan->set. */
+void setLazyTestPos(FoodCalcPlan* plan) {
+	char* need = allocarray(plan->noOutput,sizeof(char));
+	int noNeed = 0, no = 0;
 
-	{ /* input positions */
-		XinputFood = Xline + inputFoodField->fromPos - 1;
-		XinputAmount = Xline + inputAmountField->fromPos - 1;
-		XinputAmountScale = inputAmountScale;
-	}
-
-	{ /* group by positions */
-		Num** input = XinputGroupBy = alloc(groupByFields.no*sizeof(Num*));
-		int* group = XgroupInputPos = alloc(groupByFields.no*sizeof(int));
-		Num** output = XoutputGroupBy = alloc(groupByFoodFields.no*sizeof(Num*));
-		int* fgroup = XgroupFoodPos = alloc(groupByFoodFields.no*sizeof(int));
-		FieldP* fieldP = groupByFields.first;
-		XnoInputGroupBy = groupByFields.no;
-		XnoFoodGroupBy = groupByFoodFields.no;
-		while (fieldP) {
-			Field* field = fieldP->field;
-			*input++ = Xline + field->fromPos - 1;
-			*group++ = field->toPos - 1;
-			fieldP = fieldP->next;
+	{ /* fields used in tests */
+		int n = plan->noTest;
+		XTest* test = plan->test;
+		while (n--) {
+			need[test->output1] = need[test->output2] = 1;
+			test++;
 		}
-		fieldP = groupByFoodFields.first;
-		while (fieldP) {
-			Field* field = fieldP->field;
-			*output++ = Xobs + field->toPos - 1;
-			*fgroup++ = field->toPos - 1;
-			fieldP = fieldP->next;
+	}
+	{ /* fields used by calculations of needed fields. a calculation only uses
+		 fields calculated before it, so we can do this backwards in one go */
+		int n = plan->noSet;
+		XSet* set = plan->set+plan->noSet;
+		while (n--) {
+			set--;
+			if (need[set->output] && set->op < cpyOpC)
+				need[set->u.operan] = 1;
 		}
 	}
 
-	if (simpleTest) {
-		XSimpleTest* xtest = XsimpleTest = alloc(tests.no*sizeof(XSimpleTest));
-		Test* test = tests.first;
-		XnoSimpleTest = tests.no;
-		while (test) {
-			xtest->op = test->op;
-			xtest->pos = test->field1->fromPos - 1;
-			xtest->num = *(Num*)(test->field2->next);
-			xtest->action = XsimpleTest + test->action;
-			test = test->next;
-			xtest++;
+	plan->noTestNutri =
+		setLazyTestSort(plan->outputNutri,plan->foodNutriPos,plan->noFoodNutri,need);
+	noNeed += plan->noTestNutri; no += plan->noFoodNutri;
+	{ /* cook outputs */
+		int n = plan->noCookTypes;
+		XCookType* cookType = plan->cookType;
+		while (n--) {
+			int n = cookType->no;
+			XCook* cook = cookType->cook;
+			while (n--) {
+				cook->noTestOutput = setLazyTestSort(cook->output,NULL,cook->noOutput,need);
+				noNeed += cook->noTestOutput; no += cook->noOutput;
+				cook++;
+			}
+			cookType++;
 		}
-	} else {
-		XTest* xtest = Xtest = alloc(tests.no*sizeof(XTest));
-		Test* test = tests.first;
-		XnoTest = tests.no;
-		while (test) {
-			xtest->op = test->op;
-			xtest->output1 = Xobs + test->field1->toPos - 1;
-			xtest->output2 = Xobs + test->field2->toPos - 1;
-			xtest->action = Xtest + test->action;
-			test = test->next;
-			xtest++;
+	}
+	{ /* reduct outputs */
+		int n = plan->noReduct;
+		XReduct* reduct = plan->reduct;
+		while (n--) {
+			reduct->noTestOutput = setLazyTestSort(reduct->output,NULL,reduct->noOutput,need);
+			noNeed += reduct->noTestOutput; no += reduct->noOutput;
+			reduct++;
 		}
 	}
-
-	{ /* transpose positions */
-		XTranspose* xtranspose = Xtranspose = alloc(transposes.no*sizeof(XTranspose));
-		Transpose* transpose = transposes.first;
-		XnoTranspose = transposes.no;
-		while (transpose) {
-			Num** poutput = xtranspose->output = alloc(transpose->fields.no*sizeof(Num*));
-			FieldP* fieldP = transpose->fields.first;
-			xtranspose->noOutput = transpose->fields.no;
-			xtranspose->pos = transpose->groupField->fromPos - 1;
-			xtranspose->noGroups = transpose->noGroups;
-			xtranspose->groupPos = transpose->transFields.first->field->toPos - 1;
-			while (fieldP) {
-				*poutput++ = Xobs + fieldP->field->toPos - 1;
-				fieldP = fieldP->next;
-			}
-			xtranspose++;
-			transpose = transpose->next;
+	{ /* calculations */
+		XSet* set2 = alloc((plan->noSet+1)*sizeof(XSet));
+		int n = plan->noSet, no2 = 0, i;
+		XSet* set = plan->set;
+		plan->noTestSet = 0;
+		while (n--) {
+			if (need[set->output]) plan->set[plan->noTestSet++] = *set;
+			else set2[no2++] = *set;
+			set++;
 		}
+		for (i = 0; i < no2; i++) plan->set[plan->noTestSet+i] = set2[i];
+		free(set2);
+		noNeed += plan->noTestSet; no += plan->noSet;
 	}
-}
-
+	free(need);
 
+	plan->lazyTest = (noNeed < no);
+	if (plan->lazyTest && verbosity >= 80)
+		logmsg("Where: tests only need %d of %d calculations before the tests.\n",noNeed,no);
+}
 
-/***********************************************************************************/
-/*** STEP 5.5 */
 
-/* Calculate cook fractions for all weight cook commands. after this change, all weight
-   cook: commands are just like cook: commands */
+/* utility function to set the group by positions of a plan from the input fields and
+   food table fields to group by */
+void setGroupByPos(FoodCalcPlan* plan, FieldPChain* inputFields, FieldPChain* foodFields) {
+	int* input = plan->inputGroupBy = alloc(inputFields->no*sizeof(int));
+	int* group = plan->groupInputPos = alloc(inputFields->no*sizeof(int));
+	int* output = plan->outputGroupBy = alloc(foodFields->no*sizeof(int));
+	int* fgroup = plan->groupFoodPos = alloc(foodFields->no*sizeof(int));
+	FieldP* fieldP = inputFields->first;
+	plan->noInputGroupBy = inputFields->no;
+	plan->noFoodGroupBy = foodFields->no;
+	while (fieldP) {
+		Field* field = fieldP->field;
+		*input++ = field->fromPos - 1;
+		*group++ = field->toPos - 1;
+		fieldP = fieldP->next;
+	}
+	fieldP = foodFields->first;
+	while (fieldP) {
+		Field* field = fieldP->field;
+		*output++ = field->toPos - 1;
+		*fgroup++ = field->toPos - 1;
+		fieldP = fieldP->next;
+	}
+}
+
+
+/* utility function to make the array of XTest of a list of tests */
+XTest* setTestPos(TestChain* tests) {
+	XTest* xtests = alloc(tests->no*sizeof(XTest));
+	XTest* xtest = xtests;
+	Test* test = tests->first;
+	while (test) {
+		xtest->op = test->op;
+		xtest->output1 = test->field1->toPos - 1;
+		xtest->output2 = test->field2->toPos - 1;
+		xtest->action = xtests + test->action;
+		test = test->next;
+		xtest++;
+	}
+	return(xtests);
+}
+
+
+/* utility function to put the constants in a list of tests in front of the
+   calculations of a plan, so they are set in the obs before the tests */
+void setTestConstants(FoodCalcPlan* plan, TestChain* tests) {
+	int noConstant = 0;
+	Test* test = tests->first;
+	while (test) {
+		if (test->field1->noCalc == 9/*constant*/) noConstant++;
+		if (test->field2->noCalc == 9/*constant*/) noConstant++;
+		test = test->next;
+	}
+	if (noConstant) {
+		XSet* xset = alloc((plan->noSet+noConstant)*sizeof(XSet));
+		XSet* xset1 = xset;
+		int n = plan->noSet;
+		XSet* set = plan->set;
+		test = tests->first;
+		while (test) {
+			if (test->field1->noCalc == 9/*constant*/) {
+				xset1->output = test->field1->toPos - 1;
+				xset1->op = cpyOpC;
+				xset1->u.num = *(Num*)test->field1->next;
+				xset1++;
+			}
+			if (test->field2->noCalc == 9/*constant*/) {
+				xset1->output = test->field2->toPos - 1;
+				xset1->op = cpyOpC;
+				xset1->u.num = *(Num*)test->field2->next;
+				xset1++;
+			}
+			test = test->next;
+		}
+		while (n--) *xset1++ = *set++;
+		plan->set = xset;
+		plan->noSet += noConstant;
+		plan->noTestSet = plan->noSet;
+	}
+}
+
+
+/* call this function before the input file is read. it sets variables specially
+   for the input file */
+void setInputPos(FoodCalcPlan* plan) {
+
+	setFilePos(plan,inputFieldsHash,&inputFields,inputFileName,0);
+	if (blipCmd) plan->noBlip = atoi(*(blipCmd->args)); else plan->noBlip = 0;
+	if (prefetchCmd) plan->lookAhead = atoi(*(prefetchCmd->args)); else plan->lookAhead = 0;
+	plan->pipeline = 0;
+	if (pipelineCmd) {
+#ifdef HAVE_PIPELINE
+		if (library)
+			warning("The pipeline: command is not used by the library.\n");
+		else if ((plan->pipeline = atoi(*(pipelineCmd->args))) < 2)
+			plan->pipeline = 2;
+#else
+		warning("The pipeline: command can not be used on this system.\n");
+#endif
+	}
+	plan->star = inputStarFields;
+
+	{ /* input positions */
+		plan->inputFood = inputFoodField->fromPos - 1;
+		plan->inputAmount = inputAmountField->fromPos - 1;
+		plan->inputAmountScale = inputAmountScale;
+	}
+
+	setGroupByPos(plan,&groupByFields,&groupByFoodFields);
+
+	if (simpleTest) {
+		XSimpleTest* xtest = plan->simpleTest = alloc(tests.no*sizeof(XSimpleTest));
+		Test* test = tests.first;
+		plan->noSimpleTest = tests.no;
+		while (test) {
+			xtest->op = test->op;
+			xtest->pos = test->field1->fromPos - 1;
+			xtest->num = *(Num*)(test->field2->next);
+			xtest->action = plan->simpleTest + test->action;
+			test = test->next;
+			xtest++;
+		}
+	} else {
+		plan->noTest = tests.no;
+		plan->test = setTestPos(&tests);
+		setTestConstants(plan,&tests);
+		if (!plan->noWeightReduct && !outputBlocks.no) setLazyTestPos(plan);
+	}
+
+	{ /* input where: tests */
+		XInputTest* xtest = plan->inputTest = alloc(inputTests.no*sizeof(XInputTest));
+		Test* test = inputTests.first;
+		plan->noInputTest = inputTests.no;
+		while (test) {
+			xtest->op = test->op;
+			xtest->pos1 = test->field1->fromPos - 1;
+			if (test->field2->noCalc == 9/*constant*/) {
+				xtest->pos2 = -1;
+				xtest->num = *(Num*)(test->field2->next);
+			} else {
+				xtest->pos2 = test->field2->fromPos - 1;
+				xtest->num = (Num)0;
+			}
+			xtest->action = plan->inputTest + test->action;
+			test = test->next;
+			xtest++;
+		}
+	}
+
+	{ /* transpose positions */
+		XTranspose* xtranspose = plan->transpose = alloc(transposes.no*sizeof(XTranspose));
+		Transpose* transpose = transposes.first;
+		plan->noTranspose = transposes.no;
+		while (transpose) {
+			int* poutput = xtranspose->output = alloc(transpose->fields.no*sizeof(int));
+			FieldP* fieldP = transpose->fields.first;
+			xtranspose->noOutput = transpose->fields.no;
+			xtranspose->pos = transpose->groupField->fromPos - 1;
+			xtranspose->noGroups = transpose->noGroups;
+			xtranspose->groupPos = transpose->transFields.first->field->toPos - 1;
+			while (fieldP) {
+				*poutput++ = fieldP->field->toPos - 1;
+				fieldP = fieldP->next;
+			}
+			xtranspose++;
+			transpose = transpose->next;
+		}
+	}
+
+	if (outputBlocks.no) { /* output blocks */
+		OutputBlock* block = outputBlocks.first;
+		FoodCalcPlan* bplan;
+		while (block) {
+			setTestConstants(plan,&block->tests);
+			block = block->next;
+		}
+		plan->noBlock = outputBlocks.no;
+		bplan = plan->block = alloc(outputBlocks.no*sizeof(FoodCalcPlan));
+		for (block = outputBlocks.first; block; block = block->next, bplan++) {
+			int* poutput;
+			FieldP* fieldP = block->outputFields.first;
+			*bplan = *plan;
+			bplan->noBlock = 0;
+			bplan->block = NULL;
+			bplan->noInputTest = 0;	/* the lines are only tested by the main plan */
+			bplan->noTranspose = 0;
+			bplan->noRealOutput = block->outputFields.no;
+			poutput = bplan->realOutput = alloc(block->outputFields.no*sizeof(int));
+			while (fieldP) {
+				*poutput++ = fieldP->field->toPos - 1;
+				fieldP = fieldP->next;
+			}
+			setGroupByPos(bplan,&block->groupByFields,&block->groupByFoodFields);
+			if (!groupByCmd && (bplan->noInputGroupBy || bplan->noFoodGroupBy))
+				/* the group set: calculations are done for each line in the main
+				   plan, and must be done again for the groups of the block */
+				bplan->groupSet = setGroupSetPos(&bplan->noGroupSet);
+			bplan->noTest = block->tests.no;
+			bplan->test = setTestPos(&block->tests);
+		}
+	}
+
+	if (rollups.no) { /* rollup levels */
+		Rollup* rollup = rollups.first;
+		FoodCalcPlan* rplan = plan->rollup = alloc(rollups.no*sizeof(FoodCalcPlan));
+		plan->noRollup = rollups.no;
+		for (; rollup; rollup = rollup->next, rplan++) {
+			int* poutput;
+			FieldP* fieldP = rollup->outputFields.first;
+			*rplan = *plan;
+			rplan->noBlock = 0;
+			rplan->block = NULL;
+			rplan->noRollup = 0;
+			rplan->rollup = NULL;
+			rplan->isRollup = 1;
+			rplan->noRealOutput = rollup->outputFields.no;
+			poutput = rplan->realOutput = alloc(rollup->outputFields.no*sizeof(int));
+			while (fieldP) {
+				*poutput++ = fieldP->field->toPos - 1;
+				fieldP = fieldP->next;
+			}
+			setGroupByPos(rplan,&rollup->groupByFields,&rollup->groupByFoodFields);
+			/* the group by fields are taken from the groupObs added up, not the line */
+			rplan->inputGroupBy = rplan->groupInputPos;
+		}
+	}
+
+	setFileSkip(plan);
+}
+
+
+
+/***********************************************************************************/
+/*** STEP 5.5 */
+
+/* Calculate cook fractions for all weight cook commands. after this change, all weight
+   cook: commands are just like cook: commands */
 void weightCookChange() {
 	if (weightCookCmd) {
 
 		int XnoWeight = 0; /* number of used weight cook: commands */
 		typedef struct {
 			int foodPos;	/* position of reduct field in food table */
-			Num* output;	/* pointer to fraction field in Xobs */
+			int output;		/* position of fraction field in obs */
 		} XWeight;
 		XWeight* Xweight;
+		FoodCalcPlan* plan = allocarray(1,sizeof(FoodCalcPlan));
+		Num* Xobs;
 
 
-		/* we use the foodCalc variables (the compiled semantic tree) */
-		setFoodCalcPos(1);
+		/* we use a foodCalc plan (the compiled semantic tree) */
+		setFoodCalcPos(plan,1);
+		Xobs = alloc(plan->noOutput*sizeof(Num));
 
 		{ /* count weight */
 			CookType* cookType = cookTypes.first;
@@ -5962,7 +9255,7 @@ void weightCookChange() {
 						if (cook->calcField) field = cook->calcField;
 						else field = cook->fields.first->field;
 						weight->foodPos = cook->field->fromPos - 1;
-						weight->output = Xobs + field->toPos - 1;
+						weight->output = field->toPos - 1;
 					}
 					cook = cook->next;
 					weight++;
@@ -5983,43 +9276,24 @@ void weightCookChange() {
 					Num* obs = foodEntry->u.obs;
 
 					{ /* move all nutri fields from obs to Xobs */
-						int n = XnoFoodNutri;
-						int* pfoodPos = XfoodNutriPos;
-						Num** poutput = XoutputNutri;
-						while (n--) **poutput++ = obs[*pfoodPos++];
+						int n = plan->noFoodNutri;
+						int* pfoodPos = plan->foodNutriPos;
+						int* poutput = plan->outputNutri;
+						while (n--) Xobs[*poutput++] = obs[*pfoodPos++];
 					}
 
-					{ /* calculate new fields */
-						int n = XnoSet;
-						XSet* set = Xset;
-						while (n--) {
-							switch (set->op) {
-							case cpyOp: *(set->output) = *(set->u.operan); break;
-							case addOp: *(set->output) += *(set->u.operan); break;
-							case subOp: *(set->output) -= *(set->u.operan); break;
-							case mulOp: *(set->output) *= *(set->u.operan); break;
-							case divOp: if (*(set->u.operan)) *(set->output) /= *(set->u.operan); 
-										else *(set->output) = (Num)0;
-										break;
-							case cpyOpC: *(set->output) = set->u.num; break;
-							case addOpC: *(set->output) += set->u.num; break;
-							case subOpC: *(set->output) -= set->u.num; break;
-							case mulOpC: *(set->output) *= set->u.num; break;
-							case divOpC: *(set->output) /= set->u.num; break;
-							}
-							set++;
-						}
-					}
+					/* calculate new fields */
+					foodCalcSet(Xobs,plan->set,plan->noSet);
 
 					{ /* change fractions */
 						int n = XnoWeight;
 						XWeight* weight = Xweight;
 						while (n--) {
-							if (*(weight->output) == (Num)0.0) 
+							if (Xobs[weight->output] == (Num)0.0)
 								obs[weight->foodPos] = (Num)0.0;
 							else
 								obs[weight->foodPos] = 
-									recipeSum * obs[weight->foodPos] / *(weight->output);
+									recipeSum * obs[weight->foodPos] / Xobs[weight->output];
 							weight++;
 						}
 					}
@@ -6145,8 +9419,8 @@ void flushRecipe() {
 }
 
 
-/* this is for the foodCalc() XoutputFun */
-void outputRecipe(Num* obs, int no) {
+/* this is for the foodCalc() ctx->outputFun */
+void outputRecipe(FoodCalcContext* ctx, Num* obs, int no) {
 	int key = (int)obs[XrecipeIdOutput];
 	Num* table;
 
@@ -6154,9 +9428,10 @@ void outputRecipe(Num* obs, int no) {
 		flushRecipe();
 		XrecipeId = key;
 		if (!keepIngredients) {
-			XrecipeEntry = allocStruct(RecipeEntry);
+			XrecipeEntry = arenaStruct(&foodArena,RecipeEntry);
 			XrecipeEntry->next = NULL;
-			XrecipeEntry->obs = allocarray(foodTableFields.no,sizeof(Num));
+			XrecipeEntry->sparse = NULL;
+			XrecipeEntry->obs = arenaArray(&foodArena,foodTableFields.no,sizeof(Num));
 		} else {
 			XrecipeEntry = NULL;
 		}
@@ -6174,10 +9449,11 @@ void outputRecipe(Num* obs, int no) {
 	}
 
 	if (keepIngredients) {
-		RecipeEntry* recipe = allocStruct(RecipeEntry);
+		RecipeEntry* recipe = arenaStruct(&foodArena,RecipeEntry);
 		recipe->next = XrecipeEntry;
+		recipe->sparse = NULL;
 		XrecipeEntry = recipe;
-		recipe->obs = table = allocarray(foodTableFields.no,sizeof(Num));
+		recipe->obs = table = arenaArray(&foodArena,foodTableFields.no,sizeof(Num));
 	} else {
 		table = XrecipeEntry->obs;
 	}
@@ -6208,8 +9484,9 @@ void outputRecipe(Num* obs, int no) {
 void readRecipes() {
 
 	RecipesFile* recipesFile = recipesFiles.first;
+	FoodCalcPlan* plan = allocarray(1,sizeof(FoodCalcPlan));
 
-	setFoodCalcPos(1);
+	setFoodCalcPos(plan,1);
 	
 	while (recipesFile) {
 
@@ -6218,9 +9495,11 @@ void readRecipes() {
 		int pMove1 = XrecipeNoMove1 = 0;
 		int pNutri = XrecipeNoNutri = 0;
 		int pMove2 = XrecipeNoMove2 = 0;
-		int pReduct = XrecipeNoReduct = 0;
+		FoodCalcContext* ctx;
+		Timing* timing = startTiming(recipesFile->file->name,1);
 
-		setRecipesPos(recipesFile);
+		XrecipeNoReduct = 0;
+		setRecipesPos(plan,recipesFile);
 
 		XrecipeNoSum += 2; /* recipe sum and amount */
 
@@ -6268,8 +9547,8 @@ void readRecipes() {
 		XrecipeMove1Recipe = alloc(XrecipeNoMove1*sizeof(int));
 		XrecipeNutriOutput = alloc(XrecipeNoNutri*sizeof(int));
 		XrecipeNutriTable = alloc(XrecipeNoNutri*sizeof(int));
-		XrecipeMove2Output = alloc(XrecipeNoMove1*sizeof(int));
-		XrecipeMove2Table = alloc(XrecipeNoMove1*sizeof(int));
+		XrecipeMove2Output = alloc(XrecipeNoMove2*sizeof(int));
+		XrecipeMove2Table = alloc(XrecipeNoMove2*sizeof(int));
 		XrecipeReduct = alloc(XrecipeNoReduct*sizeof(XRecipeReduct));
 
 		{ /* set recipe id, recipe sum and amount positions */
@@ -6344,20 +9623,22 @@ void readRecipes() {
 			}
 		}
 
-		XinputFun = &readNumLine;
-		XoutputFun = &outputRecipe;
-		Xflush = &flushRecipe;
+		ctx = newFoodCalcContext(plan);
+		ctx->inputFun = &readNumLine;
+		ctx->input = recipesFile->file;
+		ctx->outputFun = &outputRecipe;
+		ctx->flush = &flushRecipe;
 		noOutputRecipes = 0;
 		XrecipeId = 0;
-		setCurrent(recipesFile->file);
-		foodCalc();
+		foodCalc(ctx);
 		flushRecipe();
+		endTiming(timing,currentBytes(),ctx->noInputLines);
 
 		{	/* log what we did */
 			int lineLen = 0;
 			Field* field = recipesFile->fields->first;
 			logmsg("Read recipes file %s. Recipes: %d. Ingredients: %d. Fields:\n",
-				currentFileName,noOutputRecipes,noInputLines);
+				currentFileName,noOutputRecipes,ctx->noInputLines);
 			while (field) {
 				lineLen += strlen(field->name)+1;
 				if (lineLen > 78) {logmsg("\n"); lineLen = strlen(field->name)+1;}
@@ -6368,6 +9649,7 @@ void readRecipes() {
 		}
 
 		closeCurrent();
+		freeFoodCalcContext(ctx);
 		recipesFile = recipesFile->next;
 	}
 }
@@ -6379,182 +9661,424 @@ void readRecipes() {
      read a saved state back into FoodCalc (for the -s option to FoodCalc). */
 
 
+/* the save file is one image: the program state with offsets instead of pointers,
+   then the rows of the food table in one aligned block, and at the end an eof
+   marker and a checksum of all the rest. get() maps the image into memory
+   read-only (or reads it in one go where mmap() is not available), and the food
+   table points directly into the block of rows in the image. */
+
 FILE* saveFile;			/* the save file */
 int saveFileIntBuf;		/* work buffer used by the macros an functions below */
-
-#define getIntP(i) fread((i),sizeof(int),1,saveFile)
+long savePos;			/* no of bytes written to the save file */
+unsigned long saveSumA, saveSumB;	/* the running checksum of the save file */
+char* getFileName;		/* name of the file with the image read by the get macros */
+char* getImage;			/* the image read by get() */
+long getImageSize;		/* size of the image */
+char* getImageEnd;		/* end of the part of the image not yet checked */
+char* getP;				/* current position in the image */
+
+/* add n bytes to the running checksum (adler-32) */
+void saveChecksum(unsigned char* p, long n) {
+	unsigned long a = saveSumA, b = saveSumB;
+	while (n > 0) {
+		long m = n < 5552 ? n : 5552;
+		n -= m;
+		while (m--) {a += *p++; b += a;}
+		a %= 65521; b %= 65521;
+	}
+	saveSumA = a; saveSumB = b;
+}
+
+void saveBytes(void* p, int n) {
+	fwrite(p,1,n,saveFile);
+	saveChecksum(p,n);
+	savePos += n;
+}
+
+void getBytes(void* p, int n) {
+	if (n < 0 || n > getImageEnd - getP)
+		abortAndExit("Error reading %s.\n",getFileName);
+	memcpy(p,getP,n);
+	getP += n;
+}
+
+char* getStrP_() {
+	char* s;
+	getBytes(&saveFileIntBuf,sizeof(int));
+	if (saveFileIntBuf < 0 || saveFileIntBuf > getImageEnd - getP)
+		abortAndExit("Error reading %s.\n",getFileName);
+	s = alloc(saveFileIntBuf+1);
+	getBytes(s,saveFileIntBuf);
+	s[saveFileIntBuf] = '\0';
+	return(s);
+}
+
+#define getIntP(i) getBytes((i),sizeof(int))
 #define getI1(i1) getIntP(&(i1))
 #define getI2(i1,i2) (getIntP(&(i1)),getIntP(&(i2)))
 #define getI3(i1,i2,i3) (getIntP(&(i1)),getIntP(&(i2)),getIntP(&(i3)))
-#define getIA(ia,n) fread((ia) = alloc(sizeof(int)*(n)),sizeof(int),(n),saveFile)
+#define getIA(ia,n) getBytes((ia) = alloc(sizeof(int)*(n)),sizeof(int)*(n))
 #define getInt() (getI1(saveFileIntBuf), saveFileIntBuf)
-#define getNumP(n) fread((n),sizeof(Num),1,saveFile)
+#define getNumP(n) getBytes((n),sizeof(Num))
 #define getN1(n1) getNumP(&(n1))
 #define getN2(n1,n2) (getNumP(&(n1)),getNumP(&(n2)))
 #define getNP(np,base) ((np) = (base) + getInt())
-#define getNA(na,n) fread((na) = alloc(sizeof(Num)*(n)),sizeof(Num),(n),saveFile)
-void getNPA_(Num** npa, int n, Num* base) {while (n--) *npa++ = base + getInt();}
-#define getNPA(npa,n,base) getNPA_((npa) = alloc(sizeof(Num*)*(n)),(n),(base))
-#define getStrP(s) (getInt(), fread((s) = alloc(saveFileIntBuf+1),saveFileIntBuf,1,saveFile), *((s)+saveFileIntBuf) = '\0')
-#define getC(c) fread(&(c),sizeof(char),1,saveFile)
+#define getStrP(s) ((s) = getStrP_())
+#define getC(c) getBytes(&(c),sizeof(char))
 
-#define saveIntP(i) fwrite((i),sizeof(int),1,saveFile)
+#define saveIntP(i) saveBytes((i),sizeof(int))
 #define saveI1(i1) saveIntP(&(i1))
 #define saveI2(i1,i2) (saveIntP(&(i1)),saveIntP(&(i2)))
 #define saveI3(i1,i2,i3) (saveIntP(&(i1)),saveIntP(&(i2)),saveIntP(&(i3)))
-#define saveIA(ia,n) fwrite((ia),sizeof(int),n,saveFile)
+#define saveIA(ia,n) saveBytes((ia),sizeof(int)*(n))
 #define saveInt(i) (saveFileIntBuf = (i), saveI1(saveFileIntBuf))
-#define saveNumP(n) fwrite((n),sizeof(Num),1,saveFile)
+#define saveNumP(n) saveBytes((n),sizeof(Num))
 #define saveN1(n1) saveNumP(&(n1))
 #define saveN2(n1,n2) (saveNumP(&(n1)),saveNumP(&(n2)))
-#define saveNA(na,n) fwrite((na),sizeof(Num),(n),saveFile)
+#define saveNA(na,n) saveBytes((na),sizeof(Num)*(n))
 #define saveNP(np,base) saveInt((np) - (base))
-void saveNPA(Num** npa, int n, Num* base) {while (n--) saveInt(*npa++ - base);}
-#define saveStrP(s) (saveInt(strlen(s)), fwrite((s),saveFileIntBuf,1,saveFile))
-#define saveC(c) fwrite(&(c),sizeof(char),1,saveFile)
-
+#define saveStrP(s) (saveInt(strlen(s)), saveBytes((s),saveFileIntBuf))
+#define saveC(c) saveBytes(&(c),sizeof(char))
+
+/* the block of food table rows starts at a multiple of this in the image */
+#define saveRowAlign sizeof(double)
+
+
+/* open the image in the file name for reading with the get macros. returns 0 if the
+   file could not be opened or read */
+int getOpen(char* name) {
+	long size;
+#if defined(HAVE_POSIX)
+	int fd;
+	struct stat st;
+	if ((fd = open(name,O_RDONLY)) < 0) return(0);
+	if (fstat(fd,&st) != 0 || (size = st.st_size) <= 0 ||
+		(getImage = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0)) == MAP_FAILED) {
+		close(fd);
+		return(0);
+	}
+	close(fd);
+#else
+	FILE* file;
+	if (!(file = fopen(name,"rb"))) return(0);
+	fseek(file,0,SEEK_END);
+	size = ftell(file);
+	fseek(file,0,SEEK_SET);
+	getImage = alloc(size > 0 ? size : 1);
+	if (size <= 0 || fread(getImage,size,1,file) != 1) {
+		fclose(file);
+		free(getImage);
+		return(0);
+	}
+	fclose(file);
+#endif
+	getFileName = name;
+	getImageSize = size;
+	getP = getImage;
+	getImageEnd = getImage + size;
+	return(1);
+}
 
-/* saves the state of FoodCalc to the save file */
-void save() {
+/* release the image opened by getOpen() (only if nothing in it is used) */
+void getClose() {
+#if defined(HAVE_POSIX)
+	munmap(getImage,getImageSize);
+#else
+	free(getImage);
+#endif
+	getImage = NULL;
+}
 
-	if (!(saveFile = fopen(saveFileName,"wb")))
-		abortAndExit("Could not open save file %s.\n",saveFileName);
+/* check the checksum at the end of the image. returns 0 if it is wrong */
+int getChecksum() {
+	unsigned int sum;
+	if (getImageEnd - getP < (long)sizeof(sum)) return(0);
+	getImageEnd -= sizeof(sum);
+	memcpy(&sum,getImageEnd,sizeof(sum));
+	saveSumA = 1; saveSumB = 0;
+	saveChecksum((unsigned char*)getImage,getImageEnd-getImage);
+	return(sum == ((saveSumB << 16) | saveSumA));
+}
 
-	saveStrP(program); saveI2(programMajor,programMinor);
+/* write the eof marker and the checksum at the end of the save file */
+void saveEnd() {
+	unsigned int sum;
+	saveInt(12345); /* eof marker */
+	sum = (saveSumB << 16) | saveSumA;
+	fwrite(&sum,sizeof(sum),1,saveFile);
+}
 
-	saveI1(verbosity);
-	saveStrP(logFileName);
-	saveI1(inputFormat); saveStrP(inputFileName); 
-	saveC(inputSep); saveC(inputDecPoint);
-	saveI1(outputFormat); saveStrP(outputFileName);
-	saveC(outputSep); saveC(outputDecPoint);
+/* save the food table: an index with the key, type, no of rows and first row of
+   each food, and then all the rows in one block */
+void saveFoodTable() {
+	int noFields = foodTableFields.no;
+	int noFoods = 0, noRows = 0;
+	int pass;
+	char zero = 0;
 
-	saveI2(XnoOutput,XnoRealOutput);
-
-	saveI1(XnoInput);
-	saveIA(Xtext,XnoInput);
-	saveI2(Xstar,XnoInputMove);
-	saveNPA(XinputMove,XnoInputMove,Xline);
-	saveNPA(XoutputInput,XnoInputMove,Xobs);
-	saveI1(XnoInputGroupBy);
-	saveNPA(XinputGroupBy,XnoInputGroupBy,Xline);
-	saveIA(XgroupInputPos,XnoInputGroupBy);
-	saveNP(XinputFood,Xline);
-	saveNP(XinputAmount,Xline);
-	saveN1(XinputAmountScale);
-
-	saveI3(XnoNonEdible,XnonEdible,XnoNonEdibleFlag);
-	saveNP(XnonEdibleFlag,Xline);
-
-	saveI1(XnoInputCook);
-	saveNP(XinputCook,Xline);
-
-	saveI1(XnoCookTypes);
-	while (XnoCookTypes--) {
-		XCook* cook = XcookType->cook;
-		saveI1(XcookType->no);
-		while ((XcookType->no)--) {
-			saveI2(cook->foodPos,cook->noOutput);
-			saveNPA(cook->output,cook->noOutput,Xobs);
-			cook++;
-		}
-		XcookType++;
-	}
-
-	saveI1(XnoFoodGroupBy);
-	saveNPA(XoutputGroupBy,XnoFoodGroupBy,Xobs);
-	saveIA(XgroupFoodPos,XnoFoodGroupBy);
-
-	saveI1(XnoFoodMove);
-	saveIA(XfoodMovePos,XnoFoodMove);
-	saveNPA(XoutputFood,XnoFoodMove,Xobs);
-	saveI1(XnoFoodNutri);
-	saveIA(XfoodNutriPos,XnoFoodNutri);
-	saveNPA(XoutputNutri,XnoFoodNutri,Xobs);
-
-	saveI1(XnoReduct);
-	while (XnoReduct--) {
-		saveNP(Xreduct->input,Xline);
-		saveI1(Xreduct->noOutput);
-		saveNPA(Xreduct->output,Xreduct->noOutput,Xobs);
-		Xreduct++;
-	}
-	saveI2(XnoWeightReduct,XnoCalcWeightReduct);
-	while (XnoWeightReduct--) {
-		saveNP(XweightReduct->input,Xline);
-		saveNP(XweightReduct->output,Xobs);
-		XweightReduct++;
-	}
-
-	saveI2(XnoSet,XnoSet2);
-	while (XnoSet--) {
-		saveNP(Xset->output,Xobs);
-		saveI1(Xset->op);
-		if (Xset->op < cpyOpC) {saveNP(Xset->u.operan,Xobs);}
-		else {saveN1(Xset->u.num);}
-		Xset++;
-	}
-	saveI1(XnoGroupSet);
-	while (XnoGroupSet--) {
-		saveI2(XgroupSet->pos,XgroupSet->op);
-		if (XgroupSet->op < cpyOpC) {saveI1(XgroupSet->u.operan);}
-		else {saveN1(XgroupSet->u.num);}
-		XgroupSet++;
-	}
-
-	saveI1(XnoSimpleTest);
-	while (XnoSimpleTest--) {
-		saveI2(XsimpleTest->op,XsimpleTest->pos);
-		saveN1(XsimpleTest->num);
-		saveNP(XsimpleTest->action,XsimpleTest);
-		XsimpleTest++;
-	}
-	saveI1(XnoTest);
-	while (XnoTest--) {
-		saveI1(Xtest->op);
-		saveNP(Xtest->output1,Xobs);
-		saveNP(Xtest->output2,Xobs);
-		saveNP(Xtest->action,Xtest);
-		Xtest++;
-	}
-
-	saveI1(XnoTranspose);
-	while (XnoTranspose--) {
-		saveI3(Xtranspose->pos,Xtranspose->noGroups,Xtranspose->groupPos);
-		saveI1(Xtranspose->noOutput);
-		saveNPA(Xtranspose->output,Xtranspose->noOutput,Xobs);
-		Xtranspose++;
-	}
-
-	saveI1(XnoBlip);
-
-	saveI2(foodTableFields.no,totFoods);
-	{
+	for (pass = 0; pass < 3; pass++) {
 		HashIntEntry** p1 = foodTable->table;
 		int n = foodTable->size;
+		int row = 0;
+		if (pass == 1) saveI3(noFields,noFoods,noRows);
+		if (pass == 2) while (savePos % saveRowAlign) saveC(zero);
 		while (n--) {
 			HashIntEntry* p2 = *p1++;
 			while (p2) {
 				FoodEntry* foodEntry = p2->value;
-				saveI2(p2->key,foodEntry->foodType);
 				if (foodEntry->foodType != expandedRecipe) {
-					Num* obs = foodEntry->u.obs;
-					saveNA(obs,foodTableFields.no);
+					if (pass == 0) {noFoods++; noRows++;}
+					else if (pass == 1) {saveI2(p2->key,foodEntry->foodType); saveInt(1); saveI1(row);}
+					else saveNA(foodEntry->u.obs,noFields);
+					row++;
 				} else {
 					RecipeEntry* recipeEntry = foodEntry->u.recipe;
-					int n = 0;
-					while (recipeEntry) {n++; recipeEntry = recipeEntry->next;}
-					saveI1(n);
-					recipeEntry = foodEntry->u.recipe;
+					int m = 0;
 					while (recipeEntry) {
-						saveNA(recipeEntry->obs,foodTableFields.no);
+						if (pass == 2) saveNA(recipeEntry->obs,noFields);
+						m++;
 						recipeEntry = recipeEntry->next;
 					}
+					if (pass == 0) {noFoods++; noRows += m;}
+					else if (pass == 1) {saveI2(p2->key,foodEntry->foodType); saveI2(m,row);}
+					row += m;
 				}
 				p2 = p2->next;
 			}
 		}
 	}
+}
+
+/* read the food table saved by saveFoodTable(). the rows are used where they are in
+   the image */
+void getFoodTable() {
+	int noFields, noFoods, noRows;
+	FoodEntry* foodEntry;
+	RecipeEntry* recipeEntry;
+	Num* rows;
+
+	getI3(noFields,noFoods,noRows);
+	if (noFields < 0 || noFoods < 0 || noRows < 0 ||
+		(getImageEnd - getP) / (4*sizeof(int)) < noFoods)
+		abortAndExit("Error reading %s.\n",getFileName);
+	foodTable = newHashInt(noFoods,"food table");
+	foodTable->arena = &foodArena;
+	{
+		long pos = (getP - getImage) + (long)noFoods*4*sizeof(int);
+		pos = (pos + saveRowAlign - 1) / saveRowAlign * saveRowAlign;
+		rows = (Num*)(getImage + pos);
+		if ((getImageEnd - (char*)rows) / sizeof(Num) / (noFields ? noFields : 1) < noRows)
+			abortAndExit("Error reading %s.\n",getFileName);
+	}
+	foodEntry = alloc((noFoods+1)*sizeof(FoodEntry));
+	recipeEntry = alloc((noRows+1)*sizeof(RecipeEntry));
+
+	while (noFoods--) {
+		int key, m, row;
+		getI2(key,foodEntry->foodType);
+		getI2(m,row);
+		if (m < 0 || row < 0 || row > noRows - m)
+			abortAndExit("Error reading %s.\n",getFileName);
+		foodEntry->no = noFoodEntries++;
+		foodEntry->sparse = NULL;
+		if (foodEntry->foodType != expandedRecipe) {
+			foodEntry->u.obs = rows + (long)row*noFields;
+		} else {
+			RecipeEntry** last = &(foodEntry->u.recipe);
+			while (m--) {
+				recipeEntry->obs = rows + (long)row++*noFields;
+				recipeEntry->sparse = NULL;
+				*last = recipeEntry;
+				last = &(recipeEntry++->next);
+			}
+			*last = NULL;
+		}
+		insertInt(foodTable,key,foodEntry++);
+	}
+	getP = (char*)(rows + (long)noRows*noFields);
+	foodTableFields.no = noFields;
+}
+
+
+/* save the codes in the order of their nos, so getCodes() gives them the same nos */
+void saveCodes() {
+	int no;
+	saveI1(noCodes);
+	for (no = 1; no <= noCodes; no++) saveStrP(codeName(no));
+}
+
+/* read the codes saved by saveCodes(). it must be done before any other codes are read */
+void getCodes() {
+	int n, no;
+	getI1(n);
+	if (n < 0 || noCodes) abortAndExit("Error reading %s.\n",getFileName);
+	for (no = 1; no <= n; no++) {
+		char* s;
+		getStrP(s);
+		if (codeNo(s) != no) abortAndExit("Error reading %s.\n",getFileName);
+		free(s);
+	}
+}
+
+
+/* saves the state of FoodCalc to the save file */
+void save() {
+
+	FoodCalcPlan* plan = inputPlan;
+
+	if (!(saveFile = fopen(saveFileName,"wb")))
+		abortAndExit("Could not open save file %s.\n",saveFileName);
+	savePos = 0; saveSumA = 1; saveSumB = 0;
+
+	saveStrP(program); saveI2(programMajor,programMinor);
+
+	saveI1(verbosity);
+	saveStrP(logFileName);
+	saveI1(inputFormat); saveStrP(inputFileName); 
+	saveC(inputSep); saveC(inputDecPoint);
+	saveI1(outputFormat); saveStrP(outputFileName);
+	saveC(outputSep); saveC(outputDecPoint);
+	saveInt(profileFileName != NULL);
+	if (profileFileName) saveStrP(profileFileName);
+	saveI1(progressSeconds);
+	saveInt(progressFileName != NULL);
+	if (progressFileName) saveStrP(progressFileName);
+
+	saveI2(plan->noOutput,plan->noRealOutput);
+
+	saveI1(plan->noInput);
+	saveIA(plan->text,plan->noInput);
+	saveI2(plan->star,plan->noInputMove);
+	saveIA(plan->inputMove,plan->noInputMove);
+	saveIA(plan->outputInput,plan->noInputMove);
+	saveI1(plan->noInputGroupBy);
+	saveIA(plan->inputGroupBy,plan->noInputGroupBy);
+	saveIA(plan->groupInputPos,plan->noInputGroupBy);
+	saveI2(plan->inputFood,plan->inputAmount);
+	saveN1(plan->inputAmountScale);
+
+	saveI3(plan->noNonEdible,plan->nonEdible,plan->noNonEdibleFlag);
+	saveI1(plan->nonEdibleFlag);
+
+	saveI2(plan->noInputCook,plan->inputCook);
+
+	{
+		int n = plan->noCookTypes;
+		XCookType* cookType = plan->cookType;
+		saveI1(plan->noCookTypes);
+		while (n--) {
+			int m = cookType->no;
+			XCook* cook = cookType->cook;
+			saveI1(cookType->no);
+			while (m--) {
+				saveI2(cook->foodPos,cook->noOutput);
+				saveIA(cook->output,cook->noOutput);
+				cook++;
+			}
+			cookType++;
+		}
+	}
+
+	saveI1(plan->noFoodGroupBy);
+	saveIA(plan->outputGroupBy,plan->noFoodGroupBy);
+	saveIA(plan->groupFoodPos,plan->noFoodGroupBy);
+
+	saveI1(plan->noFoodMove);
+	saveIA(plan->foodMovePos,plan->noFoodMove);
+	saveIA(plan->outputFood,plan->noFoodMove);
+	saveI1(plan->noFoodNutri);
+	saveIA(plan->foodNutriPos,plan->noFoodNutri);
+	saveIA(plan->outputNutri,plan->noFoodNutri);
+
+	{
+		int n = plan->noReduct;
+		XReduct* reduct = plan->reduct;
+		saveI1(plan->noReduct);
+		while (n--) {
+			saveI2(reduct->input,reduct->noOutput);
+			saveIA(reduct->output,reduct->noOutput);
+			reduct++;
+		}
+	}
+	{
+		int n = plan->noWeightReduct;
+		XWeightReduct* weightReduct = plan->weightReduct;
+		saveI2(plan->noWeightReduct,plan->noCalcWeightReduct);
+		while (n--) {
+			saveI2(weightReduct->input,weightReduct->output);
+			weightReduct++;
+		}
+	}
+
+	{
+		int n = plan->noSet;
+		XSet* set = plan->set;
+		saveI2(plan->noSet,plan->noSet2);
+		while (n--) {
+			saveI2(set->output,set->op);
+			if (set->op < cpyOpC) {saveI1(set->u.operan);}
+			else {saveN1(set->u.num);}
+			set++;
+		}
+	}
+	{
+		int n = plan->noGroupSet;
+		XGroupSet* groupSet = plan->groupSet;
+		saveI1(plan->noGroupSet);
+		while (n--) {
+			saveI2(groupSet->pos,groupSet->op);
+			if (groupSet->op < cpyOpC) {saveI1(groupSet->u.operan);}
+			else {saveN1(groupSet->u.num);}
+			groupSet++;
+		}
+	}
+
+	{	/* the actions are saved relative to the start of the tests */
+		int n = plan->noSimpleTest;
+		XSimpleTest* simpleTest = plan->simpleTest;
+		saveI1(plan->noSimpleTest);
+		while (n--) {
+			saveI2(simpleTest->op,simpleTest->pos);
+			saveN1(simpleTest->num);
+			saveNP(simpleTest->action,plan->simpleTest);
+			simpleTest++;
+		}
+	}
+	{
+		int n = plan->noTest;
+		XTest* test = plan->test;
+		saveI1(plan->noTest);
+		while (n--) {
+			saveI3(test->op,test->output1,test->output2);
+			saveNP(test->action,plan->test);
+			test++;
+		}
+	}
+	{
+		int n = plan->noInputTest;
+		XInputTest* inputTest = plan->inputTest;
+		saveI1(plan->noInputTest);
+		while (n--) {
+			saveI3(inputTest->op,inputTest->pos1,inputTest->pos2);
+			saveN1(inputTest->num);
+			saveNP(inputTest->action,plan->inputTest);
+			inputTest++;
+		}
+	}
+
+	{
+		int n = plan->noTranspose;
+		XTranspose* transpose = plan->transpose;
+		saveI1(plan->noTranspose);
+		while (n--) {
+			saveI3(transpose->pos,transpose->noGroups,transpose->groupPos);
+			saveI1(transpose->noOutput);
+			saveIA(transpose->output,transpose->noOutput);
+			transpose++;
+		}
+	}
+
+	saveI3(plan->noBlip,plan->lookAhead,plan->pipeline);
 
 	{
 		Field* field = inputFields.first;
@@ -6571,11 +10095,15 @@ void save() {
 		saveI1(n);
 		while (n--) {
 			saveStrP(fieldP->field->name);
+			saveI1(fieldP->field->code);
 			fieldP = fieldP->next;
 		}
 	}
 
-	saveInt(12345); /* eof marker */
+	saveCodes();
+	saveFoodTable();
+
+	saveEnd();
 
 	if (ferror(saveFile)) abortAndExit("Error writing save file %s.\n",saveFileName);
 	logmsg("Wrote the save file %s.\n\n",saveFileName);
@@ -6585,17 +10113,24 @@ void save() {
 
 /* read a saved state from a save file into FoodCalc */
 void get() {
+	FoodCalcPlan* plan;
 	int saveProgramVer;
-	char* dummy;
 	int dummyi;
 
-	if (!(saveFile = fopen(saveFileName,"rb")))
+	if (!getOpen(saveFileName))
 		abortAndExit("Could not open save file %s.\n",saveFileName);
 
 	{
 		char* saveProgram;
 		int saveProgramMajor, saveProgramMinor;
-		getStrP(saveProgram);
+		if (getImageEnd - getImage < (long)sizeof(int)) saveProgram = "";
+		else {
+			getI1(saveFileIntBuf);
+			getP = getImage;
+			if (saveFileIntBuf != (int)strlen(program))
+				saveProgram = "";
+			else getStrP(saveProgram);
+		}
 		if (strcmp(program,saveProgram) != 0)
 			abortAndExit("File %s is not a save file.\n",saveFileName);
 		getI2(saveProgramMajor,saveProgramMinor);
@@ -6603,44 +10138,47 @@ void get() {
 			abortAndExit("Save file %s is saved with a different version of FoodCalc.\n",
 				saveFileName);
 		saveProgramVer = saveProgramMajor*100+saveProgramMinor;
-		if (saveProgramVer < 103)
+		if (saveProgramVer < 104)
 			abortAndExit("Save file %s is saved with a different version of FoodCalc.\n",
 				saveFileName);
 	}
 
+	if (!getChecksum())
+		abortAndExit("Save file %s is damaged (bad checksum).\n",saveFileName);
+
 	if (verbosity) getI1(dummyi); else getI1(verbosity);
-	if (logFileName) getStrP(dummy); else getStrP(logFileName);
-	getI1(inputFormat); if (inputFileName) getStrP(dummy); else getStrP(inputFileName);
+	if (logFileName) getStrP_(); else getStrP(logFileName);
+	getI1(inputFormat); if (inputFileName) getStrP_(); else getStrP(inputFileName);
 	getC(inputSep); getC(inputDecPoint);
-	getI1(outputFormat); if (outputFileName) getStrP(dummy); else getStrP(outputFileName);
+	getI1(outputFormat); if (outputFileName) getStrP_(); else getStrP(outputFileName);
 	getC(outputSep); getC(outputDecPoint);
-
-	getI2(XnoOutput,XnoRealOutput);
-	Xobs = alloc(XnoOutput*sizeof(Num));
-
-	getI1(XnoInput);
-	getIA(Xtext,XnoInput);
-	Xline = alloc(XnoInput*sizeof(num));
-	getI2(Xstar,XnoInputMove);
-	getNPA(XinputMove,XnoInputMove,Xline);
-	getNPA(XoutputInput,XnoInputMove,Xobs);
-	getI1(XnoInputGroupBy);
-	getNPA(XinputGroupBy,XnoInputGroupBy,Xline);
-	getIA(XgroupInputPos,XnoInputGroupBy);
-	getNP(XinputFood,Xline);
-	getNP(XinputAmount,Xline);
-	getN1(XinputAmountScale);
-	getI3(XnoNonEdible,XnonEdible,XnoNonEdibleFlag);
-	getNP(XnonEdibleFlag,Xline);
-
-	getI1(XnoInputCook);
-	getNP(XinputCook,Xline);
+	if (getInt()) getStrP(profileFileName);
+	getI1(progressSeconds);
+	if (getInt()) getStrP(progressFileName);
+
+	plan = inputPlan = allocarray(1,sizeof(FoodCalcPlan));
+	getI2(plan->noOutput,plan->noRealOutput);
+
+	getI1(plan->noInput);
+	getIA(plan->text,plan->noInput);
+	getI2(plan->star,plan->noInputMove);
+	getIA(plan->inputMove,plan->noInputMove);
+	getIA(plan->outputInput,plan->noInputMove);
+	getI1(plan->noInputGroupBy);
+	getIA(plan->inputGroupBy,plan->noInputGroupBy);
+	getIA(plan->groupInputPos,plan->noInputGroupBy);
+	getI2(plan->inputFood,plan->inputAmount);
+	getN1(plan->inputAmountScale);
+	getI3(plan->noNonEdible,plan->nonEdible,plan->noNonEdibleFlag);
+	getI1(plan->nonEdibleFlag);
+
+	getI2(plan->noInputCook,plan->inputCook);
 
 	{
 		int n;
 		XCookType* cookType;
-		getI1(XnoCookTypes); n = XnoCookTypes;
-		cookType = XcookType = alloc(sizeof(XCookType)*XnoCookTypes);
+		getI1(plan->noCookTypes); n = plan->noCookTypes;
+		cookType = plan->cookType = alloc(sizeof(XCookType)*plan->noCookTypes);
 		while (n--) {
 			int m;
 			XCook* cook;
@@ -6648,44 +10186,45 @@ void get() {
 			cook = cookType->cook = alloc(sizeof(XCook)*cookType->no);
 			while (m--) {
 				getI2(cook->foodPos,cook->noOutput);
-				getNPA(cook->output,cook->noOutput,Xobs);
+				getIA(cook->output,cook->noOutput);
+				cook->noTestOutput = cook->noOutput;
 				cook++;
 			}
 			cookType++;
 		}
 	}
 
-	getI1(XnoFoodGroupBy);
-	getNPA(XoutputGroupBy,XnoFoodGroupBy,Xobs);
-	getIA(XgroupFoodPos,XnoFoodGroupBy);
+	getI1(plan->noFoodGroupBy);
+	getIA(plan->outputGroupBy,plan->noFoodGroupBy);
+	getIA(plan->groupFoodPos,plan->noFoodGroupBy);
 
-	getI1(XnoFoodMove);
-	getIA(XfoodMovePos,XnoFoodMove);
-	getNPA(XoutputFood,XnoFoodMove,Xobs);
-	getI1(XnoFoodNutri);
-	getIA(XfoodNutriPos,XnoFoodNutri);
-	getNPA(XoutputNutri,XnoFoodNutri,Xobs);
+	getI1(plan->noFoodMove);
+	getIA(plan->foodMovePos,plan->noFoodMove);
+	getIA(plan->outputFood,plan->noFoodMove);
+	getI1(plan->noFoodNutri);
+	getIA(plan->foodNutriPos,plan->noFoodNutri);
+	getIA(plan->outputNutri,plan->noFoodNutri);
+	plan->noTestNutri = plan->noFoodNutri;
 
 	{
 		int n;
 		XReduct* reduct;
-		getI1(XnoReduct); n = XnoReduct;
-		reduct = Xreduct = alloc(sizeof(XReduct)*XnoReduct);
+		getI1(plan->noReduct); n = plan->noReduct;
+		reduct = plan->reduct = alloc(sizeof(XReduct)*plan->noReduct);
 		while (n--) {
-			getNP(reduct->input,Xline);
-			getI1(reduct->noOutput);
-			getNPA(reduct->output,reduct->noOutput,Xobs);
+			getI2(reduct->input,reduct->noOutput);
+			getIA(reduct->output,reduct->noOutput);
+			reduct->noTestOutput = reduct->noOutput;
 			reduct++;
 		}
 	}
 	{
 		int n;
 		XWeightReduct* weightReduct;
-		getI2(XnoWeightReduct,XnoCalcWeightReduct); n = XnoWeightReduct;
-		weightReduct = XweightReduct = alloc(sizeof(XWeightReduct)*XnoWeightReduct);
+		getI2(plan->noWeightReduct,plan->noCalcWeightReduct); n = plan->noWeightReduct;
+		weightReduct = plan->weightReduct = alloc(sizeof(XWeightReduct)*plan->noWeightReduct);
 		while (n--) {
-			getNP(XweightReduct->input,Xline);
-			getNP(XweightReduct->output,Xobs);
+			getI2(weightReduct->input,weightReduct->output);
 			weightReduct++;
 		}
 	}
@@ -6693,12 +10232,12 @@ void get() {
 	{
 		int n;
 		XSet* set;
-		getI2(XnoSet,XnoSet2); n = XnoSet;
-		set = Xset = alloc(sizeof(XSet)*XnoSet);
+		getI2(plan->noSet,plan->noSet2); n = plan->noSet;
+		plan->noTestSet = plan->noSet;
+		set = plan->set = alloc(sizeof(XSet)*plan->noSet);
 		while (n--) {
-			getNP(set->output,Xobs);
-			getI1(set->op);
-			if (set->op < cpyOpC) {getNP(set->u.operan,Xobs);}
+			getI2(set->output,set->op);
+			if (set->op < cpyOpC) {getI1(set->u.operan);}
 			else {getN1(set->u.num);}
 			set++;
 		}
@@ -6706,8 +10245,8 @@ void get() {
 	{
 		int n;
 		XGroupSet* groupSet;
-		getI1(XnoGroupSet); n = XnoGroupSet;
-		groupSet = XgroupSet = alloc(sizeof(XGroupSet)*XnoGroupSet);
+		getI1(plan->noGroupSet); n = plan->noGroupSet;
+		groupSet = plan->groupSet = alloc(sizeof(XGroupSet)*plan->noGroupSet);
 		while (n--) {
 			getI2(groupSet->pos,groupSet->op);
 			if (groupSet->op < cpyOpC) {getI1(groupSet->u.operan);}
@@ -6719,73 +10258,56 @@ void get() {
 	{
 		int n;
 		XSimpleTest* simpleTest;
-		getI1(XnoSimpleTest); n = XnoSimpleTest;
-		simpleTest = XsimpleTest = alloc(sizeof(XSimpleTest)*XnoSimpleTest);
+		getI1(plan->noSimpleTest); n = plan->noSimpleTest;
+		simpleTest = plan->simpleTest = alloc(sizeof(XSimpleTest)*plan->noSimpleTest);
 		while (n--) {
 			getI2(simpleTest->op,simpleTest->pos);
 			getN1(simpleTest->num);
-			getNP(simpleTest->action,XsimpleTest);
+			getNP(simpleTest->action,plan->simpleTest);
 			simpleTest++;
 		}
 	}
 	{
 		int n;
 		XTest* test;
-		saveI1(XnoTest); n = XnoTest;
-		test = Xtest = alloc(sizeof(XTest)*XnoTest);
+		getI1(plan->noTest); n = plan->noTest;
+		test = plan->test = alloc(sizeof(XTest)*plan->noTest);
 		while (n--) {
-			getI1(test->op);
-			getNP(test->output1,Xobs);
-			getNP(test->output2,Xobs);
-			getNP(test->action,Xtest);
+			getI3(test->op,test->output1,test->output2);
+			getNP(test->action,plan->test);
 			test++;
 		}
 	}
+	{
+		int n;
+		XInputTest* inputTest;
+		getI1(plan->noInputTest); n = plan->noInputTest;
+		inputTest = plan->inputTest = alloc(sizeof(XInputTest)*plan->noInputTest);
+		while (n--) {
+			getI3(inputTest->op,inputTest->pos1,inputTest->pos2);
+			getN1(inputTest->num);
+			getNP(inputTest->action,plan->inputTest);
+			inputTest++;
+		}
+	}
 
 	{
 		int n;
 		XTranspose* transpose;
-		getI1(XnoTranspose); n = XnoTranspose;
-		transpose = Xtranspose = alloc(sizeof(XTranspose)*XnoTranspose);
+		getI1(plan->noTranspose); n = plan->noTranspose;
+		transpose = plan->transpose = alloc(sizeof(XTranspose)*plan->noTranspose);
 		while (n--) {
 			getI3(transpose->pos,transpose->noGroups,transpose->groupPos);
 			getI1(transpose->noOutput);
-			getNPA(transpose->output,transpose->noOutput,Xobs);
+			getIA(transpose->output,transpose->noOutput);
 			transpose++;
 		}
 	}
 
-	getI1(XnoBlip);
+	plan->lazyTest = 0;
+	if (plan->noTest && !plan->noWeightReduct) setLazyTestPos(plan);
 
-	{
-		int noFields;
-		int noFoods;
-
-		foodTable = newHashInt(3571);
-		getI2(noFields,noFoods);
-
-		while (noFoods--) {
-			FoodEntry* foodEntry = allocStruct(FoodEntry);
-			int key;
-			getI2(key,foodEntry->foodType);
-			if (foodEntry->foodType != expandedRecipe) {
-				Num** obs = &(foodEntry->u.obs);
-				getNA(*obs,noFields);
-			} else {
-				int n;
-				RecipeEntry* lastRecipeEntry = NULL;
-				getI1(n);
-				while (n--) {
-					RecipeEntry* recipeEntry = allocStruct(RecipeEntry);
-					getNA(recipeEntry->obs,noFields);
-					recipeEntry->next = lastRecipeEntry;
-					lastRecipeEntry = recipeEntry;
-				}
-				foodEntry->u.recipe = lastRecipeEntry;
-			}
-			insertInt(foodTable,key,foodEntry);
-		}
-	}
+	getI3(plan->noBlip,plan->lookAhead,plan->pipeline);
 
 	{
 		int n;
@@ -6804,107 +10326,736 @@ void get() {
 		nolink(outputFields);
 		while (n--) {
 			char* s;
+			Field* field;
 			getStrP(s);
-			link(outputFields,allocFieldP(allocField(s)))
+			field = allocField(s);
+			getI1(field->code);
+			link(outputFields,allocFieldP(field))
 		}
 		endlink(outputFields);
 	}
 
-	if (feof(saveFile) || ferror(saveFile) || getInt() != 12345)
+	getCodes();
+	getFoodTable();
+
+	if (getInt() != 12345 || getP != getImageEnd)
 		abortAndExit("Error reading save file %s.\n",saveFileName);
 	logmsg("Read the save file %s.\n\n",saveFileName);
-	fclose(saveFile);
 
 }
 
 
+/********************************************************************************/
+/*** The food cache. It is a file with the food table as it is after STEP 6, and a
+     key made from everything STEP 3 to 6 depend on: the contents of the foods,
+     groups and recipes files, their separators etc., the fields in the food table
+     and the commands (except those only used by STEP 7). If the key in the cache
+     is the key of this run, the food table is read from the cache and STEP 3 to 6
+     are skipped. Otherwise the food table is built as usual and then written to
+     the cache. */
+
+
+unsigned int cacheKey[2];	/* the key of this run */
+int cacheKeyInt;			/* work buffer used by the macros below */
+int cacheKeySet = 0;		/* one if cacheKey could be set */
+
+/* add n bytes to the key (a 32 bit FNV-1a hash and a 32 bit multiplicative hash) */
+void cacheHash(void* p, long n) {
+	unsigned char* c = p;
+	unsigned long h1 = cacheKey[0], h2 = cacheKey[1];
+	while (n--) {
+		h1 = ((h1 ^ *c) * 16777619UL) & 0xffffffffUL;
+		h2 = (h2 * 31 + *c++) & 0xffffffffUL;
+	}
+	cacheKey[0] = h1; cacheKey[1] = h2;
+}
+void cacheHashStr(char* s) {cacheHash(s,strlen(s)+1);}
+#define cacheHashInt(i) (cacheKeyInt = (i), cacheHash(&cacheKeyInt,sizeof(int)))
+
+/* add the contents and settings of a data file to the key. returns 0 if the file
+   could not be read */
+int cacheHashFile(File* file) {
+	FILE* f;
+	char* buf;
+	int n;
+	if (!(f = fopen(file->name,"rb"))) return(0);
+	buf = alloc(65536);
+	while ((n = fread(buf,1,65536,f)) > 0) cacheHash(buf,n);
+	n = ferror(f);
+	fclose(f);
+	free(buf);
+	cacheHash(&(file->separator),sizeof(char));
+	cacheHash(&(file->decimalPoint),sizeof(char));
+	cacheHash(&(file->comment),sizeof(char));
+	return(!n);
+}
+
+/* add a set: expression to the key */
+void cacheHashExp(Exp* e) {
+	ExpVal* v = e->first;
+	cacheHashInt(e->no);
+	while (v) {
+		cacheHashInt(v->neg); cacheHashInt(v->recip); cacheHashInt(v->type);
+		switch (v->type) {
+		case numVal: cacheHash(&(v->u.num),sizeof(Num)); break;
+		case fieldVal: cacheHashStr(v->u.name); break;
+		case expVal: cacheHashExp(v->u.exp); break;
+		}
+		v = v->next;
+	}
+}
 
-/*********************************************************************************/
-/*** STEP 7 */
-
-/* the readInput() functions is STEP 7. it reads the input, does all calculations etc.,
-   and writes the output. The meat of the work is done by the doIt() function. If the
-   save: command is used, the state is saved just before doIt() would have been called,
-   and FoodCalc then exits. If the -s options is used the saved state is read and then
-   doIt() is called. */
+/* set cacheKey for this run. returns 0 if it could not be set */
+int setCacheKey() {
+	/* commands only used in STEP 7 */
+	static char* step7Cmds[] = {"log","commands","verbosity","save","blip","prefetch",
+		"food profile","food cache","input","input fields","input *fields",
+		"input format","input scale","input where","output","output format",
+		"where","if","if not","rollup","summary output","pipeline","progress",NULL};
+	CmdDef** cmdDef;
+
+	cacheKey[0] = 2166136261UL; cacheKey[1] = 0;
+	cacheHashInt(sizeof(Num));
+
+	for (cmdDef = cmdDefs; *cmdDef; cmdDef++) {
+		char** skip = step7Cmds;
+		Cmd* cmd;
+		while (*skip && strcmp(*skip,(*cmdDef)->name) != 0) skip++;
+		if (*skip) continue;
+		cacheHashStr((*cmdDef)->name);
+		for (cmd = *((*cmdDef)->cmd); cmd; cmd = cmd->next) {
+			char** arg = cmd->args;
+			int k;
+			cacheHashInt(-1);
+			for (k = 0; k < (*cmdDef)->numArgs && *arg; k++) {
+				switch ((*cmdDef)->args[k]) {
+				case listArg: while (*arg) cacheHashStr(*arg++); break;
+				case setArg: cacheHashStr(*arg++); cacheHashExp((Exp*)*arg++); break;
+				case whereArg: return(0);
+				default: cacheHashStr(*arg++);
+				}
+			}
+		}
+	}
 
+	{	/* the output fields and group by: of the output blocks */
+		OutputBlockCmds* block = outputBlockCmds.first;
+		for (; block; block = block->next) {
+			char** arg;
+			cacheHashInt(-2);
+			if (block->outputFieldsCmd)
+				for (arg = block->outputFieldsCmd->args; *arg; arg++) cacheHashStr(*arg);
+			cacheHashInt(-1);
+			if (block->groupByCmd)
+				for (arg = block->groupByCmd->args; *arg; arg++) cacheHashStr(*arg);
+		}
+	}
 
-/* this is the meat of it all */
-void doIt() {
-	{ /* open input */
+	{	/* the fields in the food table */
+		FieldP* fieldP = foodTableFields.first;
+		while (fieldP) {
+			Field* field = fieldP->field;
+			cacheHashStr(field->name);
+			cacheHashInt(field->fromPos); cacheHashInt(field->toPos != 0);
+			cacheHashInt(field->noCalc); cacheHashInt(field->onlyRecipe);
+			cacheHashInt(field->text);
+			fieldP = fieldP->next;
+		}
+	}
+
+	{	/* the data files */
+		FoodsFile* foodsFile = foodsFiles.first;
+		GroupsFile* groupsFile = groupsFiles.first;
+		RecipesFile* recipesFile = recipesFiles.first;
+		for (; foodsFile; foodsFile = foodsFile->next) {
+			if (foodsFile->usda) {
+				if (!cacheHashFile(foodsFile->usda->foodDes) ||
+					!cacheHashFile(foodsFile->usda->nutData) ||
+					!cacheHashFile(foodsFile->usda->nutrDef)) return(0);
+			} else if (!cacheHashFile(foodsFile->file)) return(0);
+			if (foodsFile->longFoods) {
+				cacheHashInt(foodsFile->longFoods->foodCol);
+				cacheHashInt(foodsFile->longFoods->nutrCol);
+				cacheHashInt(foodsFile->longFoods->valueCol);
+			}
+			cacheHashInt(foodsFile->starFields);
+		}
+		for (; groupsFile; groupsFile = groupsFile->next) {
+			if (!cacheHashFile(groupsFile->file)) return(0);
+			cacheHashInt(groupsFile->starFields);
+		}
+		for (; recipesFile; recipesFile = recipesFile->next) {
+			if (!cacheHashFile(recipesFile->file)) return(0);
+			cacheHashInt(recipesFile->starFields);
+		}
+	}
+
+	return(cacheKeySet = 1);
+}
+
+/* read the food table from the food cache if the cache is for this run. returns 1 if
+   the food table was read */
+int readFoodCache() {
+	int len, major, minor;
+	unsigned int key[2];
+
+	if (!cacheFileName || !setCacheKey()) return(0);
+	if (!getOpen(cacheFileName)) return(0);
+	if (!getChecksum() || getImageEnd - getP < (long)sizeof(int)) {
+		getClose();
+		return(0);
+	}
+	getI1(len);
+	if (len != (int)strlen(program) || getImageEnd - getP < len + 5*(long)sizeof(int) ||
+		memcmp(getP,program,len) != 0) {
+		getClose();
+		return(0);
+	}
+	getP += len;
+	getI2(major,minor);
+	getI2(key[0],key[1]);
+	if (major != programMajor || minor != programMinor ||
+		key[0] != cacheKey[0] || key[1] != cacheKey[1]) {
+		logmsg("The food cache %s is out of date.\n\n",cacheFileName);
+		getClose();
+		return(0);
+	}
+
+	getI1(totFoods);
+	if (codeFieldsCmd) getCodes();
+	getFoodTable();
+	if (getInt() != 12345 || getP != getImageEnd)
+		abortAndExit("Error reading %s.\n",cacheFileName);
+	logmsg("Read the food table from the food cache %s. Foods: %d\n\n",
+		cacheFileName,totFoods);
+	return(1);
+}
+
+/* write the food table to the food cache. it is written to a temporary file that is
+   then renamed, so other runs never see a half written cache */
+void writeFoodCache() {
+	char* tmpName;
+
+	if (!cacheFileName || !cacheKeySet) return;
+	tmpName = alloc(strlen(cacheFileName)+30);
+#if defined(HAVE_POSIX)
+	sprintf(tmpName,"%s.%d.tmp",cacheFileName,(int)getpid());
+#else
+	sprintf(tmpName,"%s.tmp",cacheFileName);
+#endif
+	if (!(saveFile = fopen(tmpName,"wb"))) {
+		logmsg("Could not write the food cache %s.\n\n",cacheFileName);
+		free(tmpName);
+		return;
+	}
+	savePos = 0; saveSumA = 1; saveSumB = 0;
+
+	saveStrP(program); saveI2(programMajor,programMinor);
+	saveI2(cacheKey[0],cacheKey[1]);
+	saveI1(totFoods);
+	if (codeFieldsCmd) saveCodes();
+	saveFoodTable();
+	saveEnd();
+
+	if (ferror(saveFile) | fclose(saveFile)) {
+		remove(tmpName);
+		logmsg("Could not write the food cache %s.\n\n",cacheFileName);
+	} else {
+#if !defined(HAVE_POSIX)
+		remove(cacheFileName); /* rename() will not replace a file here */
+#endif
+		if (rename(tmpName,cacheFileName) != 0) {
+			remove(tmpName);
+			logmsg("Could not write the food cache %s.\n\n",cacheFileName);
+		} else {
+			logmsg("Wrote the food cache %s.\n\n",cacheFileName);
+		}
+	}
+	free(tmpName);
+}
+
+
+
+/*********************************************************************************/
+/*** STEP 7 */
+
+/* the readInput() functions is STEP 7. it reads the input, does all calculations etc.,
+   and writes the output. The meat of the work is done by the doIt() function. If the
+   save: command is used, the state is saved just before doIt() would have been called,
+   and FoodCalc then exits. If the -s options is used the saved state is read and then
+   doIt() is called. */
+
+
+/* utility function used by reorderFoodTable() to sort food entries with the most
+   used first. foods used the same no of times are kept in the old order */
+typedef struct {FoodEntry* foodEntry; int no;} FoodEntryNo;
+int* reorderUses; /* the no of uses of each food entry while reorderFoodTable() sorts */
+int compareFoodEntryNo(const void* p1, const void* p2) {
+	const FoodEntryNo* e1 = p1;
+	const FoodEntryNo* e2 = p2;
+	int used1 = reorderUses[e1->foodEntry->no], used2 = reorderUses[e2->foodEntry->no];
+	if (used1 != used2) return(used1 > used2 ? -1 : 1);
+	return(e1->no - e2->no);
+}
+
+/* lay out the rows of the food table again, so the rows of the most used foods are
+   together in memory in the order of use, and they are first in the hash chains.
+   uses is array[noFoodEntries] of the no of uses of each food entry. the old rows are
+   left where they are (in the food arena or the save file image) */
+void reorderFoodTable(int* uses) {
+	int noFields = foodTableFields.no;
+	int noEntries = 0, noRows = 0;
+	FoodEntryNo* entries;
+	Num* rows;
+
+	{	/* count entries and rows */
+		int n = foodTable->size;
+		HashIntEntry** p1 = foodTable->table;
+		while (n--) {
+			HashIntEntry* p2 = *p1++;
+			while (p2) {
+				FoodEntry* foodEntry = p2->value;
+				noEntries++;
+				if (foodEntry->foodType == expandedRecipe) {
+					RecipeEntry* recipeEntry = foodEntry->u.recipe;
+					while (recipeEntry) {noRows++; recipeEntry = recipeEntry->next;}
+				} else {
+					noRows++;
+				}
+				p2 = p2->next;
+			}
+		}
+	}
+
+	{	/* sort the chains of the hash and the entries */
+		int n = foodTable->size;
+		HashIntEntry** p1 = foodTable->table;
+		FoodEntryNo* e = entries = alloc((noEntries+1)*sizeof(FoodEntryNo));
+		while (n--) {
+			/* insertion sort of the chain - the chains are short */
+			HashIntEntry* sorted = NULL;
+			HashIntEntry* p2 = *p1;
+			while (p2) {
+				HashIntEntry* next = p2->next;
+				HashIntEntry** pp = &sorted;
+				while (*pp && uses[((FoodEntry*)(*pp)->value)->no] >=
+							  uses[((FoodEntry*)p2->value)->no])
+					pp = &(*pp)->next;
+				p2->next = *pp;
+				*pp = p2;
+				e->foodEntry = p2->value;
+				e->no = e-entries;
+				e++;
+				p2 = next;
+			}
+			*p1++ = sorted;
+		}
+		reorderUses = uses;
+		qsort(entries,noEntries,sizeof(FoodEntryNo),compareFoodEntryNo);
+	}
+
+	{	/* copy the rows to one array in the sorted order */
+		Num* row = rows = alloc((noRows+1)*noFields*sizeof(Num));
+		int i;
+		for (i = 0; i < noEntries; i++) {
+			FoodEntry* foodEntry = entries[i].foodEntry;
+			if (foodEntry->foodType == expandedRecipe) {
+				RecipeEntry* recipeEntry = foodEntry->u.recipe;
+				while (recipeEntry) {
+					memcpy(row,recipeEntry->obs,noFields*sizeof(Num));
+					recipeEntry->obs = row;
+					row += noFields;
+					recipeEntry = recipeEntry->next;
+				}
+			} else {
+				memcpy(row,foodEntry->u.obs,noFields*sizeof(Num));
+				foodEntry->u.obs = row;
+				row += noFields;
+			}
+		}
+	}
+	free(entries);
+}
+
+/* read the food profile file (if it exists) and reorder the food table by it. the
+   file has a line for each food used with the food id and the no of uses */
+void readProfile() {
+	FILE* file;
+	int noFoods = 0;
+	if ((file = fopen(profileFileName,"r"))) {
+		int key, used;
+		int* uses = allocarray(noFoodEntries+1,sizeof(int));
+		while (fscanf(file,"%d %d",&key,&used) == 2) {
+			FoodEntry* foodEntry;
+			if (key > 0 && (foodEntry = lookInt(foodTable,key))) {
+				uses[foodEntry->no] = used;
+				noFoods++;
+			}
+		}
+		fclose(file);
+		reorderFoodTable(uses);
+		free(uses);
+		logmsg("Read food profile %s. Foods: %d\n\n",profileFileName,noFoods);
+	}
+}
+
+/* write the no of uses of each food in the run to the food profile file */
+void writeProfile(FoodCalcContext* ctx) {
+	FILE* file;
+	int noFoods = 0;
+	if (!(file = fopen(profileFileName,"w"))) {
+		error("Could not open food profile file %s.\n",profileFileName);
+		return;
+	}
+	{
+		int n = foodTable->size;
+		HashIntEntry** p1 = foodTable->table;
+		while (n--) {
+			HashIntEntry* p2 = *p1++;
+			while (p2) {
+				FoodEntry* foodEntry = p2->value;
+				if (ctx->foodUses[foodEntry->no]) {
+					fprintf(file,"%d %d\n",p2->key[0],ctx->foodUses[foodEntry->no]);
+					noFoods++;
+				}
+				p2 = p2->next;
+			}
+		}
+	}
+	if (ferror(file)) error("Error writing food profile file %s.\n",profileFileName);
+	fclose(file);
+	logmsg("Wrote food profile %s. Foods: %d\n\n",profileFileName,noFoods);
+}
+
+
+/* utility function used by doIt() to open the output file of a context. fieldP is
+   the first of the fields to output. returns 0 if the file could not be opened */
+int openOutput(FoodCalcContext* ctx, char* fileName, FileFormat format, char sep,
+			   char decPoint, FieldP* fieldP) {
+	char* mode;
+	ctx->outputSep = sep;
+	ctx->outputDecPoint = decPoint;
+	if (format == formatBinNative) {
+		if (sizeof(Num) != sizeof(double)) {
+			ctx->output4buf = alloc(sizeof(double)*ctx->plan->noRealOutput);
+			ctx->outputFun = outputBinNative4;
+		} else {
+			ctx->outputFun = outputBinNative;
+		}
+		mode = "wb";
+	} else {
+		ctx->outputFun = (ctx->summary? &outputSummary : &outputLine);
+		mode = "w";
+	}
+	if (strcmp(fileName,"-") == 0) {
+		ctx->output = stdout;
+	} else if (!(ctx->output = fopen(fileName,mode))) {
+		error("Could not open file %s.\n",fileName);
+		return(0);
+	}
+	if (format != formatBinNative && !ctx->summary) {
+		/* the code fields are written as the names of the codes */
+		FieldP* codeP = fieldP;
+		int i;
+		for (i = 0; i < ctx->plan->noRealOutput; i++, codeP = codeP->next) {
+			if (codeP->field->code) {
+				if (!ctx->outputCode)
+					ctx->outputCode = allocarray(ctx->plan->noRealOutput,sizeof(int));
+				ctx->outputCode[i] = 1;
+			}
+		}
+	}
+	if (format == formatText && !ctx->summary) {
+		/* output header line */
+		int n = ctx->plan->noRealOutput;
+		while (n--) {
+			fputs(fieldP->field->name,ctx->output);
+			fieldP = fieldP->next;
+			if (n) fputc(sep,ctx->output);
+		}
+		fputc('\n',ctx->output);
+	}
+	return(1);
+}
+
+/* utility function used by doIt() to log what was written to an output file */
+void logOutput(FoodCalcContext* ctx, char* fileName, FieldP* fieldP) {
+	int lineLen = 0;
+	int n = ctx->plan->noRealOutput;
+	logmsg("Wrote output file %s. Lines: %d. Fields: %d\n",
+		fileName,ctx->noOutputObs,ctx->plan->noRealOutput);
+	while (n--) {
+		lineLen += strlen(fieldP->field->name)+1;
+		if (lineLen > 78) {logmsg("\n"); lineLen = strlen(fieldP->field->name)+1;}
+		logmsg("%s ",fieldP->field->name);
+		fieldP = fieldP->next;
+	}
+	logmsg("\n\n");
+}
+
+
+/* utility function used by doIt() to log the counters of the run */
+void logCounters(FoodCalcContext* ctx) {
+	FoodCalcCounters* count = ctx->count;
+	int i;
+	logmsg("Counters:\n");
+	logmsg("Food lookups: %ld. Not found: %ld. Hash chain steps: %ld (%.2f per lookup).\n",
+		count->lookups,count->misses,count->chainSteps,
+		count->lookups ? (double)count->chainSteps/count->lookups : 0.0);
+	logmsg("Recipe ingredients: %ld. Skipped by simple tests: %ld. Skipped by tests: %ld.\n",
+		count->ingredients,count->simpleSkips,count->testSkips);
+	if (ctx->plan->noCookTypes) {
+		logmsg("Cooked with cook id");
+		for (i = 0; i < ctx->plan->noCookTypes; i++)
+			logmsg(" %d: %ld%s",i+1,count->cooks[i],
+				i < ctx->plan->noCookTypes-1 ? "," : ".");
+		logmsg("\n");
+	}
+	logmsg("Cook factors and reductions skipped as zero: %ld.\n",count->zeroReducts);
+	logmsg("Groups: %ld. Recycled: %ld. Group hash chain steps: %ld.\n\n",
+		count->newGroups,count->recycledGroups,count->groupSteps);
+	if (verbosity >= 70) {
+		/* the chains of the group hash each time the groups were output */
+		long noChains = 0;
+		for (i = 0; i < 7; i++) noChains += count->groupChains[i];
+		if (noChains) {
+			logmsg("Group hash when the groups were output:\n");
+			logHashHeader();
+			logHashRow("group by",count->newGroups,noChains,count->groupChains,
+				count->maxGroupChain,(double)count->groupProbes);
+			logmsg("\n");
+		}
+	}
+}
+
+
+/* with the progress: command a thread writes a JSON line with the progress of the run
+   every progressSeconds: the lines read, the bytes read and the percent of the input
+   file (if it is a file), the lines per second since the last line and in all, the
+   lines output, and the estimated seconds left. the thread only reads the counters
+   of the run, so it costs nothing when the run does not write the progress. the
+   bytes read are the position of the input file descriptor, which is ahead of the
+   lines read by at most the buffer of the file. a last line with "done": true is
+   written when the input is read */
+#ifdef HAVE_PIPELINE
+typedef struct {
+	FoodCalcContext* ctx;	/* the run */
+	FILE* file;				/* the file the progress is written to */
+	int fd;					/* the file descriptor of the input file */
+	double size;			/* the size of the input file, or 0 if not known */
+	double start;			/* the time the run started */
+	double lastTime;		/* the time of the last progress line */
+	int lastLines;			/* the lines read at the last progress line */
+	int stop;				/* set when the thread should stop */
+	pthread_mutex_t mutex;	/* mutex and condition to wake the thread to stop */
+	pthread_cond_t cond;
+	pthread_t thread;
+} Progress;
+
+/* write a progress line */
+void writeProgress(Progress* progress, int done) {
+	double now = wallTime();
+	int lines = countGet(progress->ctx->noInputLines);
+	int outputs = countGet(progress->ctx->noOutputObs);
+	double elapsed = now - progress->start;
+	double bytes = -1;
+	if (progress->fd >= 0) {
+		off_t pos = lseek(progress->fd,0,SEEK_CUR);
+		if (pos >= 0) bytes = pos;
+	}
+	if (done && progress->size > 0) bytes = progress->size;
+	fprintf(progress->file,"{\"elapsed\": %.3f, \"lines\": %d",elapsed,lines);
+	if (bytes >= 0) {
+		fprintf(progress->file,", \"bytes\": %.0f",bytes);
+		if (progress->size > 0)
+			fprintf(progress->file,", \"size\": %.0f, \"percent\": %.1f",
+				progress->size,100.0*bytes/progress->size);
+	}
+	fprintf(progress->file,", \"linesPerSec\": %.0f, \"avgLinesPerSec\": %.0f",
+		now > progress->lastTime ? (lines - progress->lastLines)/(now - progress->lastTime) : 0.0,
+		elapsed > 0 ? lines/elapsed : 0.0);
+	fprintf(progress->file,", \"outputs\": %d",outputs);
+	if (done)
+		fprintf(progress->file,", \"eta\": 0");
+	else if (bytes > 0 && progress->size > 0)
+		fprintf(progress->file,", \"eta\": %.1f",
+			elapsed*(progress->size > bytes ? progress->size - bytes : 0)/bytes);
+	fprintf(progress->file,", \"done\": %s}\n",done ? "true" : "false");
+	fflush(progress->file);
+	progress->lastTime = now;
+	progress->lastLines = lines;
+}
+
+/* the progress thread. it writes a progress line every progressSeconds until it
+   is stopped */
+void* progressThread(void* arg) {
+	Progress* progress = arg;
+	pthread_mutex_lock(&progress->mutex);
+	while (!progress->stop) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME,&t);
+		t.tv_sec += progressSeconds;
+		if (pthread_cond_timedwait(&progress->cond,&progress->mutex,&t) && !progress->stop)
+			writeProgress(progress,0);
+	}
+	pthread_mutex_unlock(&progress->mutex);
+	return(NULL);
+}
+
+/* start the progress thread for the run, if progress: is used. the input of the run
+   must be open. returns NULL if no progress is written */
+Progress* startProgress(FoodCalcContext* ctx) {
+	Progress* progress;
+	FILE* file;
+	struct stat st;
+	char* p = progressFileName;
+	if (!progressFileName || serverSocketName) return(NULL);
+	while (*p >= '0' && *p <= '9') p++;
+	if (!*p) file = fdopen(atoi(progressFileName),"w");
+	else file = fopen(progressFileName,"w");
+	if (!file) {
+		warning("Could not open progress file %s.\n",progressFileName);
+		return(NULL);
+	}
+	progress = allocarray(1,sizeof(Progress));
+	progress->ctx = ctx;
+	progress->file = file;
+	progress->fd = ctx->input ? fileno(ctx->input->file) : -1;
+	if (progress->fd >= 0 && !fstat(progress->fd,&st) && S_ISREG(st.st_mode))
+		progress->size = (double)st.st_size;
+	progress->start = progress->lastTime = wallTime();
+	pthread_mutex_init(&progress->mutex,NULL);
+	pthread_cond_init(&progress->cond,NULL);
+	if (pthread_create(&progress->thread,NULL,progressThread,progress)) {
+		warning("Could not start the progress thread.\n");
+		fclose(file);
+		free(progress);
+		return(NULL);
+	}
+	return(progress);
+}
+
+/* stop the progress thread and write the last progress line */
+void stopProgress(Progress* progress) {
+	if (!progress) return;
+	pthread_mutex_lock(&progress->mutex);
+	progress->stop = 1;
+	pthread_cond_signal(&progress->cond);
+	pthread_mutex_unlock(&progress->mutex);
+	pthread_join(progress->thread,NULL);
+	writeProgress(progress,1);
+	fclose(progress->file);
+	pthread_mutex_destroy(&progress->mutex);
+	pthread_cond_destroy(&progress->cond);
+	free(progress);
+}
+#else
+typedef void Progress;
+#define startProgress(ctx) NULL
+#define stopProgress(progress)
+#endif
+
+
+/* this is the meat of it all. it runs the plan of the input file, and returns the
+   context of the run or NULL if the input or output could not be opened. the output
+   file is left open */
+FoodCalcContext* doIt() {
+	FoodCalcPlan* plan = inputPlan;
+	FoodCalcContext* ctx = newFoodCalcContext(plan);
+	Timing* timing;
+	Progress* progress;
+
+	{ /* open input */
 		char* mode;
 		if (inputFormat == formatBinNative) {
 			if (sizeof(Num) != sizeof(double)) {
 				read4buf = alloc(sizeof(double)*inputFields.no);
-				XinputFun = &readNumBinNative4;
+				ctx->inputFun = &readNumBinNative4;
 			} else {
-				XinputFun = &readNumBinNative;
+				ctx->inputFun = &readNumBinNative;
 			}
 			inputFile = allocStruct(File);
 			mode = "rb";
 			if (!(inputFile->file = fopen(inputFileName,mode))) {
 				error("Could not open file %s.\n",inputFileName);
-				return;
+				freeFoodCalcContext(ctx);
+				return(NULL);
 			}
 			inputFile->name = inputFileName;
 			inputFile->type = inputFileT;
 			inputFile->lineNo = 1;
 		} else if (inputFormat != formatText) {
-			XinputFun = &readNumLine;
+			ctx->inputFun = &readNumLine;
 			mode = "r";
 			inputFile = allocStruct(File);
 			if (!initFile(inputFile,inputFileName,inputFileT,mode,
 				          inputSep,inputDecPoint,inputComment)) {
 				error("Could not open file %s.\n",inputFileName);
-				return;
+				freeFoodCalcContext(ctx);
+				return(NULL);
 			}
 		} else {
-			XinputFun = &readNumLine;
+			ctx->inputFun = &readNumLine;
 		}
-		setCurrent(inputFile);
+		ctx->input = inputFile;
 	}
 
-	{ /* open output */
-		char* mode;
-		if (outputFormat == formatBinNative) {
-			if (sizeof(Num) != sizeof(double)) {
-				output4buf = alloc(sizeof(double)*outputFields.no);
-				XoutputFun = outputBinNative4;
-			} else {
-				XoutputFun = outputBinNative;
+	/* open output */
+	if (summaryOutput) ctx->summary = newSummary(plan->noRealOutput,summaryStratify);
+	if (!openOutput(ctx,outputFileName,outputFormat,outputSep,outputDecPoint,
+					outputFields.first)) {
+		freeFoodCalcContext(ctx);
+		return(NULL);
+	}
+	{	/* open the outputs of the output blocks */
+		OutputBlock* block = outputBlocks.first;
+		FoodCalcContext* bctx = ctx->block;
+		for (; block; block = block->next, bctx++) {
+			if (!openOutput(bctx,block->outputFileName,block->outputFormat,
+							block->outputSep,block->outputDecPoint,
+							block->outputFields.first)) {
+				freeFoodCalcContext(ctx);
+				return(NULL);
 			}
-			mode = "wb";
-		} else {
-			XoutputFun = &outputLine;
-			mode = "w";
-		}
-		if (strcmp(outputFileName,"-") == 0) {
-			output = stdout;
-		} else if (!(output = fopen(outputFileName,mode))) {
-			error("Could not open file %s.\n",outputFileName);
-			return;
 		}
-		if (outputFormat == formatText) {
-			/* output header line */
-			FieldP* fieldP = outputFields.first;
-			int n = XnoRealOutput;
-			while (n--) {
-				fputs(fieldP->field->name,output);
-				fieldP = fieldP->next;
-				if (n) fputc(outputSep,output);
+	}
+	{	/* open the outputs of the rollup levels */
+		Rollup* rollup = rollups.first;
+		FoodCalcContext* level = ctx->rollup;
+		for (; rollup; rollup = rollup->next, level++) {
+			if (!openOutput(level,rollup->outputFileName,outputFormat,outputSep,
+							outputDecPoint,rollup->outputFields.first)) {
+				freeFoodCalcContext(ctx);
+				return(NULL);
 			}
-			fputc('\n',output);
 		}
 	}
 
-	Xflush = NULL;
-	foodCalc();
+	/* the input step is timed from here, so it is not in the timings if a file could
+	   not be opened */
+	timing = startTiming("input",0);
+
+	if (profileFileName) {
+		readProfile();
+		ctx->foodUses = allocarray(noFoodEntries+1,sizeof(int));
+	}
+
+	progress = startProgress(ctx);
+	foodCalc(ctx);
+	stopProgress(progress);
+
+	if (profileFileName) writeProfile(ctx);
+
+	if (ctx->summary) writeSummary(ctx,outputFormat,outputFields.first);
+	endTiming(timing,currentBytes(),ctx->noInputLines);
 
 	{	/* log what we read */
 		int lineLen = 0;
 		Field* field = inputFields.first;
 		logmsg("Read input file %s. Lines: %d. Fields: %d\n",
-			currentFileName,noInputLines,inputFields.no);
+			currentFileName,ctx->noInputLines,inputFields.no);
+		if (plan->noInputTest)
+			logmsg("Skipped %d lines by input where:.\n",ctx->noSkipInputLines);
 		while (field) {
 			lineLen += strlen(field->name)+1;
 			if (lineLen > 78) {logmsg("\n"); lineLen = strlen(field->name)+1;}
@@ -6913,27 +11064,342 @@ void doIt() {
 		}
 		logmsg("\n\n");
 	}
-	{	/* log what we wrote */
-		int lineLen = 0;
-		FieldP* fieldP = outputFields.first;
-		int n = XnoRealOutput;
-		logmsg("Wrote output file %s. Lines: %d. Fields: %d\n",
-			outputFileName,noOutputObs,XnoRealOutput);
-		while (n--) {
-			lineLen += strlen(fieldP->field->name)+1;
-			if (lineLen > 78) {logmsg("\n"); lineLen = strlen(fieldP->field->name)+1;}
-			logmsg("%s ",fieldP->field->name);
-			fieldP = fieldP->next;
+	logCounters(ctx);
+	/* log what we wrote */
+	logOutput(ctx,outputFileName,outputFields.first);
+	{
+		OutputBlock* block = outputBlocks.first;
+		FoodCalcContext* bctx = ctx->block;
+		for (; block; block = block->next, bctx++) {
+			logOutput(bctx,block->outputFileName,block->outputFields.first);
+			if (bctx->output != stdout) fclose(bctx->output);
+		}
+	}
+	{
+		Rollup* rollup = rollups.first;
+		FoodCalcContext* level = ctx->rollup;
+		for (; rollup; rollup = rollup->next, level++) {
+			logOutput(level,rollup->outputFileName,rollup->outputFields.first);
+			if (level->output != stdout) fclose(level->output);
 		}
-		logmsg("\n\n");
 	}
 	
 	closeCurrent();
+	return(ctx);
 }
 
 
-/* this function is STEP 7 - se comments above */
-void readInput() {
+/* the serve() function is used instead of doIt() when FoodCalc is started with the -d
+   option. it waits for jobs on a unix socket. a job is a line with the names of the
+   input file, the output file and optionally a log file separated by tabs. each job is
+   done by doIt() in a new process, so all jobs share the food table and the compiled
+   calculations read-only, and up to serverWorkers jobs are done at the same time. when
+   a job is done, a line with the no of input lines, the no of output lines and the no
+   of errors is sent back. if the job could not be done, a line with "error" and the
+   reason is sent back instead. jobs done at the same time must have different output
+   and log files, and the food profile is only read when the server starts */
+#if defined(HAVE_POSIX)
+
+typedef struct {
+	pid_t pid;				/* the worker process of the job, or 0 if not used */
+	char* line;				/* the job line, which the input and output names are in */
+	char* inputFileName;
+	char* outputFileName;
+	char* logFileName;		/* the log of the job, in its own memory */
+} ServeJob;
+
+/* read a line from the socket into a new string. returns NULL on error */
+char* serveReadLine(int conn) {
+	char buf[1000];
+	int len = 0;
+	while (len < (int)sizeof(buf)-1 && read(conn,buf+len,1) == 1 && buf[len] != '\n')
+		len++;
+	if (len == (int)sizeof(buf)-1 || len == 0) return(NULL);
+	if (buf[len-1] == '\r') len--;
+	buf[len] = '\0';
+	return(allocStr(buf,len));
+}
+
+/* send a line with "error" and the message to the client. the message ends the line */
+void serveError(int conn, char* message) {
+	char reply[300];
+	int len;
+	sprintf(reply,"error %.250s",message);
+	len = strlen(reply);
+	while (len > 5 && (reply[len-1] == '\n' || reply[len-1] == ' ')) len--;
+	reply[len++] = '\n';
+	write(conn,reply,len);
+}
+
+/* read and check the line of a job. returns an error message, or NULL if the job can
+   be done. a job without a log file gets the name of the output file with .log added
+   as log, so the jobs do not write to the log of the server at the same time */
+char* serveReadJob(int conn, ServeJob* job) {
+	char* line = job->line = serveReadLine(conn);
+	char* p;
+	if (!line || !(p = strchr(line,'\t')) || p == line)
+		return("The job line was not understood.");
+	*p++ = '\0';
+	job->inputFileName = line;
+	job->outputFileName = p;
+	if ((p = strchr(p,'\t'))) {
+		*p++ = '\0';
+		job->logFileName = allocStr(p,strlen(p));
+	} else {
+		job->logFileName = alloc(strlen(job->outputFileName)+5);
+		sprintf(job->logFileName,"%s.log",job->outputFileName);
+	}
+	if (!*job->outputFileName || strcmp(job->outputFileName,"-") == 0)
+		return("The output file of a job must be a file.");
+	if (strcmp(job->outputFileName,job->logFileName) == 0)
+		return("The output file and the log file of a job must be different.");
+	return(NULL);
+}
+
+/* returns 1 if a running job writes the output or log file of the job */
+int serveUsed(ServeJob* job, ServeJob* jobs) {
+	int i;
+	for (i = 0; i < serverWorkers; i++) {
+		if (!jobs[i].pid) continue;
+		if (strcmp(job->outputFileName,jobs[i].outputFileName) == 0 ||
+			strcmp(job->outputFileName,jobs[i].logFileName) == 0 ||
+			strcmp(job->logFileName,jobs[i].outputFileName) == 0 ||
+			strcmp(job->logFileName,jobs[i].logFileName) == 0)
+			return(1);
+	}
+	return(0);
+}
+
+/* free the names of a job */
+void serveFreeJob(ServeJob* job) {
+	free(job->logFileName);
+	free(job->line);
+	memset(job,0,sizeof(ServeJob));
+}
+
+/* free the jobs of the workers that have ended. if wait is 1 it waits for a worker to
+   end. returns the no of workers that ended */
+int serveEnded(ServeJob* jobs, int wait) {
+	int n = 0, i;
+	pid_t pid;
+	while ((pid = waitpid(-1,NULL,(wait && !n) ? 0 : WNOHANG)) > 0) {
+		for (i = 0; i < serverWorkers; i++)
+			if (jobs[i].pid == pid) serveFreeJob(jobs+i);
+		n++;
+	}
+	return(n);
+}
+
+/* do a single job in a worker process */
+void serveJob(int conn, ServeJob* job) {
+	char reply[100];
+	FoodCalcContext* ctx;
+	jmp_buf jump;
+
+	inputFileName = job->inputFileName;
+	outputFileName = job->outputFileName;
+	if (!(logFile = fopen(job->logFileName,"w"))) {
+		serveError(conn,"Could not open the log file of the job.");
+		exit(1);
+	}
+	if (setjmp(jump)) {
+		/* the job was aborted */
+		serveError(conn,abortMessage);
+		close(conn);
+		exit(1);
+	}
+	abortJump = &jump;
+
+	if ((ctx = doIt())) {
+		fclose(ctx->output);
+		sprintf(reply,"%d %d %d\n",ctx->noInputLines,ctx->noOutputObs,errors);
+	} else {
+		sprintf(reply,"0 0 %d\n",errors);
+	}
+	abortJump = NULL;
+	fclose(logFile);
+	write(conn,reply,strlen(reply));
+	close(conn);
+	exit(errors ? 1 : 0);
+}
+
+void serve() {
+	int sock;
+	int noWorkers = 0;
+	struct sockaddr_un addr;
+	ServeJob* jobs;
+
+	signal(SIGPIPE,SIG_IGN);
+	if (serverWorkers < 1) serverWorkers = 1;
+	jobs = allocarray(serverWorkers,sizeof(ServeJob));
+	if (strlen(serverSocketName) >= sizeof(addr.sun_path))
+		abortAndExit("Socket name %s is too long.\n",serverSocketName);
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,serverSocketName);
+	unlink(serverSocketName);
+	if ((sock = socket(AF_UNIX,SOCK_STREAM,0)) < 0 ||
+		bind(sock,(struct sockaddr*)&addr,sizeof(addr)) != 0 || listen(sock,64) != 0)
+		abortAndExit("Could not create socket %s.\n",serverSocketName);
+
+	/* the food table is laid out by the food profile once for all jobs. the jobs do
+	   not write the profile, as they would all write the same file */
+	if (profileFileName) {
+		readProfile();
+		logmsg("The jobs do not write the food profile %s.\n\n",profileFileName);
+		profileFileName = NULL;
+	}
+	logmsg("Waiting for jobs on socket %s. Workers: %d\n\n",serverSocketName,serverWorkers);
+
+	while (1) {
+		int conn, i;
+		pid_t pid;
+		ServeJob job;
+		char* message;
+		struct timeval timeout;
+		noWorkers -= serveEnded(jobs,noWorkers >= serverWorkers);
+		if ((conn = accept(sock,NULL,NULL)) < 0) continue;
+		noWorkers -= serveEnded(jobs,0);
+
+		/* a client that does not send its job line in time is dropped */
+		timeout.tv_sec = 10;
+		timeout.tv_usec = 0;
+		setsockopt(conn,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+		memset(&job,0,sizeof(job));
+		if (!(message = serveReadJob(conn,&job))) {
+			/* a client often sends its next job as soon as it has the reply of the
+			   last, so a worker writing the same files is given a second to end */
+			for (i = 0; i < 100 && serveUsed(&job,jobs); i++) {
+				usleep(10000);
+				noWorkers -= serveEnded(jobs,0);
+			}
+			if (serveUsed(&job,jobs))
+				message = "The output or log file is used by another job.";
+		}
+		if (message) {
+			serveError(conn,message);
+			serveFreeJob(&job);
+			close(conn);
+			continue;
+		}
+
+		fflush(NULL); /* the workers should not write what is buffered here */
+		if ((pid = fork()) == 0) {
+			close(sock);
+			serveJob(conn,&job);
+		}
+		if (pid < 0) {
+			logmsg("Could not start a worker for a job.\n");
+			serveFreeJob(&job);
+		} else {
+			for (i = 0; i < serverWorkers && jobs[i].pid; i++) ;
+			if (i < serverWorkers) {
+				jobs[i] = job;
+				jobs[i].pid = pid;
+			} else serveFreeJob(&job);
+			noWorkers++;
+		}
+		close(conn);
+	}
+}
+
+#else
+
+void serve() {
+	abortAndExit("The -d option can not be used on this system.\n");
+}
+
+#endif
+
+
+/* the rows of a wide food table often have most of their nutrient fields zero. for
+   such a row foodCalcFood() only calculates the non-zero fields, from a sparse row with
+   the positions and values of the non-zero nutrient fields of the plan. the food table
+   keeps its full rows, as the other fields, the cook and transpose fields etc. are
+   still taken from them. sparseMinFields and sparseMaxPct are defined with
+   SparseNutri */
+
+/* utility function used by setSparseRows() to make the sparse row of a row, or return
+   NULL if the row has too many non-zero nutrient fields. a -0 is not zero here, as
+   the result of it has another sign */
+SparseNutri* sparseRow(FoodCalcPlan* plan, Num* row, long* noNonZero) {
+	int n = plan->noFoodNutri;
+	int* pfoodPos = plan->foodNutriPos;
+	int k = 0, i;
+	SparseNutri* sparse;
+	while (n--) {
+		Num num = row[*pfoodPos++];
+		if (num != (Num)0.0 || (Num)1.0/num < (Num)0.0) k++;
+	}
+	if (k*100 > plan->noFoodNutri*sparseMaxPct) return(NULL);
+	sparse = arenaArray(&foodArena,k+1,sizeof(SparseNutri));
+	for (i = 0, k = 0; i < plan->noFoodNutri; i++) {
+		Num num = row[plan->foodNutriPos[i]];
+		if (num != (Num)0.0 || (Num)1.0/num < (Num)0.0) {
+			sparse[k].pos = i;
+			sparse[k++].num = num;
+		}
+	}
+	sparse[k].pos = plan->noFoodNutri;
+	sparse[k].num = (Num)0.0;
+	*noNonZero += k;
+	plan->noSparse++;
+	return(sparse);
+}
+
+/* make the sparse rows of the food table for the plan. the groups only add the
+   non-zero fields of a sparse row if no set: calculation changes a nutrient field */
+void setSparseRows(FoodCalcPlan* plan) {
+	long noNonZero = 0;
+	int noRows = 0;
+	plan->noSparse = 0;
+	plan->sparseGroup = 0;
+	if (plan->noFoodNutri < sparseMinFields) return;
+	{	/* make the sparse rows */
+		int n = foodTable->size;
+		HashIntEntry** p1 = foodTable->table;
+		while (n--) {
+			HashIntEntry* p2 = *p1++;
+			while (p2) {
+				FoodEntry* foodEntry = p2->value;
+				if (foodEntry->foodType == expandedRecipe) {
+					RecipeEntry* recipeEntry = foodEntry->u.recipe;
+					while (recipeEntry) {
+						recipeEntry->sparse = sparseRow(plan,recipeEntry->obs,&noNonZero);
+						noRows++;
+						recipeEntry = recipeEntry->next;
+					}
+				} else {
+					foodEntry->sparse = sparseRow(plan,foodEntry->u.obs,&noNonZero);
+					noRows++;
+				}
+				p2 = p2->next;
+			}
+		}
+	}
+	if (plan->noSparse) {
+		int n = plan->noSet;
+		XSet* set = plan->set;
+		plan->sparseGroup = 1;
+		while (n--) {
+			int k = plan->noFoodNutri;
+			int* poutput = plan->outputNutri;
+			while (k--) if (*poutput++ == set->output) plan->sparseGroup = 0;
+			set++;
+		}
+	}
+	if (verbosity >= 70) {
+		logmsg("Sparse rows: %d of %d rows. Non-zero nutrient fields: %.1f of %d per sparse row.\n",
+			plan->noSparse,noRows,(plan->noSparse ? (double)noNonZero/plan->noSparse : 0.0),
+			plan->noFoodNutri);
+		if (plan->noSparse && !plan->sparseGroup)
+			logmsg("The groups add all nutrient fields, as a set: changes a nutrient field.\n");
+		logmsg("\n");
+	}
+}
+
+/* this function logs the food table and makes the plan for the input file */
+void setInputPlan() {
 
 	{	/* log about food table */
 		int lineLen = 0;
@@ -6948,11 +11414,30 @@ void readInput() {
 		logmsg("\n\n");
 	}
 
-	setFoodCalcPos(0);
-	setInputPos();
+	inputPlan = allocarray(1,sizeof(FoodCalcPlan));
+	setFoodCalcPos(inputPlan,0);
+	setInputPos(inputPlan);
+	setSparseRows(inputPlan);
+	logHashStats();
+	logArenas();
+}
+
+
+/* this function is STEP 7 - se comments above */
+void readInput() {
+	Timing* timing = startTiming("plan",0);
 
-	if (saveBin) save();
-	else doIt();
+	setInputPlan();
+	endTiming(timing,0,0);
+
+	if (saveBin) {
+		timing = startTiming("save",0);
+		save();
+		endTiming(timing,0,0);
+	} else if (serverSocketName) {
+		reportTimings();
+		serve();
+	} else doIt();
 
 }
 		
@@ -6962,11 +11447,197 @@ void readInput() {
 /**********************************************************************************/
 
 
-void main(int argc, char** argv) {
-	
+/* this function does STEP 1 to 6 for the main commands file (mainCommandsName) and
+   the other commands files in argv */
+void setup(char** argv) {
+
 	File commands;
 	Cmd* cmd;
+	Timing* timing;
+
+	/** STEP 1 **/
+	timing = startTiming("commands",0);
+	/* read the main commands file */
+	if (!initFile(&commands,mainCommandsName,commandFileT,"r",',','.',';'))
+		abortAndExit("Could not open commands file %s.\n",mainCommandsName);
+	readCommands(&commands);
+	/* read any other commands files specified as arguments to FoodCalc */
+	while (*argv) {
+		if (!initFile(&commands,*argv,commandFileT,"r",',','.',';'))
+			error("Could not open commands file %s.\n",*argv);
+		else
+			readCommands(&commands);
+		argv++;
+	}
+	/* read any commands files specified with the commands: command */
+	cmd = commandsCmd;
+	while (cmd && !errors) {
+		if (!initFile(&commands,*(cmd->args),commandFileT,"r",',','.',';'))
+			error("Could not open commands file %s.\n",*(cmd->args));
+		else
+			readCommands(&commands);
+		cmd = cmd->next;
+	}
+
+	if (errors) abortAndExit(""); 
+	logmsg("\n");
+	checkCommands(); 
+	if (errors) abortAndExit("");
+	endTiming(timing,0,0);
+
+	/* STEP 2 */
+	timing = startTiming("fields",0);
+	readFields(); 
+	if (errors) abortAndExit("");
+	endTiming(timing,0,0);
+
+	/* STEP 3 to 6 are skipped if the food table can be read from the food cache */
+	timing = startTiming("food cache",0);
+	if (readFoodCache()) {
+		endTiming(timing,0,0);
+	} else {
+		endTiming(timing,0,0);
 
+		/* STEP 3 */
+		timing = startTiming("groups",0);
+		stageFiles();
+		readGroups();
+		endTiming(timing,0,0);
+
+		/* STEP 4 */
+		timing = startTiming("foods",0);
+		readFoods();
+		if (errors) abortAndExit("");
+		endTiming(timing,0,0);
+
+		/* STEP 5 */
+		timing = startTiming("expand groups",0);
+		expandGroups();
+		if (errors) abortAndExit("");
+		endTiming(timing,0,0);
+
+		/* STEP 5.5 */
+		timing = startTiming("weight and cook change",0);
+		weightCookChange();
+		endTiming(timing,0,0);
+
+		/* STEP 6 */
+		if (recipesFiles.first) {
+			timing = startTiming("recipes",0);
+			readRecipes();
+			endTiming(timing,0,0);
+		}
+		if (errors) abortAndExit("");
+
+		timing = startTiming("write food cache",0);
+		writeFoodCache();
+		endTiming(timing,0,0);
+	}
+}
+
+
+/**********************************************************************************/
+/*** The library interface - see FoodCalc.h. A program that links with FoodCalc.c
+     compiled with FOODCALC_LIB calls these functions instead of main() */
+
+
+/* read the commands file and do STEP 1 to 6 and the plan of STEP 7 */
+int fcLoad(char* commandsFileName) {
+	jmp_buf jump;
+	char* argv[1];
+
+	if (setjmp(jump)) {abortJump = NULL; return(0);}
+	abortJump = &jump;
+	library = 1;
+	commandsHashInit();
+	mainCommandsName = commandsFileName;
+	argv[0] = NULL;
+	setup(argv);
+	if (errors) abortAndExit("");
+	setInputPlan();
+	inputPlan->noBlip = 0;
+	abortJump = NULL;
+	return(!errors);
+}
+
+
+/* the no and names of the input fields */
+int fcNoInputFields(void) {
+	return(inputFields.no);
+}
+
+char* fcInputField(int i) {
+	Field* field = inputFields.first;
+	if (i < 0 || i >= inputFields.no) return(NULL);
+	while (i--) field = field->next;
+	return(field->name);
+}
+
+
+/* the no and names of the output fields */
+int fcNoOutputFields(void) {
+	return(noRealOutputFields);
+}
+
+char* fcOutputField(int i) {
+	FieldP* fieldP = outputFields.first;
+	if (i < 0 || i >= noRealOutputFields) return(NULL);
+	while (i--) fieldP = fieldP->next;
+	return(fieldP->field->name);
+}
+
+
+/* open a new run of the input plan */
+FcRun* fcOpen(void (*rowFun)(void* arg, double* row, int no), void* arg) {
+	FoodCalcContext* ctx = newFoodCalcContext(inputPlan);
+	ctx->outputFun = &outputRow;
+	ctx->rowFun = rowFun;
+	ctx->rowArg = arg;
+	ctx->output4buf = alloc(sizeof(double)*inputPlan->noRealOutput);
+	foodCalcStart(ctx);
+	return(ctx);
+}
+
+
+/* calculate a row as if it was read from the input file */
+int fcPush(FcRun* ctx, double* row) {
+	jmp_buf jump;
+	int n = ctx->plan->noInput;
+	Num* line = ctx->line;
+
+	if (setjmp(jump)) {abortJump = NULL; return(0);}
+	abortJump = &jump;
+	errors = 0;
+	currentFileName = "(pushed rows)";
+	lineNo = ctx->noInputLines+1;
+	while (n--) *line++ = (Num)*row++;
+	if (foodCalcRead(ctx,ctx->line)) foodCalcLine(ctx,NULL);
+	abortJump = NULL;
+	return(!errors);
+}
+
+
+/* end the run */
+int fcClose(FcRun* ctx) {
+	jmp_buf jump;
+	int no;
+
+	if (!setjmp(jump)) {
+		abortJump = &jump;
+		foodCalcEnd(ctx);
+	}
+	abortJump = NULL;
+	no = ctx->noOutputObs;
+	freeFoodCalcContext(ctx);
+	return(no);
+}
+
+
+#if !defined(FOODCALC_LIB)
+
+void main(int argc, char** argv) {
+	
+	timingStart = wallTime();
 	argv++;
 	commandsHashInit();
 	mainCommandsName = "-";
@@ -6985,6 +11656,9 @@ void main(int argc, char** argv) {
 		case 'o': outputFileName = optionArg; break;
 		case 'l': logFileName = optionArg; break;
 		case 's': saveFileName = optionArg; break;
+		case 'd': serverSocketName = optionArg; break;
+		case 'j': serverWorkers = atoi(optionArg); break;
+		case 't': timingFileName = optionArg; break;
 		default: abortAndExit("Unknown option -%c\n",option);
 		}
 		++argv;
@@ -6993,9 +11667,19 @@ void main(int argc, char** argv) {
 	/* check first if we are called with -s. If we are, we do not have to do all
 	   the initial steps. */
 	if (saveFileName) {
+		Timing* timing;
 		if (*argv) abortAndExit("You can not specify commands files with -s.\n");
+		timing = startTiming("get",0);
 		get();
-		doIt();
+		setSparseRows(inputPlan);
+		endTiming(timing,0,0);
+		logHashStats();
+		logArenas();
+		if (serverSocketName) {
+			reportTimings();
+			serve();
+		} else doIt();
+		reportTimings();
 		if (errors) abortAndExit("");
 		exit(0);
 	}
@@ -7014,60 +11698,16 @@ void main(int argc, char** argv) {
 #endif
 	}
 	
-	/** STEP 1 **/
-	/* read the main commands file */
-	if (!initFile(&commands,mainCommandsName,commandFileT,"r",',','.',';'))
-		abortAndExit("Could not open commands file %s.\n",mainCommandsName);
-	readCommands(&commands);
-	/* read any other commands files specified as arguments to FoodCalc */
-	while (*argv) {
-		if (!initFile(&commands,*argv,commandFileT,"r",',','.',';'))
-			error("Could not open commands file %s.\n",*argv);
-		else
-			readCommands(&commands);
-		argv++;
-	}
-	/* read any commands files specified with the commands: command */
-	cmd = commandsCmd;
-	while (cmd && !errors) {
-		if (!initFile(&commands,*(cmd->args),commandFileT,"r",',','.',';'))
-			error("Could not open commands file %s.\n",*(cmd->args));
-		else
-			readCommands(&commands);
-		cmd = cmd->next;
-	}
-
-	if (errors) abortAndExit(""); 
-	logmsg("\n");
-	checkCommands(); 
-	if (errors) abortAndExit("");
-
-	/* STEP 2 */
-	readFields(); 
-	if (errors) abortAndExit("");
-
-	/* STEP 3 */
-	readGroups();
-
-	/* STEP 4 */
-	readFoods();
-	if (errors) abortAndExit("");
-
-	/* STEP 5 */
-	expandGroups();
-	if (errors) abortAndExit("");
-
-	/* STEP 5.5 */
-	weightCookChange();
-
-	/* STEP 6 */
-	if (recipesFiles.first) readRecipes();
-	if (errors) abortAndExit("");
+	/* STEP 1 to 6 */
+	setup(argv);
 
 	/* STEP 7 */
 	readInput();
+	reportTimings();
 	if (errors) abortAndExit("");
 
 	exit(0);
 }
 	
+
+#endif
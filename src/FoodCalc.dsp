@@ -87,5 +87,9 @@ LINK32=link.exe
 
 SOURCE=.\FoodCalc.c
 # End Source File
+# Begin Source File
+
+SOURCE=.\FoodCalc.h
+# End Source File
 # End Target
 # End Project
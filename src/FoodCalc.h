@@ -0,0 +1,56 @@
+/*
+  FoodCalc.h - the library interface of FoodCalc.
+
+  When FoodCalc.c is compiled with FOODCALC_LIB defined (as libfoodcalc.dsp does, or
+  "cc -c -DFOODCALC_LIB FoodCalc.c" on unix; add -fPIC to link it into a shared
+  library) there is no main(), and a program can instead use FoodCalc like this:
+
+	if (!fcLoad("study.fc")) ...the log says what went wrong...
+	run = fcOpen(&gotRow,myData);
+	for each input line: fcPush(run,values);
+	fcClose(run);
+
+  fcLoad() reads the commands files and the groups, foods and recipes files (or the
+  food cache) just as FoodCalc does before it reads the input file. The commands must
+  include an "input fields:" command, but the input and output files given with
+  "input:" and "output:" are not used; the input lines are pushed with fcPush() and
+  the output lines are given to the function given to fcOpen(). fcLoad() may only be
+  called once.
+
+  Each run is a calculation of the output from a list of input lines, like a run of
+  FoodCalc over an input file. More runs may be open at the same time, also in
+  different threads, and they all use the same food table and calculations.
+
+  The rows pushed must have a value for each input field, in the order of the
+  "input fields:" command (text fields are not used). The rows given to the row
+  function have a value for each output field, in the order of the "output fields:"
+  command. With "group by:" the rows of a group are given when the group is done, so
+  the last group is given by fcClose().
+
+  Errors are written to the log just as when running FoodCalc.
+*/
+
+#ifndef FOODCALC_H
+#define FOODCALC_H
+
+typedef struct FoodCalcContext_ FcRun;	/* a run */
+
+/* read the commands file and the food table. returns 1 if ok, 0 if errors */
+int fcLoad(char* commandsFileName);
+
+/* the no and names of the input and output fields after fcLoad() */
+int fcNoInputFields(void);
+char* fcInputField(int i);
+int fcNoOutputFields(void);
+char* fcOutputField(int i);
+
+/* open a new run. rowFun is called with arg for each output row */
+FcRun* fcOpen(void (*rowFun)(void* arg, double* row, int no), void* arg);
+
+/* push an input row to the run. returns 1 if ok, 0 if the row gave errors */
+int fcPush(FcRun* run, double* row);
+
+/* end the run (output the last group) and free it. returns no of rows output */
+int fcClose(FcRun* run);
+
+#endif